@@ -0,0 +1,524 @@
+/* bmplib - bmp-bench.c
+ *
+ * Copyright (c) 2024, Rupert Weber.
+ *
+ * This file is part of bmplib.
+ * bmplib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "bmplib.h"
+
+/* bmp-bench generates a synthetic image for each of the BMP flavours
+ * bmplib reads and writes, and measures bmpwrite_save_image(),
+ * bmpread_load_image(), and bmpread_load_line() for each of them and
+ * each number format. Only the public API is used, everything happens
+ * in memory (bmpwrite_new_mem() / bmpread_new_mem()).
+ *
+ * usage: bmp-bench [-s WIDTHxHEIGHT] [-t SECONDS] [-f FILTER] [-o DIR]
+ *
+ *   -s  image size, default 1920x1080
+ *   -t  minimum time per measurement, default 0.25. Each measurement
+ *       is repeated (at least 3 times) until that time is used up, and
+ *       the fastest run is reported.
+ *   -f  only run the cases whose name contains FILTER
+ *   -o  also save the generated BMPs as DIR/<case>.bmp
+ *
+ * MB/s refers to the image buffer (the input of bmpwrite_save_image(),
+ * the output of bmpread_load_image()), not to the size of the BMP.
+ */
+
+#define BENCH_TOPDOWN  0x01
+#define BENCH_64BIT    0x02
+#define BENCH_2BIT     0x04
+#define BENCH_HUFFMAN  0x08
+#define BENCH_RLE24    0x10
+#define BENCH_THREADS  0x20
+#define BENCH_STREAM   0x40
+
+struct Case {
+	const char *name;
+	int         channels;
+	int         bits;        /* bits per channel of the BMP_FORMAT_INT buffer */
+	int         ncolors;     /* > 0: indexed */
+	BMPRLETYPE  rle;
+	int         outbits[4];  /* for bmpwrite_set_output_bits(), all 0 = default */
+	unsigned    flags;
+};
+
+static const struct Case s_cases[] = {
+	{ "idx1",          1,  8,   2, BMP_RLE_NONE,     { 0 },            0 },
+	{ "idx2",          1,  8,   4, BMP_RLE_NONE,     { 0 },            BENCH_2BIT },
+	{ "idx4",          1,  8,  16, BMP_RLE_NONE,     { 0 },            0 },
+	{ "idx8",          1,  8, 256, BMP_RLE_NONE,     { 0 },            0 },
+	{ "idx8-topdown",  1,  8, 256, BMP_RLE_NONE,     { 0 },            BENCH_TOPDOWN },
+	{ "rle4",          1,  8,  16, BMP_RLE_AUTO,     { 0 },            0 },
+	{ "rle8",          1,  8, 256, BMP_RLE_RLE8,     { 0 },            0 },
+	{ "rle8-mt",       1,  8, 256, BMP_RLE_RLE8,     { 0 },            BENCH_THREADS },
+	{ "rle8-stream",   1,  8, 256, BMP_RLE_RLE8,     { 0 },            BENCH_STREAM },
+	{ "rle-smallest",  1,  8,  16, BMP_RLE_SMALLEST, { 0 },            0 },
+	{ "rle-fastest",   1,  8,  16, BMP_RLE_FASTEST,  { 0 },            0 },
+	{ "huffman",       1,  8,   2, BMP_RLE_AUTO,     { 0 },            BENCH_HUFFMAN },
+	{ "rle24",         3,  8,   0, BMP_RLE_AUTO,     { 0 },            BENCH_RLE24 },
+	{ "rgb16-565",     3,  8,   0, BMP_RLE_NONE,     { 5, 6, 5, 0 },   0 },
+	{ "rgba16-4444",   4,  8,   0, BMP_RLE_NONE,     { 4, 4, 4, 4 },   0 },
+	{ "rgb24",         3,  8,   0, BMP_RLE_NONE,     { 0 },            0 },
+	{ "rgb24-topdown", 3,  8,   0, BMP_RLE_NONE,     { 0 },            BENCH_TOPDOWN },
+	{ "rgb24-mt",      3,  8,   0, BMP_RLE_NONE,     { 0 },            BENCH_THREADS },
+	{ "rgba32",        4,  8,   0, BMP_RLE_NONE,     { 0 },            0 },
+	{ "bitfields-10",  4, 16,   0, BMP_RLE_NONE,     { 10, 10, 10, 2 }, 0 },
+	{ "rgba64",        4, 16,   0, BMP_RLE_NONE,     { 0 },            BENCH_64BIT },
+};
+
+static const struct {
+	BMPFORMAT   format;
+	const char *name;
+} s_formats[] = {
+	{ BMP_FORMAT_INT,   "int"   },
+	{ BMP_FORMAT_FLOAT, "float" },
+	{ BMP_FORMAT_S2_13, "s2.13" },
+};
+
+#define ARRAY_LEN(a) ((int) (sizeof a / sizeof a[0]))
+
+struct Job {
+	const struct Case *c;
+	BMPFORMAT          format;
+	int                bits;
+	int                width;
+	int                height;
+	const void        *image;
+	unsigned char     *bmp;
+	size_t             bmpsize;
+	unsigned char     *buffer;
+};
+
+typedef BMPRESULT (*benchfunc)(struct Job *job);
+
+static double    s_min_time = 0.25;
+
+static double    s_now(void);
+static double    s_measure(benchfunc func, struct Job *job);
+static void     *s_make_image(const struct Case *c, BMPFORMAT format, int bits, int width, int height, size_t *size);
+static BMPRESULT s_write(struct Job *job);
+static BMPRESULT s_read_image(struct Job *job);
+static BMPRESULT s_read_lines(struct Job *job);
+static void      s_report(const char *name, const char *op, const char *fmt, double secs, size_t bytes, int width,
+                          int height);
+static int       s_save_corpus(const char *dir, const char *name, const void *bmp, size_t size);
+
+
+int main(int argc, char *argv[])
+{
+	const char *filter = NULL, *outdir = NULL;
+	int         width = 1920, height = 1080;
+	int         i, n, f, err = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			if (2 != sscanf(argv[++i], "%dx%d", &width, &height) || width < 1 || height < 1)
+				goto usage;
+		} else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+			s_min_time = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+			filter = argv[++i];
+		} else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			outdir = argv[++i];
+		} else
+			goto usage;
+	}
+
+	printf("bmplib %s, %dx%d\n", bmp_version(), width, height);
+	printf("%-14s %-11s %-6s %10s %10s\n", "case", "op", "format", "MB/s", "Mpixels/s");
+
+	for (n = 0; n < ARRAY_LEN(s_cases); n++) {
+		const struct Case *c = &s_cases[n];
+		struct Job         job;
+		unsigned char     *intbmp = NULL;
+		size_t             imgsize, bufsize, intsize = 0;
+		double             secs;
+
+		if (filter && !strstr(c->name, filter))
+			continue;
+
+		memset(&job, 0, sizeof job);
+		job.c      = c;
+		job.width  = width;
+		job.height = height;
+
+		/* write, for each number format the writer takes for this case.
+		 * The BMP from the int run is kept for the read benchmarks.
+		 */
+		for (f = 0; f < ARRAY_LEN(s_formats); f++) {
+			if (f > 0 && (c->ncolors || (c->flags & BENCH_RLE24)))
+				break;
+
+			job.format = s_formats[f].format;
+			switch (job.format) {
+			case BMP_FORMAT_FLOAT: job.bits = 32; break;
+			case BMP_FORMAT_S2_13: job.bits = 16; break;
+			default:               job.bits = c->bits; break;
+			}
+			if (!(job.image = s_make_image(c, job.format, job.bits, width, height, &imgsize))) {
+				perror("bmp-bench");
+				return 1;
+			}
+
+			/* a first run to learn the BMP size, so the timed runs
+			 * don't measure the growing of the output buffer.
+			 */
+			job.bmp = NULL;
+			if (BMP_RESULT_OK == s_write(&job)) {
+				if (0 > (secs = s_measure(s_write, &job)))
+					err = 1;
+				else
+					s_report(c->name, "save_image", s_formats[f].name, secs, imgsize, width, height);
+			} else
+				err = 1;
+			free((void*) job.image);
+			job.image = NULL;
+
+			if (job.format != BMP_FORMAT_INT) {
+				free(job.bmp);
+			} else if (job.bmp) {
+				intbmp  = job.bmp;
+				intsize = job.bmpsize;
+				printf("%-14s %-11s %-6s %10.1f%%\n", c->name, "(filesize)", "",
+				       100.0 * (double) intsize / (double) imgsize);
+				if (outdir && s_save_corpus(outdir, c->name, intbmp, intsize))
+					err = 1;
+			}
+		}
+		if (!(job.bmp = intbmp))
+			continue;
+		job.bmpsize = intsize;
+
+		/* read the int BMP back in each number format */
+		for (f = 0; f < ARRAY_LEN(s_formats); f++) {
+			BMPHANDLE h;
+
+			job.format = s_formats[f].format;
+			h = bmpread_new_mem(job.bmp, job.bmpsize);
+			bmpread_set_insanity_limit(h, SIZE_MAX);
+			if (BMP_RESULT_OK != bmp_set_number_format(h, job.format) ||
+			    BMP_RESULT_OK != bmpread_load_info(h)) {
+				fprintf(stderr, "%s: %s\n", c->name, bmp_errmsg(h));
+				bmp_free(h);
+				err = 1;
+				continue;
+			}
+			bufsize = bmpread_buffersize(h);
+			bmp_free(h);
+
+			if (!(job.buffer = malloc(bufsize))) {
+				perror("bmp-bench");
+				return 1;
+			}
+
+			if (0 > (secs = s_measure(s_read_image, &job)))
+				err = 1;
+			else
+				s_report(c->name, "load_image", s_formats[f].name, secs, bufsize, width, height);
+
+			if (0 > (secs = s_measure(s_read_lines, &job)))
+				err = 1;
+			else
+				s_report(c->name, "load_line", s_formats[f].name, secs, bufsize, width, height);
+
+			free(job.buffer);
+			job.buffer = NULL;
+		}
+		free(job.bmp);
+	}
+
+	return err;
+
+usage:
+	fprintf(stderr, "usage: %s [-s WIDTHxHEIGHT] [-t SECONDS] [-f FILTER] [-o DIR]\n", argv[0]);
+	return 1;
+}
+
+
+
+/*****************************************************************************
+ * 	s_now
+ *****************************************************************************/
+
+static double s_now(void)
+{
+	struct timespec ts;
+
+	timespec_get(&ts, TIME_UTC);
+	return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+
+
+/*****************************************************************************
+ * 	s_measure
+ *
+ * returns the time of the fastest run in seconds or -1 on error
+ *****************************************************************************/
+
+static double s_measure(benchfunc func, struct Job *job)
+{
+	double start, t0, t, best = -1;
+	int    runs = 0;
+
+	start = s_now();
+	do {
+		t0 = s_now();
+		if (BMP_RESULT_OK != func(job))
+			return -1;
+		t = s_now() - t0;
+		if (best < 0 || t < best)
+			best = t;
+		runs++;
+	} while (runs < 3 || s_now() - start < s_min_time);
+
+	return best;
+}
+
+
+
+/*****************************************************************************
+ * 	s_make_image
+ *
+ * Blocks of constant color (so RLE has something to work with), every
+ * third band of 64 lines is noise instead.
+ *****************************************************************************/
+
+static void *s_make_image(const struct Case *c, BMPFORMAT format, int bits, int width, int height, size_t *size)
+{
+	unsigned char *image;
+	uint32_t       rnd = 12345;
+	size_t         i = 0;
+	double         v;
+	int            x, y, ch;
+
+	*size = (size_t) width * height * c->channels * bits / 8;
+	if (!(image = malloc(*size)))
+		return NULL;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			for (ch = 0; ch < c->channels; ch++, i++) {
+				if ((y / 64) % 3 == 2) {
+					rnd = rnd * 1103515245 + 12345;
+					v = (double) (rnd >> 16 & 0x7fff) / 0x7fff;
+				} else
+					v = ((x / 24 + y / 8 + ch * 3) % 8) / 7.0;
+
+				if (c->ncolors) {
+					image[i] = (unsigned char) (v * (c->ncolors - 1) + 0.5);
+					continue;
+				}
+				switch (format) {
+				case BMP_FORMAT_FLOAT:
+					((float*) image)[i] = (float) v;
+					break;
+				case BMP_FORMAT_S2_13:
+					((uint16_t*) image)[i] = (uint16_t) (v * 8192.0 + 0.5);
+					break;
+				default:
+					if (bits == 16)
+						((uint16_t*) image)[i] = (uint16_t) (v * 65535.0 + 0.5);
+					else
+						image[i] = (unsigned char) (v * 255.0 + 0.5);
+					break;
+				}
+			}
+		}
+	}
+	return image;
+}
+
+
+
+/*****************************************************************************
+ * 	s_write
+ *
+ * The first call for a job (job->bmp == NULL) lets bmplib allocate the
+ * output buffer, later calls reuse it.
+ *****************************************************************************/
+
+static BMPRESULT s_write(struct Job *job)
+{
+	const struct Case *c = job->c;
+	unsigned char      palette[256 * 4];
+	BMPHANDLE          h;
+	BMPRESULT          res;
+	void              *bmp;
+	size_t             size;
+	int                i;
+
+	h = bmpwrite_new_mem(job->bmp, job->bmp ? job->bmpsize : 0);
+	if (!h)
+		return BMP_RESULT_ERROR;
+
+	res = bmp_set_number_format(h, job->format);
+	if (res == BMP_RESULT_OK)
+		res = bmpwrite_set_dimensions(h, job->width, job->height, c->channels, job->bits);
+
+	if (res == BMP_RESULT_OK && c->ncolors) {
+		for (i = 0; i < c->ncolors; i++) {
+			palette[4*i + 0] = (unsigned char) (i * 255 / (c->ncolors - 1));
+			palette[4*i + 1] = (unsigned char) (255 - i * 255 / (c->ncolors - 1));
+			palette[4*i + 2] = (unsigned char) (i * 37);
+			palette[4*i + 3] = 0;
+		}
+		res = bmpwrite_set_palette(h, c->ncolors, palette);
+	}
+	if (res == BMP_RESULT_OK && c->rle != BMP_RLE_NONE)
+		res = bmpwrite_set_rle(h, c->rle);
+	if (res == BMP_RESULT_OK && c->outbits[0])
+		res = bmpwrite_set_output_bits(h, c->outbits[0], c->outbits[1], c->outbits[2], c->outbits[3]);
+	if (res == BMP_RESULT_OK && (c->flags & BENCH_TOPDOWN))
+		res = bmpwrite_set_orientation(h, BMP_ORIENT_TOPDOWN);
+	if (res == BMP_RESULT_OK && (c->flags & BENCH_64BIT))
+		res = bmpwrite_set_64bit(h);
+	if (res == BMP_RESULT_OK && (c->flags & BENCH_2BIT))
+		res = bmpwrite_allow_2bit(h);
+	if (res == BMP_RESULT_OK && (c->flags & BENCH_HUFFMAN))
+		res = bmpwrite_allow_huffman(h);
+	if (res == BMP_RESULT_OK && (c->flags & BENCH_RLE24))
+		res = bmpwrite_allow_rle24(h);
+	if (res == BMP_RESULT_OK && (c->flags & BENCH_THREADS))
+		res = bmpwrite_set_threads(h, 0);
+	if (res == BMP_RESULT_OK && (c->flags & BENCH_STREAM))
+		res = bmpwrite_set_streaming(h, 0);
+
+	if (res == BMP_RESULT_OK)
+		res = bmpwrite_save_image(h, job->image);
+	if (res == BMP_RESULT_OK)
+		res = bmpwrite_get_buffer(h, &bmp, &size);
+
+	if (res != BMP_RESULT_OK)
+		fprintf(stderr, "%s (%d bit): %s\n", c->name, job->bits, bmp_errmsg(h));
+	else if (!job->bmp) {
+		job->bmp     = bmp;
+		job->bmpsize = size;
+	}
+	bmp_free(h);
+	return res;
+}
+
+
+
+/*****************************************************************************
+ * 	s_read_image
+ *****************************************************************************/
+
+static BMPRESULT s_read_image(struct Job *job)
+{
+	BMPHANDLE h;
+	BMPRESULT res;
+
+	if (!(h = bmpread_new_mem(job->bmp, job->bmpsize)))
+		return BMP_RESULT_ERROR;
+
+	bmpread_set_insanity_limit(h, SIZE_MAX);
+	res = bmp_set_number_format(h, job->format);
+	if (res == BMP_RESULT_OK && (job->c->flags & BENCH_THREADS))
+		res = bmpread_set_threads(h, 0);
+	if (res == BMP_RESULT_OK)
+		res = bmpread_load_info(h);
+	if (res == BMP_RESULT_OK)
+		bmpread_buffersize(h);
+	if (res == BMP_RESULT_OK)
+		res = bmpread_load_image(h, &job->buffer);
+
+	if (res != BMP_RESULT_OK)
+		fprintf(stderr, "%s: %s\n", job->c->name, bmp_errmsg(h));
+	bmp_free(h);
+	return res;
+}
+
+
+
+/*****************************************************************************
+ * 	s_read_lines
+ *****************************************************************************/
+
+static BMPRESULT s_read_lines(struct Job *job)
+{
+	BMPHANDLE h;
+	BMPRESULT res;
+	int       y;
+
+	if (!(h = bmpread_new_mem(job->bmp, job->bmpsize)))
+		return BMP_RESULT_ERROR;
+
+	bmpread_set_insanity_limit(h, SIZE_MAX);
+	res = bmp_set_number_format(h, job->format);
+	if (res == BMP_RESULT_OK)
+		res = bmpread_load_info(h);
+	if (res == BMP_RESULT_OK)
+		bmpread_buffersize(h);
+	for (y = 0; res == BMP_RESULT_OK && y < job->height; y++)
+		res = bmpread_load_line(h, &job->buffer);
+
+	if (res != BMP_RESULT_OK)
+		fprintf(stderr, "%s: %s\n", job->c->name, bmp_errmsg(h));
+	bmp_free(h);
+	return res;
+}
+
+
+
+/*****************************************************************************
+ * 	s_report
+ *****************************************************************************/
+
+static void s_report(const char *name, const char *op, const char *fmt, double secs, size_t bytes, int width,
+                     int height)
+{
+	if (secs <= 0)
+		secs = 1e-9;
+
+	printf("%-14s %-11s %-6s %10.1f %10.1f\n", name, op, fmt,
+	       (double) bytes / secs / (1024.0 * 1024.0),
+	       (double) width * height / secs / 1e6);
+}
+
+
+
+/*****************************************************************************
+ * 	s_save_corpus
+ *****************************************************************************/
+
+static int s_save_corpus(const char *dir, const char *name, const void *bmp, size_t size)
+{
+	char  path[1024];
+	FILE *file;
+	int   ok;
+
+	snprintf(path, sizeof path, "%s/%s.bmp", dir, name);
+	if (!(file = fopen(path, "wb"))) {
+		perror(path);
+		return 1;
+	}
+	ok = fwrite(bmp, 1, size, file) == size;
+	if (fclose(file) || !ok) {
+		perror(path);
+		return 1;
+	}
+	return 0;
+}
@@ -18,16 +18,28 @@
  * If not, see <https://www.gnu.org/licenses/>
  */
 
+/* for pthreads and sysconf() */
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
 
 #define BMPLIB_LIB
 
 #include "config.h"
+
+#if HAVE_PTHREAD
+	#include <pthread.h>
+	#include <unistd.h>
+#endif
+
 #include "bmplib.h"
 #include "logging.h"
 #include "bmp-common.h"
@@ -98,6 +110,36 @@ API BMPRESULT bmp_set_number_format(BMPHANDLE h, enum BmpFormat format)
 
 
 
+/********************************************************
+ * 	bmp_set_timing
+ *******************************************************/
+
+API BMPRESULT bmp_set_timing(BMPHANDLE h, int enable)
+{
+	if (!h)
+		return BMP_RESULT_ERROR;
+
+	switch (h->magic) {
+	case HMAGIC_READ:
+		((BMPREAD)(void*)h)->timing = !!enable;
+		return BMP_RESULT_OK;
+
+	case HMAGIC_WRITE:
+		((BMPWRITE)(void*)h)->timing = !!enable;
+		return BMP_RESULT_OK;
+
+	default:
+#ifdef DEBUG
+		printf("bmp_set_timing() called with invalid handle (0x%04x)\n",
+		                   (unsigned int) h->magic);
+#endif
+		break;
+	}
+	return BMP_RESULT_ERROR;
+}
+
+
+
 /********************************************************
  * 	bmp_free
  *******************************************************/
@@ -154,31 +196,401 @@ bool cm_check_is_write_handle(BMPHANDLE h)
 }
 
 
+/********************************************************
+ * 	cm_malloc / cm_calloc / cm_realloc / cm_free
+ *
+ *  all memory goes through the handle's allocator, or
+ *  through malloc() and friends, if there is none.
+ *  Custom allocators have no realloc(), so we need
+ *  the old size to move the data ourselves.
+ *******************************************************/
+
+void* cm_malloc(const struct BmpAllocator *a, size_t size)
+{
+	if (a->alloc)
+		return a->alloc(a->ctx, size);
+	return malloc(size);
+}
+
+
+void* cm_calloc(const struct BmpAllocator *a, size_t size)
+{
+	void *ptr;
+
+	if (!a->alloc)
+		return calloc(1, size);
+	if ((ptr = a->alloc(a->ctx, size)))
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+
+void* cm_realloc(const struct BmpAllocator *a, void *ptr, size_t oldsize, size_t newsize)
+{
+	void *tmp;
+
+	if (!a->alloc)
+		return realloc(ptr, newsize);
+
+	if (!(tmp = a->alloc(a->ctx, newsize)))
+		return NULL;
+	if (ptr) {
+		memcpy(tmp, ptr, MIN(oldsize, newsize));
+		cm_free(a, ptr);
+	}
+	return tmp;
+}
+
+
+void cm_free(const struct BmpAllocator *a, void *ptr)
+{
+	if (!a->alloc)
+		free(ptr);
+	else if (a->free && ptr)
+		a->free(a->ctx, ptr);
+}
+
+
+
+/********************************************************
+ * 	cm_get_palette
+ *
+ *  allocate a zeroed palette for numcolors colors.
+ *  A palette kept by bmpread_reset()/bmpwrite_reset()
+ *  is used again if it is large enough. *capacity is
+ *  the number of colors the palette has room for.
+ *******************************************************/
+
+struct Palette* cm_get_palette(const struct BmpAllocator *a, struct Palette **spare,
+                               int *capacity, int numcolors)
+{
+	struct Palette *palette;
+	size_t          memsize;
+
+	memsize = sizeof *palette + numcolors * sizeof palette->color[0];
+
+	if (*spare && *capacity >= numcolors) {
+		palette = *spare;
+		*spare  = NULL;
+	} else {
+		if (*spare) {
+			cm_free(a, *spare);
+			*spare = NULL;
+		}
+		*capacity = 0;
+		if (!(palette = cm_malloc(a, memsize)))
+			return NULL;
+		*capacity = numcolors;
+	}
+
+	memset(palette, 0, memsize);
+	palette->numcolors = numcolors;
+	return palette;
+}
+
+
 /********************************************************
  * 	cm_gobble_up
+ *
+ *  skip count bytes. Goes through the read buffer, so
+ *  bytes_read is updated here, not by the caller.
  *******************************************************/
 
 bool cm_gobble_up(BMPREAD_R rp, int count)
 {
-	int i;
+	size_t avail, n;
 
-	for (i = 0; i < count; i++) {
-		if (EOF == getc(rp->file)) {
-			if (feof(rp->file)) {
+	while (count > 0) {
+		avail = cm_fill_readbuf(rp, MIN((size_t) count, READBUF_CHUNK));
+		if (!avail) {
+			if (cm_is_eof(rp)) {
 				rp->lasterr = BMP_ERR_TRUNCATED;
-				logerr(rp->log, "unexpected end of file");
+				logfixed(rp->log, "unexpected end of file");
 			} else {
 				rp->lasterr = BMP_ERR_FILEIO;
-				logsyserr(rp->log, "error reading from file");
+				logsysfixed(rp->log, "error reading from file");
 			}
 			return false;
 		}
+		n = MIN(avail, (size_t) count);
+		rp->rbuf_pos   += n;
+		rp->bytes_read += n;
+		count          -= (int) n;
+	}
+	return true;
+}
+
+
+
+/********************************************************
+ * 	cm_seek
+ *
+ *  position the read buffer at pos bytes from the start
+ *  of the BMP. Positions inside the buffered data don't
+ *  touch the file, otherwise we fseek() relative to the
+ *  current file position (which is at the end of the
+ *  buffered data). If the file can't seek (pipes), we
+ *  can still go forward by reading and discarding.
+ *******************************************************/
+
+bool cm_seek(BMPREAD_R rp, size_t pos)
+{
+	size_t    start, n;
+	long long delta;
+
+	if (rp->rbuf_static) {
+		rp->rbuf_pos   = MIN(pos, rp->rbuf_len);
+		rp->bytes_read = rp->rbuf_pos;
+		return true;
+	}
+
+	start = rp->bytes_read - rp->rbuf_pos; /* file offset of rbuf[0] */
+	if (pos >= start && pos <= start + rp->rbuf_len) {
+		rp->rbuf_pos   = pos - start;
+		rp->bytes_read = pos;
+		return true;
+	}
+
+	delta = (long long) pos - (long long) (start + rp->rbuf_len);
+	if (delta > 0) {
+		if (!rp->no_seek && delta <= LONG_MAX) {
+			if (!fseek(rp->file, (long) delta, SEEK_CUR)) {
+				rp->rbuf_pos   = 0;
+				rp->rbuf_len   = 0;
+				rp->bytes_read = pos;
+				return true;
+			}
+			rp->no_seek = true;
+		}
+		/* pipes etc. can still skip forward by reading. EOF
+		 * isn't logged here, same as seeking past the end of
+		 * a file, it's up to the caller to report it.
+		 */
+		rp->rbuf_pos   = rp->rbuf_len;
+		rp->bytes_read = start + rp->rbuf_len;
+		while (delta > 0) {
+			n = MIN(cm_fill_readbuf(rp, MIN((size_t) delta, READBUF_CHUNK)), (size_t) delta);
+			if (!n)
+				return false;
+			rp->rbuf_pos   += n;
+			rp->bytes_read += n;
+			delta          -= (long long) n;
+		}
+		return true;
 	}
+	if (delta < LONG_MIN) {
+		logerr(rp->log, "Seek position out of range");
+		rp->lasterr = BMP_ERR_FILEIO;
+		return false;
+	}
+	if (delta < 0 && fseek(rp->file, (long) delta, SEEK_CUR)) {
+		logsyserr(rp->log, "Seeking in file");
+		rp->lasterr = BMP_ERR_FILEIO;
+		return false;
+	}
+	rp->rbuf_pos   = 0;
+	rp->rbuf_len   = 0;
+	rp->bytes_read = pos;
 	return true;
 }
 
 
 
+/********************************************************
+ * 	cm_fill_readbuf
+ *
+ *  make sure that (at least) count unconsumed bytes are
+ *  available in the read buffer, starting at
+ *  rp->rbuf + rp->rbuf_pos.
+ *  Unless rp->readahead is set, we never read more
+ *  than requested from the file, so that the file
+ *  position is still well-defined (e.g. for handing
+ *  over embedded PNG/JPEG to the caller).
+ *  Returns the number of available bytes, which will
+ *  be less than count on EOF or error.
+ *******************************************************/
+
+size_t cm_fill_readbuf(BMPREAD_R rp, size_t count)
+{
+	size_t         avail, want;
+	unsigned char *tmp;
+
+	avail = rp->rbuf_len - rp->rbuf_pos;
+	if (avail >= count || rp->rbuf_static)
+		return avail;
+
+	if (rp->rbuf_pos > 0) {
+		memmove(rp->rbuf, rp->rbuf + rp->rbuf_pos, avail);
+		rp->rbuf_pos = 0;
+		rp->rbuf_len = avail;
+	}
+
+	want = rp->readahead ? MAX(count, READBUF_CHUNK) : count;
+	if (want > rp->rbuf_size) {
+		if (!(tmp = cm_realloc(&rp->allocator, rp->rbuf, rp->rbuf_size, want))) {
+			logsysfixed(rp->log, "allocating read buffer");
+			rp->lasterr = BMP_ERR_MEMORY;
+			return avail;
+		}
+		rp->rbuf      = tmp;
+		rp->rbuf_size = want;
+	}
+
+	rp->rbuf_len += fread(rp->rbuf + avail, 1, want - avail, rp->file);
+
+	return rp->rbuf_len;
+}
+
+
+
+/********************************************************
+ * 	cm_read
+ *
+ *  copy up to count bytes from the read buffer (and
+ *  file) to buf. Like fread(), returns the number of
+ *  bytes actually read. Doesn't update rp->bytes_read,
+ *  that is left to the caller.
+ *******************************************************/
+
+size_t cm_read(BMPREAD_R rp, void *buf, size_t count)
+{
+	size_t avail;
+
+	avail = MIN(cm_fill_readbuf(rp, count), count);
+	memcpy(buf, rp->rbuf + rp->rbuf_pos, avail);
+	rp->rbuf_pos += avail;
+	return avail;
+}
+
+
+bool cm_read_u16_le(BMPREAD_R rp, uint16_t *val)
+{
+	unsigned char buf[2];
+
+	if (2 != cm_read(rp, buf, 2))
+		return false;
+
+	*val = u16_from_le(buf);
+	return true;
+}
+
+
+bool cm_read_u32_le(BMPREAD_R rp, uint32_t *val)
+{
+	unsigned char buf[4];
+
+	if (4 != cm_read(rp, buf, 4))
+		return false;
+
+	*val = u32_from_le(buf);
+	return true;
+}
+
+
+
+/********************************************************
+ * 	cm_is_eof
+ *
+ *  after a short read, tells an end-of-file from a
+ *  file error. Memory sources can only ever run out
+ *  of data.
+ *******************************************************/
+
+bool cm_is_eof(BMPREAD_R rp)
+{
+	return rp->rbuf_static || feof(rp->file);
+}
+
+
+
+#if HAVE_PTHREAD
+/********************************************************
+ * 	cm_online_cpus
+ *******************************************************/
+
+int cm_online_cpus(void)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (ncpu > 0) ? (int) MIN(ncpu, BMP_MAX_THREADS) : 1;
+}
+
+
+
+/********************************************************
+ * 	cm_run_threads
+ *
+ *  call func() for each of the n argsize-sized elements
+ *  of args, each in its own thread. The calling thread
+ *  does the first one. If a thread can't be started,
+ *  its work is done by the calling thread, too.
+ *******************************************************/
+
+void cm_run_threads(void* (*func)(void*), void *args, size_t argsize, int n)
+{
+	pthread_t thread[BMP_MAX_THREADS];
+	bool      started[BMP_MAX_THREADS];
+	int       i;
+
+	for (i = 1; i < n; i++)
+		started[i] = !pthread_create(&thread[i], NULL, func, (char*) args + i * argsize);
+	func(args);
+
+	for (i = 1; i < n; i++) {
+		if (started[i])
+			pthread_join(thread[i], NULL);
+		else
+			func((char*) args + i * argsize);
+	}
+}
+#endif
+
+
+
+/********************************************************
+ * 	cm_clock
+ *
+ *  seconds from an arbitrary starting point, only
+ *  differences are meaningful. Monotonic if available.
+ *******************************************************/
+
+double cm_clock(void)
+{
+	struct timespec ts;
+
+#if HAVE_CLOCK_MONOTONIC
+	if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+		return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+#endif
+	if (!timespec_get(&ts, TIME_UTC))
+		return 0.0;
+	return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+
+
+/********************************************************
+ * 	cm_add_stats
+ *
+ *  add up the counters of band handles, timings and
+ *  bytes are taken care of by the main handle.
+ *******************************************************/
+
+void cm_add_stats(struct BmpStats *restrict sum, const struct BmpStats *restrict add)
+{
+	sum->rle_repeat      += add->rle_repeat;
+	sum->rle_literal     += add->rle_literal;
+	sum->rle_eol         += add->rle_eol;
+	sum->rle_delta       += add->rle_delta;
+	sum->rle_eof         += add->rle_eof;
+	sum->huffman_codes   += add->huffman_codes;
+	sum->invalid_index   += add->invalid_index;
+	sum->invalid_delta   += add->invalid_delta;
+	sum->invalid_overrun += add->invalid_overrun;
+}
+
+
+
 /********************************************************
  * 	cm_count_bits
  *
@@ -323,90 +735,184 @@ int cm_align2padding(unsigned long long a)
 
 
 
-/*********************************************************
- *      endianess-agnostic functions to read/write
- *      from little-endian files
- *********************************************************/
-
-bool write_u16_le(FILE *file, uint16_t val)
-{
-	return (EOF != fputc(val & 0xff, file) &&
-	        EOF != fputc((val >> 8) & 0xff, file));
-}
-
+/********************************************************
+ * 	cm_flush_writebuf
+ *
+ *  hand the buffered output over to the file.
+ *  Without a file, the output is collected in memory,
+ *  and 'flushing' means making more room in wbuf.
+ *******************************************************/
 
-bool write_u32_le(FILE *file, uint32_t val)
+bool cm_flush_writebuf(BMPWRITE_R wp)
 {
-	int i;
+	size_t len;
 
-	for (i = 0; i < 4; i++) {
-		if (EOF == fputc((val >> (i*8)) & 0xff, file))
+	if (!wp->file) {
+		if (!cm_grow_writebuf(wp, 1))
 			return false;
+		if (!wp->file)
+			return true;
+		/* spilled to a temp file, carry on as usual */
 	}
+
+	len = wp->wbuf_len;
+	wp->wbuf_len = 0;
+	if (len && len != fwrite(wp->wbuf, 1, len, wp->file))
+		return false;
 	return true;
 }
 
 
-bool read_u16_le(FILE *file, uint16_t *val)
+
+/********************************************************
+ * 	cm_grow_writebuf
+ *
+ *  make sure that wbuf can take count more bytes.
+ *  When streaming and the memory limit would be
+ *  exceeded, the bitmap data is moved to a temp file
+ *  instead, and wp->file is set to that temp file.
+ *  (see bmpwrite_set_streaming())
+ *******************************************************/
+static bool s_spill_writebuf(BMPWRITE_R wp);
+
+bool cm_grow_writebuf(BMPWRITE_R wp, size_t count)
 {
-	unsigned char buf[2];
+	size_t         size;
+	unsigned char *tmp;
+
+	if (count <= wp->wbuf_size - wp->wbuf_len)
+		return true;
+
+	if (wp->stream_out && wp->stream_limit &&
+	    wp->wbuf_len >= wp->fh->offbits &&
+	    (count > wp->stream_limit || wp->wbuf_len > wp->stream_limit - count))
+		return s_spill_writebuf(wp);
 
-	if (2 != fread(buf, 1, 2, file))
+	if (wp->wbuf_fixed) {
+		logerr(wp->log, "Output buffer too small");
+		errno = ENOSPC;
 		return false;
+	}
+
+	if (count > SIZE_MAX / 2 - wp->wbuf_len) {
+		errno = ENOMEM;
+		return false;
+	}
 
-	*val = ((unsigned)buf[1] << 8) | (unsigned)buf[0];
+	size = wp->wbuf_size < SIZE_MAX / 4 ? MAX(wp->wbuf_size * 2, WRITEBUF_CHUNK) : wp->wbuf_size;
+	if (size - wp->wbuf_len < count)
+		size = wp->wbuf_len + count;
 
+	if (!(tmp = cm_realloc(&wp->allocator, wp->wbuf, wp->wbuf_size, size)))
+		return false;
+	wp->wbuf      = tmp;
+	wp->wbuf_size = size;
 	return true;
 }
 
 
-bool read_u32_le(FILE *file, uint32_t *val)
+
+/********************************************************
+ * 	s_spill_writebuf
+ *
+ *  keep the headers (which we still have to patch)
+ *  and move everything else to a temp file.
+ *******************************************************/
+
+static bool s_spill_writebuf(BMPWRITE_R wp)
 {
-	unsigned char buf[4];
+	size_t hdrsize = wp->fh->offbits;
 
-	if (4 != fread(buf, 1, 4, file))
+	if (!(wp->stream_header = cm_malloc(&wp->allocator, hdrsize)))
 		return false;
+	memcpy(wp->stream_header, wp->wbuf, hdrsize);
 
-	*val = ((uint32_t)buf[3] << 24) | ((uint32_t)buf[2] << 16) |
-	       ((uint32_t)buf[1] << 8) | (uint32_t)buf[0];
+	if (!(wp->spill = tmpfile()))
+		return false;
+
+	if (wp->wbuf_len > hdrsize &&
+	    wp->wbuf_len - hdrsize != fwrite(wp->wbuf + hdrsize, 1,
+	                                     wp->wbuf_len - hdrsize, wp->spill))
+		return false;
 
+	wp->wbuf_len = 0;
+	wp->file     = wp->spill;
 	return true;
 }
 
 
-bool write_s16_le(FILE *file, int16_t val)
-{
-	return write_u16_le(file, (uint16_t)val);
-}
 
+/********************************************************
+ * 	cm_write
+ *
+ *  all output goes through the write buffer, which is
+ *  flushed with fwrite() when full. Blocks that are
+ *  larger than the buffer are written directly.
+ *  bytes_written is updated here, not by the caller.
+ *******************************************************/
 
-bool write_s32_le(FILE *file, int32_t val)
+bool cm_write(BMPWRITE_R wp, const void *buf, size_t count)
 {
-	return write_u32_le(file, (uint32_t)val);
+	if (count > wp->wbuf_size - wp->wbuf_len) {
+		if (!wp->file) {
+			if (!cm_grow_writebuf(wp, count))
+				return false;
+		}
+		if (wp->file) {
+			if (!cm_flush_writebuf(wp))
+				return false;
+			if (count >= wp->wbuf_size) {
+				if (count != fwrite(buf, 1, count, wp->file))
+					return false;
+				wp->bytes_written += count;
+				return true;
+			}
+		}
+	}
+	memcpy(wp->wbuf + wp->wbuf_len, buf, count);
+	wp->wbuf_len      += count;
+	wp->bytes_written += count;
+	return true;
 }
 
-bool read_s16_le(FILE *file, int16_t *val)
+
+
+/*********************************************************
+ *      endianess-agnostic functions to write
+ *      little-endian values
+ *********************************************************/
+
+bool cm_write_u16_le(BMPWRITE_R wp, uint16_t val)
 {
-	uint16_t u16;
+	unsigned char buf[2];
 
-	if (!read_u16_le(file, &u16))
-		return false;
+	buf[0] = val & 0xff;
+	buf[1] = (val >> 8) & 0xff;
+	return cm_write(wp, buf, 2);
+}
 
-	*val = (int16_t)u16;
 
-	return true;
+bool cm_write_u32_le(BMPWRITE_R wp, uint32_t val)
+{
+	unsigned char buf[4];
+
+	u32_to_le(buf, val);
+	return cm_write(wp, buf, 4);
 }
 
-bool read_s32_le(FILE *file, int32_t *val)
+
+bool cm_write_s32_le(BMPWRITE_R wp, int32_t val)
 {
-	uint32_t u32;
+	return cm_write_u32_le(wp, (uint32_t)val);
+}
 
-	if (!read_u32_le(file, &u32))
-		return false;
 
-	*val = (int32_t)u32;
+void u32_to_le(unsigned char *buf, uint32_t val)
+{
+	int i;
 
-	return true;
+	for (i = 0; i < 4; i++)
+		buf[i] = (val >> (i*8)) & 0xff;
 }
 
 
@@ -82,6 +82,16 @@ struct Colormask {
 	} maxval;
 };
 
+struct LineMark {
+	size_t   pos;         /* rbuf_pos at start of line */
+	size_t   bytes_read;
+	int      x;           /* lbl_x */
+	int      file_y;      /* lbl_file_y */
+	bool     eol;         /* rle_eol */
+	uint32_t hufbuf;
+	int      hufbuf_len;
+};
+
 typedef struct Bmpread  *BMPREAD;
 typedef struct Bmpwrite *BMPWRITE;
 typedef struct Bmpread  *restrict BMPREAD_R;
@@ -94,11 +104,26 @@ struct Palette {
 
 struct Bmpread {
 	struct {
-		uint32_t magic;
-		LOG      log;
+		uint32_t            magic;
+		LOG                 log;
+		struct BmpAllocator allocator;
 	};
 	FILE             *file;
 	size_t            bytes_read;  /* number of bytes we have read from the file */
+	unsigned char    *rbuf;        /* bitmap data is read in blocks through rbuf */
+	size_t            rbuf_size;   /* allocated size of rbuf */
+	size_t            rbuf_pos;    /* next unconsumed byte in rbuf */
+	size_t            rbuf_len;    /* number of valid bytes in rbuf */
+	bool              readahead;   /* may fill rbuf beyond the requested size */
+	bool              no_seek;     /* fseek() failed, skip lines by reading */
+	bool              rbuf_static; /* rbuf is caller's memory or mmap, never written */
+	void             *mmap_base;
+	size_t            mmap_size;
+	long              mmap_filepos; /* file position at bmpread_use_mmap() */
+	bool              feed;         /* data comes in through bmpread_feed() */
+	bool              feed_end;     /* bmpread_feed(h, NULL, 0) was called */
+	int               feed_rows;    /* lines which can be decoded from rbuf */
+	struct LineMark   feed_mark;    /* decoder state at line feed_rows */
 	struct Bmpfile   *fh;
 	struct Bmpinfo   *ih;
 	unsigned int      insanity_limit;
@@ -110,7 +135,28 @@ struct Bmpread {
 	bool              we_allocated_buffer;
 	bool              line_by_line;
 	struct Palette   *palette;
+	struct Palette   *spare_palette;    /* kept by bmpread_reset() for reuse */
+	int               palette_capacity; /* colors allocated in (spare_)palette */
+	unsigned char     pal_lut[256 * 16]; /* palette in result format    */
+	unsigned char    *pal_expand;        /* 1/2/4 bit: byte -> 8/4/2 px */
+	bool              pal_expand_valid;
+	unsigned char     pal_expand_invalid[256]; /* invalid indices per byte */
 	struct Colormask  cmask;
+	const struct Kernels *kern;    /* SIMD or plain C conversion kernels */
+	void            (*rgb_kernel)(BMPREAD_R rp, const unsigned char *restrict data,
+	                              unsigned char *restrict line, int npixels);
+	void            (*u8_kernel)(BMPREAD_R rp, const unsigned char *restrict data,
+	                             unsigned char *restrict line, int npixels);
+	int               kernel_offs[4]; /* byte offsets for s_kernel_bytes() */
+	enum BmpOrder     order;
+	int               chan[4];        /* result offset of r, g, b, a */
+	bool              passthrough;    /* file data is copied unchanged */
+	int               nthreads;
+	struct LineMark  *line_index;      /* decoder state every INDEX_STEP lines */
+	int               line_index_rows; /* number of lines covered by line_index */
+	int               clip_x0;         /* only pixels clip_x0 ... clip_x1-1 */
+	int               clip_x1;         /* are written to the line buffer   */
+	bool              region_mode;     /* loading with bmpread_load_region() */
 	/* result image dimensions */
 	enum Bmpconv64    conv64;
 	bool              conv64_explicit;
@@ -122,6 +168,11 @@ struct Bmpread {
 	enum BmpFormat    result_format;
 	bool              result_format_explicit;
 	size_t            result_size;
+	int               scale_shift;   /* bmpread_set_scale(), every 2^n-th pixel */
+	int               result_width;  /* image dimensions after scaling */
+	unsigned          result_height;
+	size_t            stride;        /* set by bmpread_set_stride(), 0 = packed */
+	size_t            result_stride; /* actual line stride of the result image */
 	/* state */
 	unsigned long     lasterr;
 	bool              getinfo_called;
@@ -149,14 +200,17 @@ struct Bmpread {
 	bool              file_err;
 	bool              file_eof;
 	bool              panic;
+	bool              timing;  /* bmp_set_timing() */
+	struct BmpStats   stats;   /* bytes is filled in by bmpread_get_stats() */
 
 };
 
 
 struct Bmpwrite {
 	struct {
-		uint32_t magic;
-		LOG      log;
+		uint32_t            magic;
+		LOG                 log;
+		struct BmpAllocator allocator;
 	};
 	FILE            *file;
 	struct Bmpfile  *fh;
@@ -168,9 +222,25 @@ struct Bmpwrite {
 	int              source_bitsperchannel;
 	int              source_bytes_per_pixel;
 	int              source_format;
+	size_t           stride;       /* set by bmpwrite_set_stride(), 0 = packed */
 	struct Palette  *palette;
+	struct Palette  *spare_palette;    /* kept by bmpwrite_reset() for reuse */
+	int              palette_capacity; /* colors allocated in (spare_)palette */
 	int              palette_size; /* sizeof palette in bytes */
+	bool             map_palette;  /* bmpwrite_map_to_palette(), source is RGB(A) */
+	struct Quantizer *quant;       /* RGB -> index cache, see s_quantize_line() */
+	unsigned char   *qline;        /* one line of palette indices */
+	int              qline_width;
 	/* output */
+	unsigned char   *wbuf;      /* all output is collected in wbuf, then fwrite() */
+	size_t           wbuf_size; /* allocated size of wbuf */
+	size_t           wbuf_len;  /* number of bytes in wbuf not yet written */
+	bool             mem_target; /* no file, output stays in wbuf */
+	bool             wbuf_fixed; /* wbuf is the caller's, never grown or freed */
+	size_t           stream_limit;  /* streaming: max. memory before spilling (0 = none) */
+	FILE            *stream_out;    /* streaming: the real file, while we hold back the data */
+	FILE            *spill;         /* streaming: temp file for data beyond stream_limit */
+	unsigned char   *stream_header; /* streaming: headers kept back after spilling */
 	size_t           bytes_written;
 	size_t           bytes_written_before_bitdata;
 	bool             has_alpha;
@@ -184,16 +254,30 @@ struct Bmpwrite {
 	bool             out64bit;
 	int              outbytes_per_pixel;
 	int              padding;
+	const struct Kernels *kern; /* SIMD or plain C conversion kernels */
+	void           (*packer)(BMPWRITE_R wp, const unsigned char *restrict src,
+	                         unsigned char *restrict dst); /* whole line, or NULL */
+	void           (*line_kernel)(const unsigned char *restrict src,
+	                              unsigned char *restrict dst, size_t n);
+	uint64_t       (*pack_lut)[256]; /* 8-bit value -> output bits, per channel */
+	unsigned char   *linebuf;   /* one output line incl. padding for packer */
+	size_t           linebuf_size;
 	int             *group;
 	int              group_count;
+	int              group_width; /* image width group was allocated for */
+	int              nthreads;
 	/* state */
 	bool             outbits_set;
 	bool             dimensions_set;
+	bool             streaming;
 	bool             saveimage_done;
+	bool             image_complete;
 	bool             line_by_line;
 	int              lbl_y;
 	uint32_t         hufbuf;
 	int              hufbuf_len;
+	bool             timing;  /* bmp_set_timing() */
+	struct BmpStats  stats;   /* bytes is filled in by bmpwrite_get_stats() */
 };
 
 
@@ -203,6 +287,18 @@ bool cm_all_equal_int(int n, ...);
 bool cm_all_positive_int(int n, ...);
 bool cm_is_one_of(int n, int candidate, ...);
 
+#define READBUF_CHUNK  ((size_t) 64 * 1024)
+#define WRITEBUF_CHUNK ((size_t) 64 * 1024)
+
+#define PAL_EXPAND_SIZE ((size_t) 256 * 8 * 4) /* 256 bytes x 8 pixels x 4 bytes */
+
+#define BMP_MAX_THREADS 64
+
+#if HAVE_PTHREAD
+int  cm_online_cpus(void);
+void cm_run_threads(void* (*func)(void*), void *args, size_t argsize, int n);
+#endif
+
 #define cm_align4size(a)     ((((a) + 3) >> 2) << 2)
 #define cm_align2size(a)     ((((a) + 1) >> 1) << 1)
 int cm_align4padding(unsigned long long a);
@@ -210,21 +306,37 @@ int cm_align2padding(unsigned long long a);
 int cm_count_bits(unsigned long v);
 
 bool cm_gobble_up(BMPREAD_R rp, int count);
+bool cm_seek(BMPREAD_R rp, size_t pos);
+size_t cm_fill_readbuf(BMPREAD_R rp, size_t count);
+size_t cm_read(BMPREAD_R rp, void *buf, size_t count);
+bool cm_read_u16_le(BMPREAD_R rp, uint16_t *val);
+bool cm_read_u32_le(BMPREAD_R rp, uint32_t *val);
+bool cm_is_eof(BMPREAD_R rp);
 bool cm_check_is_read_handle(BMPHANDLE h);
 bool cm_check_is_write_handle(BMPHANDLE h);
 
+void* cm_malloc(const struct BmpAllocator *a, size_t size);
+void* cm_calloc(const struct BmpAllocator *a, size_t size);
+void* cm_realloc(const struct BmpAllocator *a, void *ptr, size_t oldsize, size_t newsize);
+void  cm_free(const struct BmpAllocator *a, void *ptr);
+
+struct Palette* cm_get_palette(const struct BmpAllocator *a, struct Palette **spare,
+                               int *capacity, int numcolors);
+
+double cm_clock(void);
+void   cm_add_stats(struct BmpStats *restrict sum, const struct BmpStats *restrict add);
+
 const char* cm_conv64_name(enum Bmpconv64 conv);
 const char* cm_format_name(enum BmpFormat format);
 
-bool write_u16_le(FILE *file, uint16_t val);
-bool write_u32_le(FILE *file, uint32_t val);
-bool read_u16_le(FILE *file, uint16_t *val);
-bool read_u32_le(FILE *file, uint32_t *val);
+bool cm_flush_writebuf(BMPWRITE_R wp);
+bool cm_grow_writebuf(BMPWRITE_R wp, size_t count);
+bool cm_write(BMPWRITE_R wp, const void *buf, size_t count);
+bool cm_write_u16_le(BMPWRITE_R wp, uint16_t val);
+bool cm_write_u32_le(BMPWRITE_R wp, uint32_t val);
+bool cm_write_s32_le(BMPWRITE_R wp, int32_t val);
 
-bool write_s16_le(FILE *file, int16_t val);
-bool write_s32_le(FILE *file, int32_t val);
-bool read_s16_le(FILE *file, int16_t *val);
-bool read_s32_le(FILE *file, int32_t *val);
+void     u32_to_le(unsigned char *buf, uint32_t val);
 
 uint32_t u32_from_le(const unsigned char *buf);
 int32_t  s32_from_le(const unsigned char *buf);
@@ -23,6 +23,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <math.h>
 
 #define BMPLIB_LIB
@@ -33,7 +34,9 @@
 #include "bmp-common.h"
 #include "huffman.h"
 #include "bmp-read.h"
+#include "kernels.h"
 #include "reversebits.h"
+#include "srgb-tables.h"
 
 
 /*
@@ -65,14 +68,33 @@ static void s_log_error_from_state(BMPREAD_R rp);
 static bool s_cont_error(BMPREAD_R rp);
 static bool s_stopping_error(BMPREAD_R rp);
 static inline int s_read_one_byte(BMPREAD_R rp);
+static inline void s_add_invalid_index(BMPREAD_R rp, unsigned long n);
 static inline void s_int_to_result_format(BMPREAD_R rp, int frombits, unsigned char *restrict px);
 
 static BMPRESULT s_load_image_or_line(BMPREAD_R rp, unsigned char **restrict buffer, bool line_by_line);
+static void s_choose_rgb_kernel(BMPREAD_R rp);
+static bool s_can_passthrough(BMPREAD_R rp);
+static void s_read_passthrough_image(BMPREAD_R rp, unsigned char *restrict image);
+static int  s_read_bands(BMPREAD_R rp, unsigned char *restrict image);
 static void s_read_rgb_line(BMPREAD_R rp, unsigned char *restrict line);
 static void s_read_indexed_line(BMPREAD_R rp, unsigned char *restrict line);
 static void s_read_rle_line(BMPREAD_R rp, unsigned char *restrict line,
                                int *restrict x, int *restrict yoff);
 static void s_read_huffman_line(BMPREAD_R rp, unsigned char *restrict line);
+static int  s_decode_indexed(BMPREAD_R rp, const unsigned char *restrict data,
+                             unsigned char *restrict line, int x0, int npixels);
+static void s_build_palette_lut(BMPREAD_R rp);
+static inline void s_copy_pixel(unsigned char *restrict dst, const unsigned char *restrict src,
+                                int bytes);
+
+#define INDEX_STEP 16  /* lines between entries of the line index */
+
+static bool s_build_line_index(BMPREAD_R rp);
+static bool s_set_line_mark(BMPREAD_R rp, const struct LineMark *mark, int y);
+static int  s_sampled_end(BMPREAD_R rp, int nlines);
+static void s_read_next_line(BMPREAD_R rp, unsigned char *restrict line);
+static void s_skip_to_sampled(BMPREAD_R rp);
+static void s_skip_line(BMPREAD_R rp, size_t linesize);
 
 _Static_assert(sizeof(float) == 4, "sizeof(float) must be 4. Cannot build bmplib.");
 _Static_assert(sizeof(int) >= 4, "int must be at least 32bit. Cannot build bmplib.");
@@ -84,13 +106,25 @@ _Static_assert(sizeof(int) >= 4, "int must be at least 32bit. Cannot build bmpli
 
 API BMPRESULT bmpread_load_image(BMPHANDLE h, unsigned char **restrict buffer)
 {
-	BMPREAD rp;
+	BMPREAD   rp;
+	BMPRESULT res;
+	double    start = 0.0;
+	int       y;
 
 	if (!(h && cm_check_is_read_handle(h)))
 		return BMP_RESULT_ERROR;
 	rp = (BMPREAD)(void*)h;
 
-	return s_load_image_or_line(rp, buffer, false);
+	if (rp->timing)
+		start = cm_clock();
+	y = rp->lbl_y;
+
+	res = s_load_image_or_line(rp, buffer, false);
+
+	rp->stats.rows += rp->lbl_y - y;
+	if (rp->timing)
+		rp->stats.time_pixels += cm_clock() - start;
+	return res;
 }
 
 
@@ -101,7 +135,10 @@ API BMPRESULT bmpread_load_image(BMPHANDLE h, unsigned char **restrict buffer)
 
 API BMPRESULT bmpread_load_line(BMPHANDLE h, unsigned char **restrict buffer)
 {
-	BMPREAD rp;
+	BMPREAD   rp;
+	BMPRESULT res;
+	double    start = 0.0;
+	int       y;
 
 	if (!(h && cm_check_is_read_handle(h)))
 		return BMP_RESULT_ERROR;
@@ -110,7 +147,106 @@ API BMPRESULT bmpread_load_line(BMPHANDLE h, unsigned char **restrict buffer)
 	logreset(rp->log); /* otherwise we might accumulate thousands  */
 	                   /* of log entries with large corrupt images */
 
-	return s_load_image_or_line(rp, buffer, true);
+	if (rp->timing)
+		start = cm_clock();
+	y = rp->lbl_y;
+
+	res = s_load_image_or_line(rp, buffer, true);
+
+	rp->stats.rows += rp->lbl_y - y;
+	if (rp->timing)
+		rp->stats.time_pixels += cm_clock() - start;
+	return res;
+}
+
+
+
+/********************************************************
+ * 	bmpread_load_lines
+ *******************************************************/
+
+static BMPRESULT s_load_lines(BMPREAD_R rp, int nlines, unsigned char *restrict buffer, size_t stride);
+
+API BMPRESULT bmpread_load_lines(BMPHANDLE h, int nlines, unsigned char *buffer, size_t stride)
+{
+	BMPREAD   rp;
+	BMPRESULT res;
+	double    start = 0.0;
+	int       y;
+
+	if (!(h && cm_check_is_read_handle(h)))
+		return BMP_RESULT_ERROR;
+	rp = (BMPREAD)(void*)h;
+
+	logreset(rp->log);
+
+	if (rp->timing)
+		start = cm_clock();
+	y = rp->lbl_y;
+
+	res = s_load_lines(rp, nlines, buffer, stride);
+
+	rp->stats.rows += rp->lbl_y - y;
+	if (rp->timing)
+		rp->stats.time_pixels += cm_clock() - start;
+	return res;
+}
+
+
+
+/********************************************************
+ * 	bmpread_load_region
+ *******************************************************/
+
+static BMPRESULT s_load_region(BMPREAD_R rp, int x, int y, int width, int height,
+                               unsigned char **restrict buffer, int *restrict nrows);
+
+API BMPRESULT bmpread_load_region(BMPHANDLE h, int x, int y, int width, int height,
+                                  unsigned char **restrict buffer)
+{
+	BMPREAD   rp;
+	BMPRESULT res;
+	double    start = 0.0;
+	int       nrows = 0;
+
+	if (!(h && cm_check_is_read_handle(h)))
+		return BMP_RESULT_ERROR;
+	rp = (BMPREAD)(void*)h;
+
+	logreset(rp->log);
+
+	if (rp->timing)
+		start = cm_clock();
+
+	res = s_load_region(rp, x, y, width, height, buffer, &nrows);
+
+	rp->stats.rows += nrows;
+	if (rp->timing)
+		rp->stats.time_pixels += cm_clock() - start;
+	return res;
+}
+
+
+
+/********************************************************
+ * 	bmpread_is_passthrough
+ *******************************************************/
+
+API int bmpread_is_passthrough(BMPHANDLE h)
+{
+	BMPREAD rp;
+
+	if (!(h && cm_check_is_read_handle(h)))
+		return 0;
+	rp = (BMPREAD)(void*)h;
+
+	if (!rp->getinfo_called || rp->getinfo_return != BMP_RESULT_OK)
+		return 0;
+
+	if (rp->image_loaded || rp->line_by_line)
+		return rp->passthrough;
+
+	return s_can_passthrough(rp);
 }
 
 
@@ -119,13 +255,14 @@ API BMPRESULT bmpread_load_line(BMPHANDLE h, unsigned char **restrict buffer)
  * 	s_load_image_or_line
  *******************************************************/
 
+static bool s_start_decoding(BMPREAD_R rp);
 static void s_read_whole_image(BMPREAD_R rp, unsigned char *restrict image);
 static void s_read_one_line(BMPREAD_R rp, unsigned char *restrict image);
 
-static BMPRESULT s_load_image_or_line(BMPREAD_R rp, unsigned char **restrict buffer, bool line_by_line)
-{
-	size_t	buffer_size;
+static bool s_feed_lines_ready(BMPREAD_R rp, int y_end);
 
+static BMPRESULT s_check_load_state(BMPREAD_R rp, bool line_by_line)
+{
 	if (!(rp->getinfo_called && (rp->getinfo_return == BMP_RESULT_OK))) {
 		if (rp->getinfo_return == BMP_RESULT_INSANE) {
 			logerr(rp->log, "trying to load insanley large image");
@@ -146,22 +283,52 @@ static BMPRESULT s_load_image_or_line(BMPREAD_R rp, unsigned char **restrict buf
 		return BMP_RESULT_ERROR;
 	}
 
+	if (rp->region_mode) {
+		logerr(rp->log, "Image is being loaded by region. "
+		                "Cannot switch to full image or line-by-line.");
+		return BMP_RESULT_ERROR;
+	}
+
 	if (!rp->dimensions_queried) {
 		logerr(rp->log, "must query dimensions before loading image");
 		return BMP_RESULT_ERROR;
 	}
 
+	return BMP_RESULT_OK;
+}
+
+
+static BMPRESULT s_load_image_or_line(BMPREAD_R rp, unsigned char **restrict buffer, bool line_by_line)
+{
+	size_t    buffer_size;
+	BMPRESULT res;
+
+	if (BMP_RESULT_OK != (res = s_check_load_state(rp, line_by_line)))
+		return res;
+
+	if (!s_feed_lines_ready(rp, line_by_line ? s_sampled_end(rp, 1) : (int) rp->height))
+		return BMP_RESULT_NEED_MORE;
+
 	if (!buffer) {
 		logerr(rp->log, "buffer pointer is NULL");
 		return BMP_RESULT_ERROR;
 	}
 
+	if (!line_by_line &&
+	    rp->result_stride < (size_t) rp->result_width * rp->result_bytes_per_pixel) {
+		logerr(rp->log, "Stride %lu is smaller than line size %lu",
+		       (unsigned long) rp->result_stride,
+		       (unsigned long) ((size_t) rp->result_width * rp->result_bytes_per_pixel));
+		rp->lasterr = BMP_ERR_STRIDE;
+		return BMP_RESULT_ERROR;
+	}
+
 	if (line_by_line)
-		buffer_size = (size_t) rp->width * rp->result_bytes_per_pixel;
+		buffer_size = (size_t) rp->result_width * rp->result_bytes_per_pixel;
 	else
 		buffer_size = rp->result_size;
 	if (!*buffer) { /* no buffer supplied, we will allocate one */
-		if (!(*buffer = malloc(buffer_size))) {
+		if (!(*buffer = cm_malloc(&rp->allocator, buffer_size))) {
 			logsyserr(rp->log, "allocating result buffer");
 			return BMP_RESULT_ERROR;
 		}
@@ -170,29 +337,29 @@ static BMPRESULT s_load_image_or_line(BMPREAD_R rp, unsigned char **restrict buf
 		rp->we_allocated_buffer = false;
 	}
 
-	if (rp->we_allocated_buffer || (rp->rle && (rp->undefined_mode == BMP_UNDEFINED_TO_ALPHA)))
-		memset(*buffer, 0, buffer_size);
+	if (rp->we_allocated_buffer || line_by_line ||
+	    rp->result_stride == (size_t) rp->result_width * rp->result_bytes_per_pixel) {
+		if (rp->we_allocated_buffer || (rp->rle && (rp->undefined_mode == BMP_UNDEFINED_TO_ALPHA)))
+			memset(*buffer, 0, buffer_size);
+	} else if (rp->rle && (rp->undefined_mode == BMP_UNDEFINED_TO_ALPHA)) {
+		/* leave the caller's padding between lines alone */
+		for (unsigned y = 0; y < rp->result_height; y++)
+			memset(*buffer + (size_t) y * rp->result_stride, 0,
+			       (size_t) rp->result_width * rp->result_bytes_per_pixel);
+	}
 
 	if (!line_by_line)
 		rp->image_loaded = true; /* point of no return */
 
 	if (!rp->line_by_line) {  /* either whole image or first line */
-		if (rp->bytes_read > rp->fh->offbits) {
-			logerr(rp->log, "Corrupt file");
+		if (!s_start_decoding(rp))
 			goto abort;
-		}
-		/* skip to actual bitmap data: */
-		if (!cm_gobble_up(rp, rp->fh->offbits - rp->bytes_read)) {
-			logerr(rp->log, "while seeking start of bitmap data");
-			goto abort;
-		}
-		rp->bytes_read += rp->fh->offbits - rp->bytes_read;
 	}
 
 	if (line_by_line) {
 		rp->line_by_line = true;  /* don't set this earlier, or we won't */
 		                          /* be able to identify first line      */
-		s_read_one_line(rp, *buffer);
+		s_read_next_line(rp, *buffer);
 	} else {
 		s_read_whole_image(rp, *buffer);
 	}
@@ -209,7 +376,7 @@ static BMPRESULT s_load_image_or_line(BMPREAD_R rp, unsigned char **restrict buf
 
 abort:
 	if (rp->we_allocated_buffer) {
-		free(*buffer);
+		cm_free(&rp->allocator, *buffer);
 		*buffer = NULL;
 	}
 	rp->image_loaded = true;
@@ -218,23 +385,989 @@ abort:
 
 
 
-/********************************************************
- * 	s_read_whole_image
- *******************************************************/
+/********************************************************
+ * 	s_load_lines
+ *
+ * Same as nlines calls to bmpread_load_line(), but the
+ * checks are done only once. Lines are stride bytes
+ * apart in buffer (0 = stride set with bmpread_set_stride()).
+ *******************************************************/
+
+static BMPRESULT s_load_lines(BMPREAD_R rp, int nlines, unsigned char *restrict buffer, size_t stride)
+{
+	size_t    linesize;
+	BMPRESULT res;
+	int       i, left;
+
+	if (BMP_RESULT_OK != (res = s_check_load_state(rp, true)))
+		return res;
+
+	if (!buffer) {
+		logerr(rp->log, "buffer pointer is NULL");
+		rp->lasterr = BMP_ERR_NULL;
+		return BMP_RESULT_ERROR;
+	}
+
+	linesize = (size_t) rp->result_width * rp->result_bytes_per_pixel;
+	if (!stride)
+		stride = rp->result_stride;
+
+	left = br_lines_left(rp, (int) rp->height);
+	if (nlines < 1 || nlines > left || stride < linesize) {
+		logerr(rp->log, "Invalid request for %d lines with stride %lu (%d lines left, "
+		                "line size %lu)", nlines, (unsigned long) stride,
+		                left, (unsigned long) linesize);
+		rp->lasterr = BMP_ERR_LINES;
+		return BMP_RESULT_ERROR;
+	}
+
+	if (!s_feed_lines_ready(rp, s_sampled_end(rp, nlines)))
+		return BMP_RESULT_NEED_MORE;
+
+	if (!rp->line_by_line) {
+		if (!s_start_decoding(rp)) {
+			rp->image_loaded = true;
+			return BMP_RESULT_ERROR;
+		}
+		rp->line_by_line = true;
+	}
+	rp->we_allocated_buffer = false;
+
+	for (i = 0; i < nlines; i++) {
+		if (rp->rle && (rp->undefined_mode == BMP_UNDEFINED_TO_ALPHA))
+			memset(buffer + (size_t) i * stride, 0, linesize);
+		s_read_next_line(rp, buffer + (size_t) i * stride);
+		if (s_stopping_error(rp))
+			break;
+	}
+
+	s_log_error_from_state(rp);
+	if (s_stopping_error(rp)) {
+		rp->truncated = true;
+		rp->image_loaded = true;
+		return BMP_RESULT_TRUNCATED;
+	} else if (s_cont_error(rp))
+		return BMP_RESULT_INVALID;
+
+	return BMP_RESULT_OK;
+}
+
+
+
+/********************************************************
+ * 	s_load_region
+ *
+ * Uncompressed images: seek to each needed line and
+ * only decode the wanted columns.
+ * RLE/Huffman: position the decoder at the first needed
+ * line, using the line index (see s_build_line_index()).
+ * Without an index (e.g. reading from a pipe), we can
+ * only move forward through the file.
+ *******************************************************/
+
+static bool s_read_region_uncompressed(BMPREAD_R rp, int x, int y, int width, int height,
+                                       unsigned char *restrict buffer, int *restrict nrows);
+static bool s_read_region_compressed(BMPREAD_R rp, int x, int y, int width, int height,
+                                     unsigned char *restrict buffer, int *restrict nrows);
+
+static BMPRESULT s_load_region(BMPREAD_R rp, int x, int y, int width, int height,
+                               unsigned char **restrict buffer, int *restrict nrows)
+{
+	size_t buffer_size;
+
+	/* the insanity limit is about the full image size, regions are fine */
+	if (!(rp->getinfo_called && (rp->getinfo_return == BMP_RESULT_OK ||
+	                             rp->getinfo_return == BMP_RESULT_INSANE))) {
+		logerr(rp->log, "getinfo had failed, cannot load image");
+		return BMP_RESULT_ERROR;
+	}
+
+	if (rp->line_by_line || (rp->image_loaded && !rp->region_mode)) {
+		logerr(rp->log, "Cannot load regions once the image is being loaded "
+		                "by bmpread_load_image() or bmpread_load_line()");
+		return BMP_RESULT_ERROR;
+	}
+
+	if (!rp->dimensions_queried) {
+		logerr(rp->log, "must query dimensions before loading image");
+		return BMP_RESULT_ERROR;
+	}
+
+	if (!buffer) {
+		logerr(rp->log, "buffer pointer is NULL");
+		return BMP_RESULT_ERROR;
+	}
+
+	if (x < 0 || y < 0 || width < 1 || height < 1 ||
+	    width > rp->width - x || height > (int) rp->height - y) {
+		logerr(rp->log, "Invalid region %dx%d at %d,%d for %dx%d image",
+		                width, height, x, y, rp->width, (int) rp->height);
+		rp->lasterr = BMP_ERR_REGION;
+		return BMP_RESULT_ERROR;
+	}
+
+	if (rp->scale_shift) {
+		logerr(rp->log, "Cannot load regions of a scaled image");
+		rp->lasterr = BMP_ERR_SCALE;
+		return BMP_RESULT_ERROR;
+	}
+
+	if (!s_feed_lines_ready(rp, (int) rp->height))
+		return BMP_RESULT_NEED_MORE;
+
+	buffer_size = (size_t) width * height * rp->result_bytes_per_pixel;
+	if (!*buffer) { /* no buffer supplied, we will allocate one */
+		if (!(*buffer = cm_malloc(&rp->allocator, buffer_size))) {
+			logsyserr(rp->log, "allocating result buffer");
+			return BMP_RESULT_ERROR;
+		}
+		rp->we_allocated_buffer = true;
+	} else {
+		rp->we_allocated_buffer = false;
+	}
+
+	if (rp->we_allocated_buffer || (rp->rle && (rp->undefined_mode == BMP_UNDEFINED_TO_ALPHA)))
+		memset(*buffer, 0, buffer_size);
+
+	if (!rp->region_mode) {
+		rp->region_mode = true;
+		if (!s_start_decoding(rp))
+			goto abort;
+	}
+
+	/* error state is per region */
+	rp->file_eof        = false;
+	rp->file_err        = false;
+	rp->invalid_index   = false;
+	rp->invalid_delta   = false;
+	rp->invalid_overrun = false;
+	rp->truncated       = false;
+
+	if (rp->rle || rp->ih->compression == BI_OS2_HUFFMAN) {
+		if (!s_read_region_compressed(rp, x, y, width, height, *buffer, nrows))
+			goto abort;
+	} else {
+		if (!s_read_region_uncompressed(rp, x, y, width, height, *buffer, nrows))
+			goto abort;
+	}
+
+	s_log_error_from_state(rp);
+	if (s_stopping_error(rp)) {
+		rp->truncated = true;
+		return BMP_RESULT_TRUNCATED;
+	} else if (s_cont_error(rp))
+		return BMP_RESULT_INVALID;
+
+	return BMP_RESULT_OK;
+
+abort:
+	if (rp->we_allocated_buffer) {
+		cm_free(&rp->allocator, *buffer);
+		*buffer = NULL;
+	}
+	return BMP_RESULT_ERROR;
+}
+
+
+/* both set *nrows to the number of complete lines in buffer */
+static bool s_read_region_uncompressed(BMPREAD_R rp, int x, int y, int width, int height,
+                                       unsigned char *restrict buffer, int *restrict nrows)
+{
+	size_t         stride, linesize, first, span, avail, pos;
+	int            row, file_y, npixels, bits;
+	unsigned char *line;
+
+	bits     = rp->ih->bitcount;
+	stride   = cm_align4size(((size_t) rp->width * bits + 7) / 8);
+	linesize = (size_t) width * rp->result_bytes_per_pixel;
+	first    = (size_t) x * bits / 8;
+	span     = ((size_t) (x + width) * bits + 7) / 8 - first;
+
+	/* only the first line (in file order) can be behind us */
+	file_y = (rp->orientation == BMP_ORIENT_TOPDOWN) ? y : (int) rp->height - y - height;
+	pos    = rp->fh->offbits + (size_t) file_y * stride + first;
+	if (pos < rp->bytes_read - rp->rbuf_pos && !br_can_seek(rp)) {
+		logerr(rp->log, "Cannot go back in an image read from a non-seekable file");
+		rp->lasterr = BMP_ERR_REGION;
+		return false;
+	}
+
+	/* go through the lines in file order */
+	for (int i = 0; i < height; i++) {
+		row    = (rp->orientation == BMP_ORIENT_TOPDOWN) ? i : height - 1 - i;
+		file_y = (rp->orientation == BMP_ORIENT_TOPDOWN) ? y + row : (int) rp->height - 1 - (y + row);
+		line   = buffer + (size_t) row * linesize;
+
+		pos = rp->fh->offbits + (size_t) file_y * stride + first;
+		if (!cm_seek(rp, pos)) {
+			s_set_file_error(rp);
+			break;
+		}
+		avail = MIN(cm_fill_readbuf(rp, span), span);
+
+		if (bits <= 8) {
+			/* complete pixels, x doesn't need to start on a byte boundary */
+			npixels = (int) MIN((size_t) width, (avail * 8 - ((size_t) x * bits) % 8) / bits);
+			if (avail)
+				s_add_invalid_index(rp, s_decode_indexed(rp, rp->rbuf + rp->rbuf_pos, line,
+				                                         (int) (((size_t) x * bits) % 8 / bits),
+				                                         npixels));
+		} else {
+			npixels = (int) (avail / (bits / 8));
+			rp->rgb_kernel(rp, rp->rbuf + rp->rbuf_pos, line, npixels);
+		}
+
+		rp->rbuf_pos   += avail;
+		rp->bytes_read += avail;
+
+		if (avail < span) {
+			s_set_file_error(rp);
+			break;
+		}
+		(*nrows)++;
+	}
+	return true;
+}
+
+
+static bool s_read_region_compressed(BMPREAD_R rp, int x, int y, int width, int height,
+                                     unsigned char *restrict buffer, int *restrict nrows)
+{
+	int       file_y0, file_y, row, mark;
+	size_t    linesize;
+	bool      topdown = rp->orientation == BMP_ORIENT_TOPDOWN;
+
+	linesize = (size_t) width * rp->result_bytes_per_pixel;
+	file_y0  = topdown ? y : (int) rp->height - y - height;
+
+	if (!rp->line_index)
+		s_build_line_index(rp);
+
+	if (rp->line_index) {
+		mark = MIN(file_y0, rp->line_index_rows - 1) / INDEX_STEP;
+		/* only jump if that gets us closer (or we must go back) */
+		if (rp->lbl_y > file_y0 || rp->lbl_y < mark * INDEX_STEP) {
+			if (!s_set_line_mark(rp, &rp->line_index[mark], mark * INDEX_STEP))
+				return false;
+			rp->rle_eof = false;
+		}
+	} else if (rp->lbl_y > file_y0) {
+		logerr(rp->log, "Cannot go back in a compressed image read from "
+		                "a non-seekable file");
+		rp->lasterr = BMP_ERR_REGION;
+		return false;
+	}
+
+	/* parse (but don't draw) up to the first wanted line */
+	while (rp->lbl_y < file_y0 && !(rp->rle_eof || s_stopping_error(rp)))
+		s_read_one_line(rp, NULL);
+
+	rp->clip_x0 = x;
+	rp->clip_x1 = x + width;
+	for (file_y = rp->lbl_y; file_y < file_y0 + height; file_y++) {
+		if (rp->rle_eof || s_stopping_error(rp))
+			break;
+		row = topdown ? file_y - y : (int) rp->height - 1 - file_y - y;
+		s_read_one_line(rp, buffer + (size_t) row * linesize);
+		if (!s_stopping_error(rp))
+			(*nrows)++;
+	}
+	rp->clip_x0 = 0;
+	rp->clip_x1 = rp->width;
+
+	/* the lines after an early end of bitmap are valid (and empty) */
+	if (rp->rle_eof && !s_stopping_error(rp))
+		*nrows = height;
+
+	return true;
+}
+
+
+
+/********************************************************
+ * 	s_start_decoding
+ *
+ * called once before the first line is decoded
+ *******************************************************/
+
+static bool s_start_decoding(BMPREAD_R rp)
+{
+	if (rp->bytes_read > rp->fh->offbits) {
+		logerr(rp->log, "Corrupt file");
+		return false;
+	}
+	/* skip to actual bitmap data: */
+	if (!cm_gobble_up(rp, rp->fh->offbits - rp->bytes_read)) {
+		logerr(rp->log, "while seeking start of bitmap data");
+		return false;
+	}
+	/* from here on, the file belongs to us */
+	rp->readahead = true;
+
+	for (int i = 0; i < 4; i++)
+		rp->chan[i] = i;
+	if (rp->order == BMP_ORDER_BGR) {
+		rp->chan[0] = 2;
+		rp->chan[2] = 0;
+	}
+	rp->clip_x0 = 0;
+	rp->clip_x1 = rp->width;
+	rp->passthrough = s_can_passthrough(rp);
+
+	if (rp->ih->bitcount > 8 && !rp->rle)
+		s_choose_rgb_kernel(rp);
+	else if (rp->palette && !rp->result_indexed)
+		s_build_palette_lut(rp);
+
+	return true;
+}
+
+
+
+/********************************************************
+ * 	s_read_whole_image
+ *******************************************************/
+
+static void s_read_whole_image(BMPREAD_R rp, unsigned char *restrict image)
+{
+	int          y, yoff = 1;
+	size_t       linesize, real_y;
+
+	if (rp->scale_shift) {
+		/* no threads, every band would have to skip lines */
+		while (br_lines_left(rp, (int) rp->height) > 0) {
+			s_skip_to_sampled(rp);
+			if (s_stopping_error(rp))
+				break;
+			real_y = (rp->orientation == BMP_ORIENT_TOPDOWN) ? (unsigned) rp->lbl_y : rp->height-1-rp->lbl_y;
+			s_read_one_line(rp, image + (real_y >> rp->scale_shift) * rp->result_stride);
+			if (rp->rle_eof || s_stopping_error(rp))
+				break;
+		}
+		return;
+	}
+
+	linesize = (size_t) rp->width * rp->result_bytes_per_pixel;
+
+	if (rp->passthrough && rp->orientation == BMP_ORIENT_TOPDOWN &&
+	    linesize == cm_align4size(linesize) && rp->result_stride == linesize) {
+		s_read_passthrough_image(rp, image);
+		return;
+	}
+
+	/* multi-threaded decoding covers all complete lines (or,
+	 * for RLE, all lines up to the end of the RLE data or the
+	 * first stopping error), whatever is left is done below.
+	 */
+	y = s_read_bands(rp, image);
+	if (rp->rle_eof || s_stopping_error(rp))
+		return;
+
+	for (; y < (int) rp->height; y += yoff) {
+		real_y = (rp->orientation == BMP_ORIENT_TOPDOWN) ? y : rp->height-1-y;
+		s_read_one_line(rp, image + real_y * rp->result_stride);
+		if (rp->rle_eof || s_stopping_error(rp))
+			break;
+	}
+}
+
+
+
+/********************************************************
+ * 	s_read_bands
+ *
+ * Uncompressed images from memory/mmap: every line's
+ * position is known up front, so we can split the image
+ * into bands and decode them in parallel. (RLE and
+ * Huffman images see s_read_seq_bands().)
+ * Returns the number of lines decoded (0 if the image
+ * isn't suitable or only one thread was requested).
+ *******************************************************/
+
+#define BAND_MIN_PIXELS (64 * 1024)
+
+#if HAVE_PTHREAD
+struct Band {
+	BMPREAD_R            rp;
+	unsigned char       *image;
+	const unsigned char *data;     /* start of first file line */
+	size_t               stride;   /* file line length incl. padding */
+	int                  y0, y1;   /* file lines y0 ... y1-1 */
+	unsigned long        invalid;  /* number of invalid indices */
+};
+
+struct SeqBand {
+	struct Bmpread       h;        /* private copy of the handle */
+	unsigned char       *image;
+	int                  y0, y1;
+};
+
+static void* s_decode_band(void *arg);
+static void* s_decode_seq_band(void *arg);
+static int   s_read_seq_bands(BMPREAD_R rp, unsigned char *restrict image);
+#endif
+
+static int s_read_bands(BMPREAD_R rp, unsigned char *restrict image)
+{
+#if HAVE_PTHREAD
+	struct Band band[BMP_MAX_THREADS];
+	int         i, nthreads, nlines;
+	size_t      stride;
+
+	if (rp->nthreads < 2 || !rp->rbuf_static)
+		return 0;
+
+	if (rp->rle || rp->ih->compression == BI_OS2_HUFFMAN)
+		return s_read_seq_bands(rp, image);
+
+	stride   = cm_align4size(((size_t) rp->width * rp->ih->bitcount + 7) / 8);
+	nlines   = (int) MIN((size_t) rp->height, (rp->rbuf_len - rp->rbuf_pos) / stride);
+	nthreads = (int) MIN((uint64_t) rp->nthreads,
+	                     (uint64_t) nlines * rp->width / BAND_MIN_PIXELS);
+	if (nthreads < 2)
+		return 0;
+
+	for (i = 0; i < nthreads; i++) {
+		band[i].rp      = rp;
+		band[i].image   = image;
+		band[i].data    = rp->rbuf + rp->rbuf_pos;
+		band[i].stride  = stride;
+		band[i].y0      = (int) ((int64_t) nlines * i / nthreads);
+		band[i].y1      = (int) ((int64_t) nlines * (i + 1) / nthreads);
+		band[i].invalid = 0;
+	}
+
+	cm_run_threads(s_decode_band, band, sizeof *band, nthreads);
+
+	for (i = 0; i < nthreads; i++) {
+		s_add_invalid_index(rp, band[i].invalid);
+	}
+
+	rp->rbuf_pos   += (size_t) nlines * stride;
+	rp->bytes_read += (size_t) nlines * stride;
+	rp->lbl_y       = nlines;
+	rp->lbl_file_y  = nlines;
+	if (rp->lbl_y >= (int) rp->height)
+		rp->image_loaded = true;
+
+	return nlines;
+#else
+	(void) rp;
+	(void) image;
+	return 0;
+#endif
+}
+
+
+#if HAVE_PTHREAD
+static void* s_decode_band(void *arg)
+{
+	struct Band   *band = arg;
+	BMPREAD_R      rp   = band->rp;
+	size_t         real_y;
+	unsigned char *line;
+
+	for (int y = band->y0; y < band->y1; y++) {
+		real_y = (rp->orientation == BMP_ORIENT_TOPDOWN) ? y : rp->height-1-y;
+		line   = band->image + real_y * rp->result_stride;
+
+		if (rp->ih->bitcount <= 8) {
+			band->invalid += s_decode_indexed(rp, band->data + y * band->stride,
+			                                  line, 0, rp->width);
+		} else {
+			rp->rgb_kernel(rp, band->data + y * band->stride, line, rp->width);
+		}
+	}
+	return NULL;
+}
+
+
+
+/********************************************************
+ * 	s_read_seq_bands
+ *
+ * RLE and Huffman lines can't be located by offset.
+ * s_build_line_index() first walks the codes (without
+ * writing any pixels) and remembers the decoder state at every INDEX_STEP-th
+ * line. Each band then gets its own copy of the handle,
+ * set to the state at its first line, and decodes its lines
+ * with the regular s_read_one_line(). Error flags are
+ * collected afterwards.
+ *******************************************************/
+
+static int s_read_seq_bands(BMPREAD_R rp, unsigned char *restrict image)
+{
+	struct SeqBand  *band;
+	struct Bmpread  *last;
+	int              i, nthreads, nmarks;
+
+	if ((uint64_t) rp->width * rp->height / BAND_MIN_PIXELS < 2)
+		return 0;
+
+	if (!rp->line_index && !s_build_line_index(rp))
+		return 0;
+
+	nmarks   = (rp->line_index_rows + INDEX_STEP - 1) / INDEX_STEP;
+	nthreads = (int) MIN((uint64_t) rp->nthreads, (uint64_t) rp->line_index_rows * rp->width / BAND_MIN_PIXELS);
+	nthreads = MIN(nthreads, nmarks);
+	if (nthreads < 2)
+		return 0;
+
+	if (!(band = cm_malloc(&rp->allocator, nthreads * sizeof *band)))
+		return 0; /* not fatal, decode with one thread */
+
+	for (i = 0; i < nthreads; i++) {
+		band[i].h     = *rp;
+		band[i].image = image;
+		band[i].y0    = nmarks * i / nthreads * INDEX_STEP;
+		band[i].y1    = MIN(nmarks * (i + 1) / nthreads * INDEX_STEP, rp->line_index_rows);
+		memset(&band[i].h.stats, 0, sizeof band[i].h.stats);
+		s_set_line_mark(&band[i].h, &rp->line_index[band[i].y0 / INDEX_STEP], band[i].y0);
+	}
+
+	cm_run_threads(s_decode_seq_band, band, sizeof *band, nthreads);
+
+	for (i = 0; i < nthreads; i++) {
+		rp->lasterr         |= band[i].h.lasterr;
+		rp->invalid_index   |= band[i].h.invalid_index;
+		rp->invalid_delta   |= band[i].h.invalid_delta;
+		rp->invalid_overrun |= band[i].h.invalid_overrun;
+		rp->file_err        |= band[i].h.file_err;
+		rp->file_eof        |= band[i].h.file_eof;
+		rp->panic           |= band[i].h.panic;
+		rp->truncated       |= band[i].h.truncated;
+		cm_add_stats(&rp->stats, &band[i].h.stats);
+	}
+
+	last = &band[nthreads - 1].h;
+	rp->rbuf_pos     = last->rbuf_pos;
+	rp->bytes_read   = last->bytes_read;
+	rp->lbl_x        = last->lbl_x;
+	rp->lbl_y        = last->lbl_y;
+	rp->lbl_file_y   = last->lbl_file_y;
+	rp->rle_eol      = last->rle_eol;
+	rp->rle_eof      = last->rle_eof;
+	rp->hufbuf       = last->hufbuf;
+	rp->hufbuf_len   = last->hufbuf_len;
+	rp->image_loaded = last->image_loaded;
+	cm_free(&rp->allocator, band);
+
+	return rp->line_index_rows;
+}
+
+
+static void* s_decode_seq_band(void *arg)
+{
+	struct SeqBand *band = arg;
+	BMPREAD_R       rp   = &band->h;
+	size_t          real_y;
+
+	for (int y = band->y0; y < band->y1; y++) {
+		real_y = (rp->orientation == BMP_ORIENT_TOPDOWN) ? y : rp->height-1-y;
+		s_read_one_line(rp, band->image + real_y * rp->result_stride);
+		if (rp->rle_eof || s_stopping_error(rp))
+			break;
+	}
+	return NULL;
+}
+#endif
+
+
+
+/********************************************************
+ * 	s_build_line_index
+ *
+ * Needs all the data in memory or a seekable file. The
+ * parse runs on a copy of the handle, so none of the
+ * state/error flags of the real handle are touched.
+ * With a file, the copy reads through the (shared) read
+ * buffer, so afterwards we take over its buffer and
+ * seek back to where we were.
+ *******************************************************/
+
+static bool s_build_line_index(BMPREAD_R rp)
+{
+	struct Bmpread scan;
+	int            y, nmarks;
+	size_t         pos;
+
+	if (!(rp->rle || rp->ih->compression == BI_OS2_HUFFMAN))
+		return false;
+	if (!br_can_seek(rp))
+		return false;
+
+	nmarks = (int) ((rp->height + INDEX_STEP - 1) / INDEX_STEP);
+	if (!(rp->line_index = cm_malloc(&rp->allocator, nmarks * sizeof *rp->line_index)))
+		return false; /* not fatal, we just can't skip ahead */
+
+	scan = *rp;
+	for (y = 0; y < (int) rp->height; y++) {
+		if (y % INDEX_STEP == 0) {
+			rp->line_index[y / INDEX_STEP] = (struct LineMark) {
+				.pos        = scan.rbuf_pos,
+				.bytes_read = scan.bytes_read,
+				.x          = scan.lbl_x,
+				.file_y     = scan.lbl_file_y,
+				.eol        = scan.rle_eol,
+				.hufbuf     = scan.hufbuf,
+				.hufbuf_len = scan.hufbuf_len,
+			};
+		}
+		s_read_one_line(&scan, NULL);
+		if (scan.rle_eof || s_stopping_error(&scan)) {
+			y++;
+			break;
+		}
+	}
+	rp->line_index_rows = y;
+
+	if (!rp->rbuf_static) {
+		pos = rp->bytes_read;
+		rp->rbuf       = scan.rbuf;
+		rp->rbuf_size  = scan.rbuf_size;
+		rp->rbuf_len   = scan.rbuf_len;
+		rp->rbuf_pos   = scan.rbuf_pos;
+		rp->bytes_read = scan.bytes_read;
+		if (!cm_seek(rp, pos)) {
+			rp->file_err = true;
+			cm_free(&rp->allocator, rp->line_index);
+			rp->line_index = NULL;
+			return false;
+		}
+	}
+	return true;
+}
+
+
+static bool s_set_line_mark(BMPREAD_R rp, const struct LineMark *mark, int y)
+{
+	if (rp->rbuf_static) {
+		rp->rbuf_pos   = mark->pos;
+		rp->bytes_read = mark->bytes_read;
+	} else if (!cm_seek(rp, mark->bytes_read)) {
+		rp->file_err = true;
+		return false;
+	}
+	rp->lbl_x      = mark->x;
+	rp->lbl_file_y = mark->file_y;
+	rp->rle_eol    = mark->eol;
+	rp->hufbuf     = mark->hufbuf;
+	rp->hufbuf_len = mark->hufbuf_len;
+	rp->lbl_y      = y;
+	return true;
+}
+
+
+/********************************************************
+ * 	br_can_seek
+ *
+ * Memory is always 'seekable'. For a file, a zero seek
+ * tells us whether we could go back (not on pipes).
+ *******************************************************/
+
+bool br_can_seek(BMPREAD_R rp)
+{
+	if (rp->rbuf_static)
+		return true;
+	if (rp->no_seek || fseek(rp->file, 0, SEEK_CUR)) {
+		rp->no_seek = true;
+		return false;
+	}
+	return true;
+}
+
+
+
+/********************************************************
+ * 	br_feed_scan
+ *
+ * Find out how many lines can be decoded from the data
+ * fed so far. Uncompressed lines are simply counted.
+ * RLE/Huffman lines are walked (without writing any
+ * pixels) on a copy of the handle, same as in
+ * s_build_line_index(), starting at the last line which
+ * was found to be complete. A line which runs into the
+ * end of the data is not complete (yet), so we keep the
+ * state before that line for the next round. The Huffman
+ * decoder doesn't flag the end of the data, it just runs
+ * with the bits it has. So a Huffman line only counts as
+ * complete if there is still data left after it, i.e.
+ * the bit buffer was always filled.
+ * Once the end of the data was signaled, all lines are
+ * 'ready', missing ones will be reported as truncated.
+ *******************************************************/
+
+void br_feed_scan(BMPREAD_R rp)
+{
+	struct Bmpread scan;
+	size_t         stride, avail;
+
+	if (rp->feed_end) {
+		rp->feed_rows = (int) rp->height;
+		return;
+	}
+
+	if (rp->feed_rows >= (int) rp->height)
+		return;
+
+	if (!(rp->rle || rp->ih->compression == BI_OS2_HUFFMAN)) {
+		stride = cm_align4size(((size_t) rp->width * rp->ih->bitcount + 7) / 8);
+		avail  = rp->rbuf_len > rp->fh->offbits ? rp->rbuf_len - rp->fh->offbits : 0;
+		rp->feed_rows = (int) MIN((size_t) rp->height, avail / stride);
+		return;
+	}
+
+	scan = *rp;
+	scan.readahead       = true;
+	scan.clip_x0         = 0;
+	scan.clip_x1         = rp->width;
+	scan.rle_eof         = false;
+	scan.file_eof        = false;
+	scan.file_err        = false;
+	scan.panic           = false;
+	scan.invalid_delta   = false;
+	scan.invalid_overrun = false;
+	scan.image_loaded    = false;
+	s_set_line_mark(&scan, &rp->feed_mark, rp->feed_rows);
+
+	while (scan.lbl_y < (int) rp->height) {
+		s_read_one_line(&scan, NULL);
+		if (scan.file_eof || scan.file_err)
+			break;  /* line isn't complete, yet */
+		if (!rp->rle && scan.rbuf_pos >= scan.rbuf_len)
+			break;  /* Huffman, maybe not complete */
+		if (scan.rle_eof || s_stopping_error(&scan)) {
+			rp->feed_rows = (int) rp->height;
+			break;
+		}
+		rp->feed_rows = scan.lbl_y;
+		rp->feed_mark = (struct LineMark) {
+			.pos        = scan.rbuf_pos,
+			.bytes_read = scan.bytes_read,
+			.x          = scan.lbl_x,
+			.file_y     = scan.lbl_file_y,
+			.eol        = scan.rle_eol,
+			.hufbuf     = scan.hufbuf,
+			.hufbuf_len = scan.hufbuf_len,
+		};
+	}
+}
+
+
+
+/********************************************************
+ * 	s_feed_lines_ready
+ *
+ * bmpread_feed() handles: are (file) lines 0 ... y_end-1
+ * available?
+ *******************************************************/
+
+static bool s_feed_lines_ready(BMPREAD_R rp, int y_end)
+{
+	if (!rp->feed || y_end <= rp->feed_rows)
+		return true;
+
+	logerr(rp->log, "Only %d of %d lines have been fed so far", rp->feed_rows, y_end);
+	return false;
+}
+
+
+
+/********************************************************
+ * 	br_lines_left
+ *
+ * bmpread_set_scale(): how many of the (file) lines
+ * lbl_y ... y_end-1 end up in the result? The sampled
+ * lines are the ones with y % 2^n == 0 in image
+ * coordinates, i.e. counted from the top.
+ *******************************************************/
+
+static int s_first_sampled(BMPREAD_R rp, int y)
+{
+	unsigned step = 1U << rp->scale_shift;
+	int      offs = 0;
+
+	if (rp->orientation != BMP_ORIENT_TOPDOWN)
+		offs = (int) ((rp->height - 1) % step);
+
+	return y + (int) ((unsigned) (offs - y) & (step - 1));
+}
+
+int br_lines_left(BMPREAD_R rp, int y_end)
+{
+	int first = s_first_sampled(rp, rp->lbl_y);
+
+	if (first >= y_end)
+		return 0;
+	return ((y_end - 1 - first) >> rp->scale_shift) + 1;
+}
+
+
+
+/********************************************************
+ * 	s_sampled_end
+ *
+ * the file line after the nlines-th sampled line from
+ * lbl_y on, i.e. the y_end for s_feed_lines_ready().
+ *******************************************************/
+
+static int s_sampled_end(BMPREAD_R rp, int nlines)
+{
+	return s_first_sampled(rp, rp->lbl_y) + ((nlines - 1) << rp->scale_shift) + 1;
+}
+
+
+
+/********************************************************
+ * 	s_skip_to_sampled
+ *
+ * advance lbl_y to the next line which is part of the
+ * (scaled) result.
+ *******************************************************/
+
+static void s_skip_to_sampled(BMPREAD_R rp)
+{
+	int first = s_first_sampled(rp, rp->lbl_y);
+
+	while (rp->lbl_y < first && !s_stopping_error(rp) && !rp->rle_eof)
+		s_read_one_line(rp, NULL);
+}
+
+
+
+/********************************************************
+ * 	s_read_next_line
+ *
+ * line-by-line loading, skip any lines dropped by
+ * bmpread_set_scale() and read the next one.
+ *******************************************************/
+
+static void s_read_next_line(BMPREAD_R rp, unsigned char *restrict line)
+{
+	if (rp->scale_shift) {
+		s_skip_to_sampled(rp);
+		if (rp->lbl_y < (int) rp->height && !s_stopping_error(rp))
+			s_read_one_line(rp, line);
+		if (br_lines_left(rp, (int) rp->height) == 0)
+			rp->image_loaded = true;
+	} else {
+		s_read_one_line(rp, line);
+	}
+}
+
+
+
+/********************************************************
+ * 	s_skip_line
+ *
+ * skip an uncompressed line that isn't part of the scaled
+ * result. Seek if we can, otherwise read it into the
+ * void (pipes), once seeking has failed we don't try
+ * again.
+ *******************************************************/
+
+static void s_skip_line(BMPREAD_R rp, size_t linesize)
+{
+	size_t avail, n;
+
+	avail = MIN(rp->rbuf_len - rp->rbuf_pos, linesize);
+	rp->rbuf_pos   += avail;
+	rp->bytes_read += avail;
+	linesize       -= avail;
+
+	if (!linesize)
+		return;
+
+	if (rp->rbuf_static) {
+		s_set_file_error(rp);
+		return;
+	}
+
+	if (!rp->no_seek && linesize <= LONG_MAX) {
+		if (!fseek(rp->file, (long) linesize, SEEK_CUR)) {
+			rp->rbuf_pos    = 0;
+			rp->rbuf_len    = 0;
+			rp->bytes_read += linesize;
+			return;
+		}
+		rp->no_seek = true;
+	}
+
+	while (linesize) {
+		n = MIN(cm_fill_readbuf(rp, MIN(linesize, READBUF_CHUNK)), linesize);
+		if (!n) {
+			s_set_file_error(rp);
+			return;
+		}
+		rp->rbuf_pos   += n;
+		rp->bytes_read += n;
+		linesize       -= n;
+	}
+}
+
+
+
+/********************************************************
+ * 	s_read_passthrough_image
+ *
+ * Top-down image, file lines have no padding and are
+ * already in the result format. Copy in one go.
+ *******************************************************/
+
+static size_t s_clamp_indices(BMPREAD_R rp, unsigned char *restrict data, size_t n);
+
+static void s_read_passthrough_image(BMPREAD_R rp, unsigned char *restrict image)
+{
+	size_t size, linesize, n, last, keep;
+	int    bytes_per_pixel;
+
+	bytes_per_pixel = rp->ih->bitcount / 8;
+	linesize = (size_t) rp->width * bytes_per_pixel;
+	size     = linesize * rp->height;
+
+	n = MIN(rp->rbuf_len - rp->rbuf_pos, size);
+	memcpy(image, rp->rbuf + rp->rbuf_pos, n);
+	rp->rbuf_pos += n;
+	if (n < size && !rp->rbuf_static)
+		n += fread(image + n, 1, size - n, rp->file);
+	rp->bytes_read += n;
+
+	if (rp->result_indexed && rp->palette->numcolors < 256) {
+		s_add_invalid_index(rp, s_clamp_indices(rp, image, n));
+	}
+
+	rp->lbl_y = (int) (n / linesize);
+
+	if (n < size) {
+		/* treat the incomplete last line the same as
+		 * s_read_rgb_line()/s_read_indexed_line() would.
+		 */
+		last = n % linesize;
+		if (rp->result_indexed)
+			keep = last & ~(size_t) 3;
+		else
+			keep = last / bytes_per_pixel * bytes_per_pixel;
+		memset(image + n - last + keep, 0, last - keep);
+		rp->lbl_y++;
+		s_set_file_error(rp);
+	}
+	if (rp->lbl_y >= (int) rp->height)
+		rp->image_loaded = true;
+}
+
 
-static void s_read_whole_image(BMPREAD_R rp, unsigned char *restrict image)
+static size_t s_clamp_indices(BMPREAD_R rp, unsigned char *restrict data, size_t n)
 {
-	int          y, yoff = 1;
-	size_t       linesize, real_y;
-
-	linesize = (size_t) rp->width * rp->result_bytes_per_pixel;
+	int    maxidx = rp->palette->numcolors - 1;
+	size_t invalid = 0;
 
-	for (y = 0; y < (int) rp->height; y += yoff) {
-		real_y = (rp->orientation == BMP_ORIENT_TOPDOWN) ? y : rp->height-1-y;
-		s_read_one_line(rp, image + real_y * linesize);
-		if (rp->rle_eof || s_stopping_error(rp))
-			break;
+	for (size_t i = 0; i < n; i++) {
+		if (data[i] > maxidx) {
+			data[i] = maxidx;
+			invalid++;
+		}
 	}
+	return invalid;
 }
 
 
@@ -268,6 +1401,7 @@ static void s_read_one_line(BMPREAD_R rp, unsigned char *restrict line)
 			if (!(rp->rle_eof || s_stopping_error(rp))) {
 				if (yoff > (int) rp->height - rp->lbl_file_y) {
 					rp->invalid_delta = true;
+					rp->stats.invalid_delta++;
 				}
 				rp->lbl_file_y += yoff;
 
@@ -291,17 +1425,328 @@ static void s_read_one_line(BMPREAD_R rp, unsigned char *restrict line)
  * 	s_read_rgb_line
  *******************************************************/
 
-static inline bool     s_read_rgb_pixel(BMPREAD_R rp, union Pixel *restrict px);
+static void s_read_rgb_line(BMPREAD_R rp, unsigned char *restrict line)
+{
+	int    npixels, bytes_per_pixel;
+	size_t linesize, avail;
+
+	/* read the whole line including padding in one go. If the
+	 * file ends prematurely, we still convert all complete pixels.
+	 */
+	bytes_per_pixel = rp->ih->bitcount / 8;
+	linesize = cm_align4size((size_t) rp->width * bytes_per_pixel);
+
+	if (!line) {
+		s_skip_line(rp, linesize);
+		return;
+	}
+
+	avail    = MIN(cm_fill_readbuf(rp, linesize), linesize);
+	npixels  = (int) MIN((size_t) rp->width, avail / bytes_per_pixel);
+
+	if (rp->scale_shift) {
+		/* point sampling, convert only every 2^n-th pixel */
+		for (int x = 0; x < npixels; x += 1 << rp->scale_shift) {
+			rp->rgb_kernel(rp, rp->rbuf + rp->rbuf_pos + (size_t) x * bytes_per_pixel,
+			               line + (size_t) (x >> rp->scale_shift) * rp->result_bytes_per_pixel, 1);
+		}
+	} else {
+		rp->rgb_kernel(rp, rp->rbuf + rp->rbuf_pos, line, npixels);
+	}
+
+	rp->rbuf_pos   += avail;
+	rp->bytes_read += avail;
+
+	if (avail < linesize)
+		s_set_file_error(rp);
+}
+
+
+
+/********************************************************
+ * 	s_choose_rgb_kernel
+ *
+ * The generic kernel handles any combination of masks
+ * and result formats. For the most common layouts
+ * with 8-bit (or 565/555) channels, we have dedicated
+ * kernels which don't need the per-pixel mask/shift/
+ * scale arithmetic. The heavy lifting is done by the
+ * SIMD/C kernels in kernels.c. Float and s2.13 output
+ * is made from 8-bit pixels in chunks.
+ *******************************************************/
+
+static void s_kernel_generic(BMPREAD_R rp, const unsigned char *restrict data,
+                             unsigned char *restrict line, int npixels);
+static void s_kernel_bgr24(BMPREAD_R rp, const unsigned char *restrict data,
+                           unsigned char *restrict line, int npixels);
+static void s_kernel_bgra32(BMPREAD_R rp, const unsigned char *restrict data,
+                            unsigned char *restrict line, int npixels);
+static void s_kernel_copy(BMPREAD_R rp, const unsigned char *restrict data,
+                          unsigned char *restrict line, int npixels);
+static void s_kernel_bytes(BMPREAD_R rp, const unsigned char *restrict data,
+                           unsigned char *restrict line, int npixels);
+static void s_kernel_565(BMPREAD_R rp, const unsigned char *restrict data,
+                         unsigned char *restrict line, int npixels);
+static void s_kernel_555(BMPREAD_R rp, const unsigned char *restrict data,
+                         unsigned char *restrict line, int npixels);
+static void s_kernel_float(BMPREAD_R rp, const unsigned char *restrict data,
+                           unsigned char *restrict line, int npixels);
+static void s_kernel_s2_13(BMPREAD_R rp, const unsigned char *restrict data,
+                           unsigned char *restrict line, int npixels);
+static bool s_is_mask(const struct Colormask *cmask, unsigned long long r, unsigned long long g,
+                                                     unsigned long long b, unsigned long long a);
+
+static void s_choose_rgb_kernel(BMPREAD_R rp)
+{
+	int  i, nchannels;
+	bool bytes = true;
+
+	rp->rgb_kernel = s_kernel_generic;
+	rp->u8_kernel  = NULL;
+
+	if (rp->passthrough) {
+		rp->rgb_kernel = s_kernel_copy;
+		return;
+	}
+
+	switch (rp->ih->bitcount) {
+	case 16:
+		/* 565/555 kernels only produce RGB order */
+		if (rp->order == BMP_ORDER_BGR)
+			break;
+		if (s_is_mask(&rp->cmask, 0xf800, 0x07e0, 0x001f, 0))
+			rp->u8_kernel = s_kernel_565;
+		else if (s_is_mask(&rp->cmask, 0x7c00, 0x03e0, 0x001f, 0))
+			rp->u8_kernel = s_kernel_555;
+		break;
+
+	case 24:
+	case 32:
+		if (s_is_mask(&rp->cmask, 0xff0000, 0x00ff00, 0x0000ff, 0) && rp->ih->bitcount == 24) {
+			if (rp->order == BMP_ORDER_BGR)
+				rp->u8_kernel = s_kernel_copy;
+			else
+				rp->u8_kernel = s_kernel_bgr24;
+			break;
+		}
+		if (s_is_mask(&rp->cmask, 0xff0000, 0x00ff00, 0x0000ff, 0xff000000UL)) {
+			if (rp->order == BMP_ORDER_BGR)
+				rp->u8_kernel = s_kernel_copy;
+			else
+				rp->u8_kernel = s_kernel_bgra32;
+			break;
+		}
+
+		/* any other layout with 8-bit channels on byte boundaries */
+		nchannels = rp->has_alpha ? 4 : 3;
+		for (i = 0; i < nchannels; i++) {
+			if (rp->cmask.bits.value[i] != 8 || rp->cmask.shift.value[i] % 8) {
+				bytes = false;
+				break;
+			}
+			rp->kernel_offs[rp->chan[i]] = rp->cmask.shift.value[i] / 8;
+		}
+		if (bytes)
+			rp->u8_kernel = s_kernel_bytes;
+		break;
+	}
+
+	if (!rp->u8_kernel)
+		return;
+
+	switch (rp->result_format) {
+	case BMP_FORMAT_INT:
+		if (rp->result_bitsperchannel == 8)
+			rp->rgb_kernel = rp->u8_kernel;
+		break;
+
+	case BMP_FORMAT_FLOAT:
+	case BMP_FORMAT_S2_13:
+		/* 5/6-bit channels are scaled differently to float */
+		if (rp->ih->bitcount == 16)
+			break;
+		if (rp->result_format == BMP_FORMAT_FLOAT)
+			rp->rgb_kernel = s_kernel_float;
+		else
+			rp->rgb_kernel = s_kernel_s2_13;
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+/********************************************************
+ * 	s_can_passthrough
+ *
+ * true if the file's pixel data can be returned as-is:
+ *  - 8-bit indexed, when the caller asked for the index
+ *    data (bmpread_load_palette())
+ *  - 24-bit BGR and 32-bit BGRA with 8-bit result and
+ *    BMP_ORDER_BGR
+ *******************************************************/
+
+static bool s_can_passthrough(BMPREAD_R rp)
+{
+	if (rp->rle || rp->scale_shift)
+		return false;
+
+	switch (rp->ih->bitcount) {
+	case 8:
+		return rp->ih->compression == BI_RGB && rp->result_indexed;
+	case 24:
+	case 32:
+		if (rp->result_format != BMP_FORMAT_INT || rp->result_bitsperchannel != 8 ||
+		    rp->order != BMP_ORDER_BGR)
+			return false;
+		if (rp->ih->bitcount == 24)
+			return s_is_mask(&rp->cmask, 0xff0000, 0x00ff00, 0x0000ff, 0);
+		return s_is_mask(&rp->cmask, 0xff0000, 0x00ff00, 0x0000ff, 0xff000000UL);
+	default:
+		return false;
+	}
+}
+
+
+static bool s_is_mask(const struct Colormask *cmask, unsigned long long r, unsigned long long g,
+                                                     unsigned long long b, unsigned long long a)
+{
+	return cmask->mask.red  == r && cmask->mask.green == g &&
+	       cmask->mask.blue == b && cmask->mask.alpha == a;
+}
+
+
+
+/********************************************************
+ * 	8-bit kernels
+ *******************************************************/
+
+static void s_kernel_bgr24(BMPREAD_R rp, const unsigned char *restrict data,
+                           unsigned char *restrict line, int npixels)
+{
+	rp->kern->swap3(data, line, npixels);
+}
+
+
+static void s_kernel_bgra32(BMPREAD_R rp, const unsigned char *restrict data,
+                            unsigned char *restrict line, int npixels)
+{
+	rp->kern->swap4(data, line, npixels);
+}
+
+
+static void s_kernel_copy(BMPREAD_R rp, const unsigned char *restrict data,
+                          unsigned char *restrict line, int npixels)
+{
+	memcpy(line, data, (size_t) npixels * (rp->ih->bitcount / 8));
+}
+
+
+static void s_kernel_565(BMPREAD_R rp, const unsigned char *restrict data,
+                         unsigned char *restrict line, int npixels)
+{
+	rp->kern->expand565(data, line, npixels);
+}
+
+
+static void s_kernel_555(BMPREAD_R rp, const unsigned char *restrict data,
+                         unsigned char *restrict line, int npixels)
+{
+	rp->kern->expand555(data, line, npixels);
+}
+
+
+static void s_kernel_bytes(BMPREAD_R rp, const unsigned char *restrict data,
+                           unsigned char *restrict line, int npixels)
+{
+	int bytes_per_pixel = rp->ih->bitcount / 8;
+	int r = rp->kernel_offs[0], g = rp->kernel_offs[1], b = rp->kernel_offs[2];
+	int a = rp->kernel_offs[3];
+
+	if (rp->has_alpha) {
+		for (int x = 0; x < npixels; x++) {
+			line[0] = data[r];
+			line[1] = data[g];
+			line[2] = data[b];
+			line[3] = data[a];
+			line += 4;
+			data += bytes_per_pixel;
+		}
+	} else {
+		for (int x = 0; x < npixels; x++) {
+			line[0] = data[r];
+			line[1] = data[g];
+			line[2] = data[b];
+			line += 3;
+			data += bytes_per_pixel;
+		}
+	}
+}
+
+
+
+/********************************************************
+ * 	s_kernel_float / s_kernel_s2_13
+ *******************************************************/
+
+#define KERNEL_CHUNK 512  /* pixels */
+
+static void s_kernel_float(BMPREAD_R rp, const unsigned char *restrict data,
+                           unsigned char *restrict line, int npixels)
+{
+	unsigned char buf[KERNEL_CHUNK * 4];
+	int           n, bytes_per_pixel = rp->ih->bitcount / 8;
+	size_t        nvalues;
+
+	/* converting in chunks keeps the kernel free of per-handle
+	 * state, so it can be used from several threads at once.
+	 */
+	for (; npixels > 0; npixels -= n) {
+		n       = MIN(npixels, KERNEL_CHUNK);
+		nvalues = (size_t) n * rp->result_channels;
+		rp->u8_kernel(rp, data, buf, n);
+		rp->kern->u8_to_float(buf, (float*) line, nvalues);
+		data += (size_t) n * bytes_per_pixel;
+		line += nvalues * sizeof(float);
+	}
+}
+
+
+static void s_kernel_s2_13(BMPREAD_R rp, const unsigned char *restrict data,
+                           unsigned char *restrict line, int npixels)
+{
+	unsigned char buf[KERNEL_CHUNK * 4];
+	int           n, bytes_per_pixel = rp->ih->bitcount / 8;
+	size_t        nvalues;
+
+	for (; npixels > 0; npixels -= n) {
+		n       = MIN(npixels, KERNEL_CHUNK);
+		nvalues = (size_t) n * rp->result_channels;
+		rp->u8_kernel(rp, data, buf, n);
+		rp->kern->u8_to_s2_13(buf, (uint16_t*) line, nvalues);
+		data += (size_t) n * bytes_per_pixel;
+		line += nvalues * sizeof(uint16_t);
+	}
+}
+
+
+
+/********************************************************
+ * 	s_kernel_generic
+ *******************************************************/
+
+static inline void     s_read_rgb_pixel(BMPREAD_R rp, const unsigned char *restrict data,
+                                        union Pixel *restrict px);
 static inline double   s_s2_13_to_float(uint16_t s2_13);
 static inline double   s_int_to_float(unsigned long ul, int bits);
 static inline void     s_convert64(uint16_t *val64);
 static inline void     s_convert64srgb(uint16_t *val64);
-static inline double   s_srgb_gamma_float(double d);
-static inline uint16_t s_srgb_gamma_s2_13(uint16_t s2_13);
 
-static void s_read_rgb_line(BMPREAD_R rp, unsigned char *restrict line)
+static void s_kernel_generic(BMPREAD_R rp, const unsigned char *restrict data,
+                             unsigned char *restrict line, int npixels)
 {
-	int           i, x, padding;
+	int           i, x, bytes_per_pixel;
 	union Pixel   px;
 	size_t        offs;
 	int           bits = rp->result_bitsperchannel;
@@ -309,11 +1754,11 @@ static void s_read_rgb_line(BMPREAD_R rp, unsigned char *restrict line)
 	double        d;
 	uint16_t      s2_13;
 
-	for (x = 0; x < rp->width; x++) {
+	bytes_per_pixel = rp->ih->bitcount / 8;
 
-		if (!s_read_rgb_pixel(rp, &px)) {
-			return;
-		}
+	for (x = 0; x < npixels; x++) {
+
+		s_read_rgb_pixel(rp, data + (size_t) x * bytes_per_pixel, &px);
 
 		offs = x * rp->result_channels;
 
@@ -323,16 +1768,18 @@ static void s_read_rgb_line(BMPREAD_R rp, unsigned char *restrict line)
 				pxval = s_scaleint(px.value[i], rp->cmask.bits.value[i], bits);
 				switch(bits) {
 				case 8:
-					((unsigned char*)line)[offs + i] = pxval;
+					((unsigned char*)line)[offs + rp->chan[i]] = pxval;
 					break;
 				case 16:
-					((uint16_t*)line)[offs + i] = pxval;
+					((uint16_t*)line)[offs + rp->chan[i]] = pxval;
 					break;
 				case 32:
-					((uint32_t*)line)[offs + i] = pxval;
+					((uint32_t*)line)[offs + rp->chan[i]] = pxval;
 					break;
 				default:
-					logerr(rp->log, "Waaaaaaaaaaaaaah!");
+					/* may run in a decoder thread, leave the
+					 * log to s_log_error_from_state()
+					 */
 					rp->panic = true;
 					return;
 				}
@@ -354,15 +1801,15 @@ static void s_read_rgb_line(BMPREAD_R rp, unsigned char *restrict line)
 		case BMP_FORMAT_FLOAT:
 			if (rp->ih->bitcount == 64) {
 				for (i = 0; i < rp->result_channels; i++) {
-					d = s_s2_13_to_float(px.value[i]);
 					if (i < 3 && rp->conv64 == BMP_CONV64_SRGB)
-						d = s_srgb_gamma_float(d);
-					((float*)line)[offs+i] = (float) d;
+						((float*)line)[offs + rp->chan[i]] = s2_13_srgb_float[(uint16_t) px.value[i]];
+					else
+						((float*)line)[offs + rp->chan[i]] = (float) s_s2_13_to_float(px.value[i]);
 				}
 			} else {
 				for (i = 0; i < rp->result_channels; i++) {
 					d = s_int_to_float(px.value[i], rp->cmask.bits.value[i]);
-					((float*)line)[offs + i] = (float) d;
+					((float*)line)[offs + rp->chan[i]] = (float) d;
 				}
 			}
 			break;
@@ -372,30 +1819,26 @@ static void s_read_rgb_line(BMPREAD_R rp, unsigned char *restrict line)
 				for (i = 0; i < rp->result_channels; i++) {
 					s2_13 = px.value[i];
 					if (i < 3 && rp->conv64 == BMP_CONV64_SRGB)
-						s2_13 = s_srgb_gamma_s2_13(s2_13);
-					((uint16_t*)line)[offs+i] = s2_13;
+						s2_13 = s2_13_srgb[s2_13];
+					((uint16_t*)line)[offs + rp->chan[i]] = s2_13;
 				}
 			} else {
 				for (i = 0; i < rp->result_channels; i++) {
 					d = s_int_to_float(px.value[i], rp->cmask.bits.value[i]);
 					d = d * 8192.0 + 0.5;
-					((uint16_t*)line)[offs+i] = (uint16_t) d;
+					((uint16_t*)line)[offs + rp->chan[i]] = (uint16_t) d;
 				}
 			}
 			break;
 
 		default:
-			logerr(rp->log, "Unknown format");
+			/* may run in a decoder thread, leave the
+			 * log to s_log_error_from_state()
+			 */
 			rp->panic = true;
 			return;
 		}
 	}
-	padding = cm_align4padding(((uint64_t)rp->width * rp->ih->bitcount + 7) / 8);
-	if (!cm_gobble_up(rp, padding)) {
-		s_set_file_error(rp);
-		return;
-	}
-	rp->bytes_read += padding;
 }
 
 
@@ -411,57 +1854,32 @@ static inline double s_int_to_float(unsigned long ul, int bits)
 }
 
 
-static inline void s_convert64(uint16_t *val64)
-{
-	double d;
-
-	for (int i = 0; i < 4; i++) {
-		d = (double) (int16_t) val64[i];
-		d /= 8192.0;
-		d = MAX(0.0, d);
-		d = MIN(d, 1.0);
-		val64[i] = (uint16_t) (d * 0xffff + 0.5);
-	}
-}
-
+/* 64-bit conversions use the tables from srgb-tables.h
+ * (generated by gen-srgb.c). s_s2_13_index() clamps to
+ * 0.0...1.0 for the 8193-entry 16-bit tables.
+ */
 
-static inline void s_convert64srgb(uint16_t *val64)
+static inline int s_s2_13_index(uint16_t s2_13)
 {
-	double  d;
-
-	for (int i = 0; i < 4; i++) {
-		d = (double) (int16_t) val64[i];
-		d /= 8192.0;
-		d = MAX(0.0, d);
-		d = MIN(d, 1.0);
+	int v = (int16_t) s2_13;
 
-		/* apply gamma to RGB channels, but not to alpha channel */
-		if (i < 3)
-			d = s_srgb_gamma_float(d);
-
-		val64[i] = (uint16_t) (d * 0xffff + 0.5);
-	}
+	return MIN(MAX(v, 0), 8192);
 }
 
 
-
-static inline double s_srgb_gamma_float(double d)
+static inline void s_convert64(uint16_t *val64)
 {
-	if (d <= 0.0031308)
-		d = 12.92 * d;
-	else
-		d = 1.055 * pow(d, 1.0/2.4) - 0.055;
-	return d;
+	for (int i = 0; i < 4; i++)
+		val64[i] = s2_13_to_16_linear[s_s2_13_index(val64[i])];
 }
 
 
-static inline uint16_t s_srgb_gamma_s2_13(uint16_t s2_13)
+static inline void s_convert64srgb(uint16_t *val64)
 {
-	double d;
-
-	d = (int16_t)s2_13 / 8192.0;
-	d = s_srgb_gamma_float(d);
-	return (uint16_t) (((int)(d * 8192.0 + 0.5)) & 0xffff);
+	/* apply gamma to RGB channels, but not to alpha channel */
+	for (int i = 0; i < 3; i++)
+		val64[i] = s2_13_to_16_srgb[s_s2_13_index(val64[i])];
+	val64[3] = s2_13_to_16_linear[s_s2_13_index(val64[3])];
 }
 
 
@@ -470,18 +1888,15 @@ static inline uint16_t s_srgb_gamma_s2_13(uint16_t s2_13)
  * 	s_read_rgb_pixel
  *******************************************************/
 
-static inline bool s_read_rgb_pixel(BMPREAD_R rp, union Pixel *restrict px)
+static inline void s_read_rgb_pixel(BMPREAD_R rp, const unsigned char *restrict data,
+                                    union Pixel *restrict px)
 {
 	unsigned long long v;
-	int                i, byte;
+	int                i;
 
 	v = 0;
 	for (i = 0; i < rp->ih->bitcount; i+=8 ) {
-		if (EOF == (byte = s_read_one_byte(rp))) {
-			s_set_file_error(rp);
-			return false;
-		}
-		v |= ((unsigned long long)byte) << i;
+		v |= ((unsigned long long) *data++) << i;
 	}
 
 	px->red   = (unsigned int) ((v & rp->cmask.mask.red)   >> rp->cmask.shift.red);
@@ -491,8 +1906,6 @@ static inline bool s_read_rgb_pixel(BMPREAD_R rp, union Pixel *restrict px)
 		px->alpha = (unsigned int) ((v & rp->cmask.mask.alpha) >> rp->cmask.shift.alpha);
 	else
 		px->alpha = (1ULL<<rp->result_bitsperchannel) - 1;
-
-	return true;
 }
 
 
@@ -501,95 +1914,187 @@ static inline bool s_read_rgb_pixel(BMPREAD_R rp, union Pixel *restrict px)
  * 	s_read_indexed_line
  * - 1/2/4/8 bits non-RLE indexed
  *******************************************************/
-static inline bool s_read_n_bytes(BMPREAD_R rp, int n, unsigned long *restrict buff);
-static inline unsigned long s_bits_from_buffer(unsigned long buf, int size,
-                                              int nbits, int used_bits);
 
 static void s_read_indexed_line(BMPREAD_R rp, unsigned char *restrict line)
 {
-	int           bits_used, buffer_size, x = 0, v;
-	bool          done = false;
-	unsigned long buffer;
-	size_t        offs;
+	int    npixels, bits;
+	size_t linesize, avail;
 
-	/* setting the buffer size to the alignment takes care of padding bytes */
-	buffer_size = 32;
+	bits     = rp->ih->bitcount;
+	linesize = cm_align4size(((size_t) rp->width * bits + 7) / 8);
 
-	while (!done && s_read_n_bytes(rp, buffer_size / 8, &buffer)) {
+	if (!line) {
+		s_skip_line(rp, linesize);
+		return;
+	}
 
-		bits_used = 0;
-		while (bits_used < buffer_size) {
+	avail    = MIN(cm_fill_readbuf(rp, linesize), linesize);
 
-			/* mask out the relevant bits for current pixel */
-			v = (int) s_bits_from_buffer(buffer, buffer_size,
-			                             rp->ih->bitcount, bits_used);
-			bits_used += rp->ih->bitcount;
+	/* a truncated line is decoded in units of 32 bits, same as
+	 * when we were reading the file 4 bytes at a time.
+	 */
+	npixels = (int) MIN((uint64_t) rp->width, (uint64_t) (avail & ~(size_t) 3) * 8 / bits);
+	npixels = (npixels + (1 << rp->scale_shift) - 1) >> rp->scale_shift;
 
-			if (v >= rp->palette->numcolors) {
-				v = rp->palette->numcolors - 1;
-				rp->invalid_index = true;
-			}
+	s_add_invalid_index(rp, s_decode_indexed(rp, rp->rbuf + rp->rbuf_pos, line, 0, npixels));
 
-			offs = (size_t) x * rp->result_bytes_per_pixel;
-			if (rp->result_indexed) {
-				line[offs] = v;
-			} else {
-				line[offs]   = rp->palette->color[v].red;
-				line[offs+1] = rp->palette->color[v].green;
-				line[offs+2] = rp->palette->color[v].blue;
-				s_int_to_result_format(rp, 8, line + offs);
-			}
-			if (++x == rp->width) {
-				done = true;
-				break;      /* discarding rest of buffer == padding */
-			}
+	rp->rbuf_pos   += avail;
+	rp->bytes_read += avail;
+
+	if (avail < linesize)
+		s_set_file_error(rp);
+}
+
+
+/* decodes pixels x0 ... x0+npixels-1 of the line at data
+ * (with bmpread_set_scale(): npixels pixels, 2^n apart).
+ * Returns true if there were invalid indices. Doesn't touch
+ * the handle, see s_read_bands().
+ */
+static int s_decode_indexed(BMPREAD_R rp, const unsigned char *restrict data,
+                            unsigned char *restrict line, int x0, int npixels)
+{
+	int    x = 0, v, shift, bits, mask, ppb, bytes;
+	int    invalid = 0;
+	size_t offs, px;
+
+	if (rp->passthrough) {
+		memcpy(line, data + x0, npixels);
+		if (rp->palette->numcolors < 256)
+			invalid = (int) s_clamp_indices(rp, line, npixels);
+		return invalid;
+	}
+
+	bits  = rp->ih->bitcount;
+	mask  = (1 << bits) - 1;
+	bytes = rp->result_bytes_per_pixel;
+
+	if (rp->pal_expand_valid && !rp->scale_shift) {
+		/* single pixels up to the first byte boundary, then
+		 * whole bytes straight from the expansion table
+		 */
+		ppb = 8 / bits;
+		for (; x < npixels && (x0 + x) % ppb; x++) {
+			px    = (size_t) x0 + x;
+			shift = 8 - bits - (int) ((px * bits) % 8);
+			v     = (data[px * bits / 8] >> shift) & mask;
+			invalid += v >= rp->palette->numcolors;
+			s_copy_pixel(line + (size_t) x * bytes, rp->pal_lut + (size_t) v * bytes, bytes);
+		}
+		for (; x + ppb <= npixels; x += ppb) {
+			v = data[(size_t) (x0 + x) / ppb];
+			invalid += rp->pal_expand_invalid[v];
+			memcpy(line + (size_t) x * bytes, rp->pal_expand + (size_t) v * ppb * bytes,
+			       (size_t) ppb * bytes);
+		}
+	}
+
+	for (; x < npixels; x++) {
+		px = (size_t) x0 + ((size_t) x << rp->scale_shift);
+		if (bits == 8) {
+			v = data[px];
+		} else {
+			shift = 8 - bits - (int) ((px * bits) % 8);
+			v     = (data[px * bits / 8] >> shift) & mask;
+		}
+
+		if (v >= rp->palette->numcolors) {
+			v = rp->palette->numcolors - 1;
+			invalid++;
 		}
+
+		offs = (size_t) x * bytes;
+		if (rp->result_indexed)
+			line[offs] = v;
+		else
+			s_copy_pixel(line + offs, rp->pal_lut + (size_t) v * bytes, bytes);
 	}
+	return invalid;
 }
 
 
 
 /********************************************************
- * 	s_read_n_bytes
+ * 	s_build_palette_lut
+ *
+ * indexed image to RGB: convert the palette to the result
+ * format once, so each pixel is a straight copy from
+ * pal_lut. Indices beyond the palette get the last color,
+ * same as the clamping in s_decode_indexed(). For 1/2/4-bit
+ * images with 8-bit results, pal_expand additionally holds
+ * all 8/4/2 pixels for each possible byte value.
  *******************************************************/
 
-static inline bool s_read_n_bytes(BMPREAD_R rp, int n, unsigned long *restrict buff)
+static void s_build_palette_lut(BMPREAD_R rp)
 {
-	int byte;
+	unsigned char px[16];
+	int           i, j, v, bits, ppb, bytes, ncolors;
+
+	bytes   = rp->result_bytes_per_pixel;
+	ncolors = rp->palette->numcolors;
+	bits    = rp->ih->bitcount;
+
+	for (i = 0; i < 256; i++) {
+		v = MIN(i, ncolors - 1);
+		memset(px, 0, sizeof px);
+		if (v >= 0) {
+			px[rp->chan[0]] = rp->palette->color[v].red;
+			px[rp->chan[1]] = rp->palette->color[v].green;
+			px[rp->chan[2]] = rp->palette->color[v].blue;
+		}
+		if (rp->result_channels == 4)
+			px[3] = 0xff; /* RLE, alpha 1.0 for defined pixels */
+		s_int_to_result_format(rp, 8, px);
+		memcpy(rp->pal_lut + (size_t) i * bytes, px, bytes);
+	}
 
-	*buff = 0;
-	while (n--) {
-		if (EOF == (byte = s_read_one_byte(rp))) {
-			s_set_file_error(rp);
-			return false;
+	rp->pal_expand_valid = false;
+	if (bits >= 8 || rp->rle || bytes > 4)
+		return;
+
+	/* not worth it for tiny images */
+	ppb = 8 / bits;
+	if ((uint64_t) rp->width * rp->height < (uint64_t) 256 * ppb)
+		return;
+
+	if (!rp->pal_expand) {
+		if (!(rp->pal_expand = cm_malloc(&rp->allocator, PAL_EXPAND_SIZE)))
+			return; /* no harm, we just go pixel by pixel */
+	}
+
+	for (i = 0; i < 256; i++) {
+		rp->pal_expand_invalid[i] = 0;
+		for (j = 0; j < ppb; j++) {
+			v = (i >> (8 - bits * (j + 1))) & ((1 << bits) - 1);
+			rp->pal_expand_invalid[i] += v >= ncolors;
+			memcpy(rp->pal_expand + ((size_t) i * ppb + j) * bytes,
+			       rp->pal_lut + (size_t) v * bytes, bytes);
 		}
-		*buff <<= 8;
-		*buff |= byte;
 	}
-	return true;
+	rp->pal_expand_valid = true;
 }
 
 
 
 /********************************************************
- * 	s_bits_from_buffer
+ * 	s_copy_pixel
+ *
+ * fixed-size copies for the possible pixel sizes, so the
+ * compiler can turn them into plain moves.
  *******************************************************/
 
-static inline unsigned long s_bits_from_buffer(unsigned long buf, int size,
-                                              int nbits, int used_bits)
+static inline void s_copy_pixel(unsigned char *restrict dst, const unsigned char *restrict src,
+                                int bytes)
 {
-	unsigned long mask;
-	int           shift;
-
-	shift = size - (nbits + used_bits);
-
-	mask  = (1U << nbits) - 1;
-	mask <<= shift;
-
-	buf   &= mask;
-	buf  >>= shift;
-
-	return buf;
+	switch (bytes) {
+	case 3:  memcpy(dst, src, 3);  break;
+	case 4:  memcpy(dst, src, 4);  break;
+	case 6:  memcpy(dst, src, 6);  break;
+	case 8:  memcpy(dst, src, 8);  break;
+	case 12: memcpy(dst, src, 12); break;
+	case 16: memcpy(dst, src, 16); break;
+	default: memcpy(dst, src, bytes); break;
+	}
 }
 
 
@@ -599,6 +2104,14 @@ static inline unsigned long s_bits_from_buffer(unsigned long buf, int size,
  * - 4/8/24 bit RLE
  *******************************************************/
 
+static inline void s_rle_put_pixel(BMPREAD_R rp, unsigned char *restrict line, int x,
+                                   int r, int g, int b, bool odd);
+
+/* line may be NULL, then the RLE codes are only parsed to advance
+ * the state to the next line (see s_build_line_index()). Only pixels
+ * within clip_x0 ... clip_x1-1 are written, line[0] is at clip_x0.
+ * With bmpread_set_scale(), only every 2^n-th of those is written.
+ */
 static void s_read_rle_line(BMPREAD_R rp, unsigned char *restrict line,
                                int *restrict x, int *restrict yoff)
 {
@@ -606,7 +2119,6 @@ static void s_read_rle_line(BMPREAD_R rp, unsigned char *restrict line,
 	bool    repeat = false, padding = false, odd = false;
 	int     right, up;
 	int     v, r = 0, g = 0, b = 0;
-	size_t  offs;
 	int     bits = rp->ih->bitcount;
 
 	if (!(bits == 4 || bits == 8 || bits == 24)) {
@@ -638,44 +2150,18 @@ static void s_read_rle_line(BMPREAD_R rp, unsigned char *restrict line,
 				}
 			}
 
-			offs = (size_t) *x * rp->result_bytes_per_pixel;
-			if ((rp->undefined_mode == BMP_UNDEFINED_TO_ALPHA) && !rp->result_indexed)
-				line[offs+3] = 0xff; /* set alpha to 1.0 for defined pixels */
-			switch (bits) {
-			case 24:
-				line[offs]   = r;
-				line[offs+1] = g;
-				line[offs+2] = b;
-				s_int_to_result_format(rp, 8, line + offs);
-				break;
-			case 4:
-			case 8:
-				if (bits == 8)
-					v = b;
-				else {
-					v = odd ? b & 0x0f : (b >> 4) & 0x0f;
-					odd = !odd;
-				}
-				if (v >= rp->palette->numcolors) {
-					v = rp->palette->numcolors - 1;
-					rp->invalid_index = true;
-				}
-				if (rp->result_indexed) {
-					line[offs] = v;
-				} else {
-					line[offs]   = rp->palette->color[v].red;
-					line[offs+1] = rp->palette->color[v].green;
-					line[offs+2] = rp->palette->color[v].blue;
-					s_int_to_result_format(rp, 8, line + offs);
-				}
-				break;
-			}
+			if (line && *x >= rp->clip_x0 && *x < rp->clip_x1 &&
+			    !((*x - rp->clip_x0) & ((1 << rp->scale_shift) - 1)))
+				s_rle_put_pixel(rp, line, (*x - rp->clip_x0) >> rp->scale_shift, r, g, b, odd);
+			if (bits == 4)
+				odd = !odd;
 
 			*x += 1;
 			if (*x >= rp->width) {
 				rp->rle_eol = false; /* EOL detected by width, not by RLE-code */
 				if (left_in_run) {
 					rp->invalid_overrun = true;
+					rp->stats.invalid_overrun++;
 				}
 				break;
 			}
@@ -700,6 +2186,7 @@ static void s_read_rle_line(BMPREAD_R rp, unsigned char *restrict line,
 			odd = false;
 			left_in_run = v;
 			repeat = true;
+			rp->stats.rle_repeat++;
 			continue;
 		}
 
@@ -713,6 +2200,7 @@ static void s_read_rle_line(BMPREAD_R rp, unsigned char *restrict line,
 		if (v > 2) {
 			left_in_run = v;
 			repeat = false;
+			rp->stats.rle_literal++;
 
 			switch (bits) {
 			case 8:
@@ -732,6 +2220,7 @@ static void s_read_rle_line(BMPREAD_R rp, unsigned char *restrict line,
 
 		/* end of line.  */
 		if (v == 0) {
+			rp->stats.rle_eol++;
 			if (*x != 0 || rp->rle_eol) {
 				*x = rp->width;
 				rp->rle_eol = true;
@@ -742,6 +2231,7 @@ static void s_read_rle_line(BMPREAD_R rp, unsigned char *restrict line,
 
 		/* end of bitmap */
 		if (v == 1) {
+			rp->stats.rle_eof++;
 			rp->rle_eof = true;
 			break;
 		}
@@ -752,8 +2242,10 @@ static void s_read_rle_line(BMPREAD_R rp, unsigned char *restrict line,
 				s_set_file_error(rp);
 				break;
 			}
+			rp->stats.rle_delta++;
 			if (right >= rp->width - *x) {
 				rp->invalid_delta = true;
+				rp->stats.invalid_delta++;
 				break;
 			}
 			*x += right;
@@ -764,13 +2256,48 @@ static void s_read_rle_line(BMPREAD_R rp, unsigned char *restrict line,
 			continue;
 		}
 
-		logerr(rp->log, "Should never get here! (x=%d, byte=%d)", (int) *x, (int) v);
-		rp->panic = true;
+		rp->panic = true; /* should never get here */
 		break;
 	}
 }
 
 
+static inline void s_rle_put_pixel(BMPREAD_R rp, unsigned char *restrict line, int x,
+                                   int r, int g, int b, bool odd)
+{
+	size_t offs;
+	int    v;
+
+	offs = (size_t) x * rp->result_bytes_per_pixel;
+	if ((rp->undefined_mode == BMP_UNDEFINED_TO_ALPHA) && !rp->result_indexed)
+		line[offs+3] = 0xff; /* set alpha to 1.0 for defined pixels */
+
+	if (rp->ih->bitcount == 24) {
+		line[offs + rp->chan[0]] = r;
+		line[offs + rp->chan[1]] = g;
+		line[offs + rp->chan[2]] = b;
+		s_int_to_result_format(rp, 8, line + offs);
+		return;
+	}
+
+	/* for 4/8-bit RLE, b holds index value(s) */
+	if (rp->ih->bitcount == 8)
+		v = b;
+	else
+		v = odd ? b & 0x0f : (b >> 4) & 0x0f;
+
+	if (v >= rp->palette->numcolors) {
+		v = rp->palette->numcolors - 1;
+		s_add_invalid_index(rp, 1);
+	}
+	if (rp->result_indexed)
+		line[offs] = v;
+	else
+		s_copy_pixel(line + offs, rp->pal_lut + (size_t) v * rp->result_bytes_per_pixel,
+		             rp->result_bytes_per_pixel);
+}
+
+
 /********************************************************
  * 	s_read_huffman_line
  *******************************************************/
@@ -780,7 +2307,7 @@ static bool s_huff_find_eol(BMPREAD_R rp);
 static void s_read_huffman_line(BMPREAD_R rp, unsigned char *restrict line)
 {
 	size_t   offs;
-	int      x = 0, runlen;
+	int      x = 0, i, runlen, end;
 	bool     black = false;
 
 	while (x < rp->width)  {
@@ -808,23 +2335,29 @@ static void s_read_huffman_line(BMPREAD_R rp, unsigned char *restrict line)
 				rp->truncated = true;
 			break;
 		}
+		rp->stats.huffman_codes++;
 
 		if (runlen > rp->width - x) {
 			rp->lasterr |= BMP_ERR_PIXEL;
 			runlen = rp->width - x;
 		}
 
-		for (int i = 0; i < runlen; i++, x++) {
-			offs = (size_t) x * rp->result_bytes_per_pixel;
-			if (rp->result_indexed) {
+		/* line may be NULL (parse only), and we only write
+		 * pixels inside the clip range (and, when scaled,
+		 * only every 2^n-th)
+		 */
+		end = line ? MIN(x + runlen, rp->clip_x1) : 0;
+		i   = MAX(x, rp->clip_x0);
+		i  += (int) ((unsigned) (rp->clip_x0 - i) & ((1U << rp->scale_shift) - 1));
+		for (; i < end; i += 1 << rp->scale_shift) {
+			offs = (size_t) ((i - rp->clip_x0) >> rp->scale_shift) * rp->result_bytes_per_pixel;
+			if (rp->result_indexed)
 				line[offs] = black;
-			} else {
-				line[offs]   = rp->palette->color[black].red;
-				line[offs+1] = rp->palette->color[black].green;
-				line[offs+2] = rp->palette->color[black].blue;
-				s_int_to_result_format(rp, 8, line + offs);
-			}
+			else
+				s_copy_pixel(line + offs, rp->pal_lut + (size_t) black * rp->result_bytes_per_pixel,
+				             rp->result_bytes_per_pixel);
 		}
+		x += runlen;
 		black = !black;
 	}
 }
@@ -923,10 +2456,7 @@ static inline void s_int_to_result_format(BMPREAD_R rp, int frombits, unsigned c
 			((uint16_t*)px)[c] = (uint16_t) ((double) v / ((1ULL<<frombits)-1) * 8192.0 + 0.5);
 			break;
 		default:
-#ifdef DEBUG
-			logerr(rp->log, "Unexpected result format %d", rp->result_format);
-			exit(1);
-#endif
+			rp->panic = true; /* see s_kernel_generic() */
 			break;
 		}
 	}
@@ -940,7 +2470,7 @@ static inline void s_int_to_result_format(BMPREAD_R rp, int frombits, unsigned c
 
 static void s_set_file_error(BMPREAD_R rp)
 {
-	if (feof(rp->file))
+	if (cm_is_eof(rp))
 		rp->file_eof = true;
 	else
 		rp->file_err = true;
@@ -954,20 +2484,35 @@ static void s_set_file_error(BMPREAD_R rp)
 
 static void s_log_error_from_state(BMPREAD_R rp)
 {
-	if (rp->panic)
-		logerr(rp->log, "An internal error occured.");
-	if (rp->file_eof)
-		logerr(rp->log, "Unexpected end of file.");
-	if (rp->file_err)
-		logsyserr(rp->log, "While reading file");
-	if (rp->invalid_index)
-		logerr(rp->log, "File contained invalid color index.");
-	if (rp->invalid_delta)
-		logerr(rp->log, "Invalid delta pointing outside image area.");
-	if (rp->invalid_overrun)
-		logerr(rp->log, "RLE data overrunning image area.");
-	if (rp->truncated)
-		logerr(rp->log, "Image was truncated.");
+	/* called for every line, so don't format anything here */
+	if (rp->panic) {
+		rp->lasterr |= BMP_ERR_INTERNAL;
+		logfixed(rp->log, "An internal error occured.");
+	}
+	if (rp->file_eof) {
+		rp->lasterr |= BMP_ERR_TRUNCATED;
+		logfixed(rp->log, "Unexpected end of file.");
+	}
+	if (rp->file_err) {
+		rp->lasterr |= BMP_ERR_FILEIO;
+		logsysfixed(rp->log, "While reading file");
+	}
+	if (rp->invalid_index) {
+		rp->lasterr |= BMP_ERR_PIXEL;
+		logfixed(rp->log, "File contained invalid color index.");
+	}
+	if (rp->invalid_delta) {
+		rp->lasterr |= BMP_ERR_PIXEL;
+		logfixed(rp->log, "Invalid delta pointing outside image area.");
+	}
+	if (rp->invalid_overrun) {
+		rp->lasterr |= BMP_ERR_PIXEL;
+		logfixed(rp->log, "RLE data overrunning image area.");
+	}
+	if (rp->truncated) {
+		rp->lasterr |= BMP_ERR_TRUNCATED;
+		logfixed(rp->log, "Image was truncated.");
+	}
 }
 
 
@@ -1010,10 +2555,25 @@ static bool s_stopping_error(BMPREAD_R rp)
 
 static inline int s_read_one_byte(BMPREAD_R rp)
 {
-	int byte;
-	if (EOF != (byte = getc(rp->file)))
-		rp->bytes_read++;
-	return byte;
+	if (rp->rbuf_pos >= rp->rbuf_len && !cm_fill_readbuf(rp, 1))
+		return EOF;
+
+	rp->bytes_read++;
+	return rp->rbuf[rp->rbuf_pos++];
+}
+
+
+
+/********************************************************
+ * 	s_add_invalid_index
+ *******************************************************/
+
+static inline void s_add_invalid_index(BMPREAD_R rp, unsigned long n)
+{
+	if (n) {
+		rp->invalid_index = true;
+		rp->stats.invalid_index += n;
+	}
 }
 
 
@@ -96,7 +96,7 @@ API BMPRESULT bmpread_load_palette(BMPHANDLE h, unsigned char **palette)
 
 	memsize = rp->palette->numcolors * 4;
 	if (!*palette) {
-		if (!(*palette = malloc(memsize))) {
+		if (!(*palette = cm_malloc(&rp->allocator, memsize))) {
 			logsyserr(rp->log, "allocating palette");
 			return BMP_RESULT_ERROR;
 		}
@@ -18,6 +18,9 @@
  * If not, see <https://www.gnu.org/licenses/>
  */
 
+/* for fileno(), fstat() and mmap() */
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -29,10 +32,18 @@
 #define BMPLIB_LIB
 
 #include "config.h"
+
+#if HAVE_MMAP
+	#include <sys/types.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+#endif
+
 #include "bmplib.h"
 #include "logging.h"
 #include "bmp-common.h"
 #include "bmp-read.h"
+#include "kernels.h"
 
 
 const char* s_infoheader_name(int infoversion);
@@ -44,40 +55,472 @@ const char* s_compression_name(int compression);
  * 	bmpread_new
  *****************************************************************************/
 
+static BMPREAD s_new_handle(const struct BmpAllocator *allocator);
+
 API BMPHANDLE bmpread_new(FILE *file)
 {
+	BMPREAD rp;
+
+	if (!(rp = s_new_handle(NULL)))
+		return NULL;
+
+	if (!file) {
+		br_free(rp);
+		return NULL;
+	}
+
+	rp->file = file;
+
+	return (BMPHANDLE)(void*)rp;
+}
+
+
+
+/*****************************************************************************
+ * 	bmpread_new_mem
+ *
+ * Read a BMP from memory. The memory must stay valid
+ * until the handle is freed. It is used in place,
+ * without any copies.
+ *****************************************************************************/
+
+API BMPHANDLE bmpread_new_mem(const void *data, size_t size)
+{
+	BMPREAD rp;
+
+	if (!(rp = s_new_handle(NULL)))
+		return NULL;
+
+	if (!data) {
+		br_free(rp);
+		return NULL;
+	}
+
+	/* rbuf is never written to when rbuf_static is set */
+	rp->rbuf        = (unsigned char*) data;
+	rp->rbuf_len    = size;
+	rp->rbuf_static = true;
+
+	return (BMPHANDLE)(void*)rp;
+}
+
+
+
+/*****************************************************************************
+ * 	bmpread_new_alloc
+ *
+ * All memory of the handle, including the returned
+ * image and palette buffers, comes from the given
+ * allocator. The handle has no file or data yet, it
+ * must first be given one with bmpread_reset() or
+ * bmpread_reset_mem().
+ *****************************************************************************/
+
+API BMPHANDLE bmpread_new_alloc(const BMPALLOCATOR *allocator)
+{
+	BMPREAD rp;
+
+	if (!allocator || !allocator->alloc)
+		return NULL;
+
+	if (!(rp = s_new_handle(allocator)))
+		return NULL;
+
+	return (BMPHANDLE)(void*)rp;
+}
+
+
+
+/*****************************************************************************
+ * 	bmpread_new_feed
+ *
+ * The data will be pushed in pieces with bmpread_feed().
+ * We keep all of it in our own buffer, so the decoders
+ * see the same thing as with bmpread_new_mem(), just
+ * growing.
+ *****************************************************************************/
+
+API BMPHANDLE bmpread_new_feed(void)
+{
+	BMPREAD rp;
+
+	if (!(rp = s_new_handle(NULL)))
+		return NULL;
+
+	rp->rbuf_static = true;
+	rp->feed        = true;
+
+	return (BMPHANDLE)(void*)rp;
+}
+
+
+
+/*****************************************************************************
+ * 	bmpread_use_mmap
+ *
+ * Map the file into memory instead of reading it
+ * through stdio. Must be called right after
+ * bmpread_new(). The file's current position is
+ * where the BMP starts.
+ *****************************************************************************/
+
+API BMPRESULT bmpread_use_mmap(BMPHANDLE h)
+{
+	BMPREAD rp;
+#if HAVE_MMAP
+	struct stat st;
+	long        pos;
+	void       *map;
+	int         fd;
+#endif
+
+	if (!(h && cm_check_is_read_handle(h)))
+		return BMP_RESULT_ERROR;
+	rp = (BMPREAD)(void*)h;
+
+	if (!rp->file || rp->rbuf_static || rp->getinfo_called || rp->bytes_read) {
+		logerr(rp->log, "bmpread_use_mmap() must be called directly after bmpread_new()");
+		rp->lasterr = BMP_ERR_INTERNAL;
+		return BMP_RESULT_ERROR;
+	}
+
+#if HAVE_MMAP
+	if (-1 == (fd = fileno(rp->file)) || fstat(fd, &st)) {
+		logsyserr(rp->log, "Getting file size for mmap");
+		rp->lasterr = BMP_ERR_FILEIO;
+		return BMP_RESULT_ERROR;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		logerr(rp->log, "Cannot mmap, not a regular file");
+		rp->lasterr = BMP_ERR_FILEIO;
+		return BMP_RESULT_ERROR;
+	}
+	if (-1 == (pos = ftell(rp->file))) {
+		logsyserr(rp->log, "Getting file position for mmap");
+		rp->lasterr = BMP_ERR_FILEIO;
+		return BMP_RESULT_ERROR;
+	}
+	if ((uintmax_t) st.st_size > SIZE_MAX || st.st_size <= pos) {
+		logerr(rp->log, "Cannot mmap file of size %jd", (intmax_t) st.st_size);
+		rp->lasterr = BMP_ERR_FILEIO;
+		return BMP_RESULT_ERROR;
+	}
+
+	map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		logsyserr(rp->log, "mmap");
+		rp->lasterr = BMP_ERR_FILEIO;
+		return BMP_RESULT_ERROR;
+	}
+
+	if (rp->rbuf) /* left over from bmpread_reset() */
+		cm_free(&rp->allocator, rp->rbuf);
+	rp->rbuf_size    = 0;
+	rp->mmap_base    = map;
+	rp->mmap_size    = (size_t) st.st_size;
+	rp->mmap_filepos = pos;
+	rp->rbuf         = (unsigned char*) map + pos;
+	rp->rbuf_len     = (size_t) st.st_size - (size_t) pos;
+	rp->rbuf_static  = true;
+
+	return BMP_RESULT_OK;
+#else
+	logerr(rp->log, "mmap is not supported on this platform");
+	rp->lasterr = BMP_ERR_UNSUPPORTED;
+	return BMP_RESULT_ERROR;
+#endif
+}
+
+
+
+/*****************************************************************************
+ * 	bmpread_reset / bmpread_reset_mem / bmpread_reset_feed
+ *
+ * Reuse the handle for another BMP. Everything we
+ * learned about the previous BMP is forgotten, but the
+ * allocations (header structs, log, read buffer,
+ * palette) are kept. Settings which don't depend on
+ * the particular BMP (number format, channel order,
+ * 64-bit conversion, undefined mode, insanity limit,
+ * threads, scale) stay in effect.
+ *****************************************************************************/
+
+static void s_reset_handle(BMPREAD rp);
+
+API BMPRESULT bmpread_reset(BMPHANDLE h, FILE *file)
+{
+	BMPREAD rp;
+
+	if (!(h && cm_check_is_read_handle(h)))
+		return BMP_RESULT_ERROR;
+	rp = (BMPREAD)(void*)h;
+
+	if (!file) {
+		logerr(rp->log, "Must supply file handle");
+		rp->lasterr = BMP_ERR_INTERNAL;
+		return BMP_RESULT_ERROR;
+	}
+
+	s_reset_handle(rp);
+	rp->file = file;
+
+	return BMP_RESULT_OK;
+}
+
+
+API BMPRESULT bmpread_reset_mem(BMPHANDLE h, const void *data, size_t size)
+{
+	BMPREAD rp;
+
+	if (!(h && cm_check_is_read_handle(h)))
+		return BMP_RESULT_ERROR;
+	rp = (BMPREAD)(void*)h;
+
+	if (!data) {
+		logerr(rp->log, "Must supply data");
+		rp->lasterr = BMP_ERR_INTERNAL;
+		return BMP_RESULT_ERROR;
+	}
+
+	s_reset_handle(rp);
+
+	/* our own read buffer is of no use with in-memory data */
+	if (rp->rbuf)
+		cm_free(&rp->allocator, rp->rbuf);
+	rp->rbuf        = (unsigned char*) data;
+	rp->rbuf_size   = 0;
+	rp->rbuf_len    = size;
+	rp->rbuf_static = true;
+
+	return BMP_RESULT_OK;
+}
+
+
+API BMPRESULT bmpread_reset_feed(BMPHANDLE h)
+{
+	BMPREAD rp;
+
+	if (!(h && cm_check_is_read_handle(h)))
+		return BMP_RESULT_ERROR;
+	rp = (BMPREAD)(void*)h;
+
+	s_reset_handle(rp);
+
+	/* keep our read buffer, it will receive the fed data */
+	rp->rbuf_static = true;
+	rp->feed        = true;
+
+	return BMP_RESULT_OK;
+}
+
+
+
+/*****************************************************************************
+ * 	bmpread_feed
+ *
+ * Append data to the buffer. As soon as the headers are
+ * complete, they are read. After that, br_feed_scan()
+ * finds out how many lines can be decoded from the data
+ * we have. Loading functions refuse to go beyond that
+ * with BMP_RESULT_NEED_MORE, so the decoders never run
+ * into the (preliminary) end of the data.
+ * data == NULL and len == 0 marks the end of the data.
+ *****************************************************************************/
+
+API BMPRESULT bmpread_feed(BMPHANDLE h, const void *data, size_t len)
+{
+	BMPREAD        rp;
+	BMPRESULT      res;
+	unsigned char *tmp;
+	size_t         size;
+
+	if (!(h && cm_check_is_read_handle(h)))
+		return BMP_RESULT_ERROR;
+	rp = (BMPREAD)(void*)h;
+
+	if (!rp->feed) {
+		logerr(rp->log, "Handle was not created with bmpread_new_feed()");
+		rp->lasterr = BMP_ERR_INTERNAL;
+		return BMP_RESULT_ERROR;
+	}
+
+	if (rp->feed_end) {
+		logerr(rp->log, "Cannot feed more data after end of data");
+		rp->lasterr = BMP_ERR_INTERNAL;
+		return BMP_RESULT_ERROR;
+	}
+
+	if (!data && len) {
+		logerr(rp->log, "data pointer is NULL");
+		rp->lasterr = BMP_ERR_NULL;
+		return BMP_RESULT_ERROR;
+	}
+
+	if (!data) {
+		rp->feed_end = true;
+	} else if (len) {
+		if (len > SIZE_MAX - rp->rbuf_len) {
+			logerr(rp->log, "Too much data");
+			rp->lasterr = BMP_ERR_MEMORY;
+			return BMP_RESULT_ERROR;
+		}
+		if (rp->rbuf_len + len > rp->rbuf_size) {
+			size = MAX((size_t) READBUF_CHUNK, rp->rbuf_len + len);
+			if (rp->rbuf_size < SIZE_MAX / 2)
+				size = MAX(size, 2 * rp->rbuf_size);
+			if (!(tmp = cm_realloc(&rp->allocator, rp->rbuf, rp->rbuf_size, size))) {
+				logsyserr(rp->log, "allocating read buffer");
+				rp->lasterr = BMP_ERR_MEMORY;
+				return BMP_RESULT_ERROR;
+			}
+			rp->rbuf      = tmp;
+			rp->rbuf_size = size;
+		}
+		memcpy(rp->rbuf + rp->rbuf_len, data, len);
+		rp->rbuf_len += len;
+	}
+
+	if (!rp->getinfo_called) {
+		res = bmpread_load_info(h);
+		if (res == BMP_RESULT_NEED_MORE)
+			return res;
+	}
+
+	if (!(rp->getinfo_return == BMP_RESULT_OK || rp->getinfo_return == BMP_RESULT_INSANE))
+		return rp->getinfo_return;
+
+	br_feed_scan(rp);
+
+	if (rp->getinfo_return == BMP_RESULT_INSANE)
+		return BMP_RESULT_INSANE;
+
+	if (rp->image_loaded)
+		return BMP_RESULT_OK;
+
+	return br_lines_left(rp, rp->feed_rows) > 0 ? BMP_RESULT_ROWS_READY : BMP_RESULT_NEED_MORE;
+}
+
+
+
+/*****************************************************************************
+ * 	bmpread_rows_ready
+ *
+ * number of lines that can be loaded right now. For
+ * handles which are not fed, that's all remaining lines.
+ * (With bmpread_set_scale(), only the lines which are
+ * actually returned count.)
+ *****************************************************************************/
+
+API int bmpread_rows_ready(BMPHANDLE h)
+{
+	BMPREAD rp;
+
+	if (!(h && cm_check_is_read_handle(h)))
+		return 0;
+	rp = (BMPREAD)(void*)h;
+
+	if (!(rp->getinfo_called && (rp->getinfo_return == BMP_RESULT_OK ||
+	                             rp->getinfo_return == BMP_RESULT_INSANE)))
+		return 0;
+
+	if (rp->image_loaded)
+		return 0;
+
+	if (rp->feed)
+		return br_lines_left(rp, rp->feed_rows);
+
+	return br_lines_left(rp, (int) rp->height);
+}
+
+
+static void s_reset_handle(BMPREAD rp)
+{
+	struct Bmpread keep = *rp;
+
+#if HAVE_MMAP
+	if (rp->mmap_base)
+		munmap(rp->mmap_base, rp->mmap_size);
+#endif
+	if (rp->line_index)
+		cm_free(&rp->allocator, rp->line_index);
+	if (keep.palette) {
+		/* only one of palette/spare_palette is ever allocated */
+		keep.spare_palette = keep.palette;
+	}
+
+	memset(rp, 0, sizeof *rp);
+	rp->magic            = HMAGIC_READ;
+	rp->log              = keep.log;
+	rp->allocator        = keep.allocator;
+	rp->fh               = keep.fh;
+	rp->ih               = keep.ih;
+	rp->spare_palette    = keep.spare_palette;
+	rp->palette_capacity = keep.palette_capacity;
+	rp->kern             = keep.kern;
+	rp->pal_expand       = keep.pal_expand;
+	if (!keep.rbuf_static || keep.feed) {
+		rp->rbuf      = keep.rbuf;
+		rp->rbuf_size = keep.rbuf_size;
+	}
+
+	rp->insanity_limit         = keep.insanity_limit;
+	rp->undefined_mode         = keep.undefined_mode;
+	rp->conv64                 = keep.conv64;
+	rp->conv64_explicit        = keep.conv64_explicit;
+	rp->result_format          = keep.result_format;
+	rp->result_format_explicit = keep.result_format_explicit;
+	rp->order                  = keep.order;
+	rp->nthreads               = keep.nthreads;
+	rp->scale_shift            = keep.scale_shift;
+	rp->timing                 = keep.timing;
+	rp->orientation            = BMP_ORIENT_BOTTOMUP;
+
+	memset(rp->fh, 0, sizeof *rp->fh);
+	memset(rp->ih, 0, sizeof *rp->ih);
+	logreset(rp->log);
+}
+
+
+
+/*****************************************************************************
+ * 	s_new_handle
+ *****************************************************************************/
+
+static BMPREAD s_new_handle(const struct BmpAllocator *allocator)
+{
+	static const struct BmpAllocator libc = { NULL, NULL, NULL };
 	BMPREAD rp = NULL;
 
-	if (!(rp = malloc(sizeof *rp))) {
+	if (!allocator)
+		allocator = &libc;
+
+	if (!(rp = cm_malloc(allocator, sizeof *rp))) {
 		goto abort;
 	}
 
 	memset(rp, 0, sizeof *rp);
 	rp->magic = HMAGIC_READ;
+	rp->allocator = *allocator;
 	rp->undefined_mode = BMP_UNDEFINED_TO_ALPHA;
 	rp->orientation    = BMP_ORIENT_BOTTOMUP;
 	rp->conv64         = BMP_CONV64_SRGB;
 	rp->result_format  = BMP_FORMAT_INT;
+	rp->order          = BMP_ORDER_RGB;
+	rp->nthreads       = 1;
 
-	if (!(rp->log = logcreate()))
+	if (!(rp->log = logcreate(&rp->allocator)))
 		goto abort;
 
-	if (!file)
+	if (!(rp->fh = cm_calloc(&rp->allocator, sizeof *rp->fh)))
 		goto abort;
 
-	rp->file = file;
-
-	if (!(rp->fh = malloc(sizeof *rp->fh)))
+	if (!(rp->ih = cm_calloc(&rp->allocator, sizeof *rp->ih)))
 		goto abort;
-	memset(rp->fh, 0, sizeof *rp->fh);
-
-	if (!(rp->ih = malloc(sizeof *rp->ih)))
-		goto abort;
-	memset(rp->ih, 0, sizeof *rp->ih);
 
 	rp->insanity_limit = INSANITY_LIMIT << 20;
+	rp->kern           = kern_select();
 
-	return (BMPHANDLE)(void*)rp;
+	return rp;
 
 abort:
 	if (rp)
@@ -97,9 +540,14 @@ static struct Palette* s_read_palette(BMPREAD_R rp);
 static bool s_read_colormasks(BMPREAD_R rp);
 static bool s_check_dimensions(BMPREAD_R rp);
 
+static BMPRESULT s_load_info(BMPREAD_R rp);
+static bool s_feed_header_complete(BMPREAD_R rp);
+
 API BMPRESULT bmpread_load_info(BMPHANDLE h)
 {
-	BMPREAD rp;
+	BMPREAD   rp;
+	BMPRESULT res;
+	double    start = 0.0, palette;
 
 	if (!(h && cm_check_is_read_handle(h)))
 		return BMP_RESULT_ERROR;
@@ -108,6 +556,38 @@ API BMPRESULT bmpread_load_info(BMPHANDLE h)
 	if (rp->getinfo_called)
 		return rp->getinfo_return;
 
+	if (rp->feed && !rp->feed_end && !s_feed_header_complete(rp))
+		return BMP_RESULT_NEED_MORE;
+
+	if (rp->timing)
+		start = cm_clock();
+	palette = rp->stats.time_palette;
+
+	res = s_load_info(rp);
+
+	if (rp->feed) {
+		/* line scanning starts at the bitmap data */
+		rp->feed_mark = (struct LineMark) {
+			.pos        = rp->fh->offbits,
+			.bytes_read = rp->fh->offbits,
+		};
+	}
+
+	if (rp->timing)
+		rp->stats.time_header += cm_clock() - start - (rp->stats.time_palette - palette);
+	return res;
+}
+
+
+static BMPRESULT s_load_info(BMPREAD_R rp)
+{
+	double start = 0.0;
+
+	if (!rp->file && !rp->rbuf_static) {
+		logerr(rp->log, "No file or data given (bmpread_reset() missing?)");
+		rp->lasterr = BMP_ERR_INTERNAL;
+		goto abort;
+	}
 
 	if (!s_read_file_header(rp))
 		goto abort;
@@ -154,6 +634,14 @@ API BMPRESULT bmpread_load_info(BMPHANDLE h)
 			logerr(rp->log, "while seeking to start of jpeg/png data");
 			goto abort;
 		}
+		if (rp->mmap_base) {
+			/* leave the file where the caller expects it */
+			if (fseek(rp->file, rp->mmap_filepos + (long) rp->bytes_read, SEEK_SET)) {
+				logsyserr(rp->log, "while seeking to start of jpeg/png data");
+				rp->lasterr = BMP_ERR_FILEIO;
+				goto abort;
+			}
+		}
 		if (rp->ih->compression == BI_JPEG) {
 			rp->jpeg = true;
 			rp->getinfo_return = BMP_RESULT_JPEG;
@@ -174,7 +662,12 @@ API BMPRESULT bmpread_load_info(BMPHANDLE h)
 
 	rp->result_channels = 3;
 	if (rp->ih->bitcount <= 8) { /* indexed */
-		if (!(rp->palette = s_read_palette(rp)))
+		if (rp->timing)
+			start = cm_clock();
+		rp->palette = s_read_palette(rp);
+		if (rp->timing)
+			rp->stats.time_palette += cm_clock() - start;
+		if (!rp->palette)
 			goto abort;
 	} else if (!rp->rle) {  /* RGB  */
 		memset(&rp->cmask, 0, sizeof rp->cmask);
@@ -215,6 +708,141 @@ abort:
 
 
 
+/*****************************************************************************
+ * 	s_feed_header_complete
+ *
+ * Everything up to the bitmap data (file header, info
+ * header, color masks, palette) must have been fed.
+ * If the beginning already tells us that it's not a
+ * BMP we can read, there is no point in waiting, let
+ * s_load_info() report the problem.
+ *****************************************************************************/
+
+static bool s_info_version(uint32_t size, enum BmpInfoVer *version);
+
+static bool s_feed_header_complete(BMPREAD_R rp)
+{
+	enum BmpInfoVer version;
+	size_t          offbits;
+	uint32_t        ihsize;
+
+	if (rp->rbuf_len < BMPFHSIZE + 4)
+		return false;
+
+	offbits = u32_from_le(rp->rbuf + 10);
+	ihsize  = u32_from_le(rp->rbuf + BMPFHSIZE);
+
+	if (u16_from_le(rp->rbuf) != BMPFILE_BM || !s_info_version(ihsize, &version))
+		return true;
+
+	return rp->rbuf_len >= MAX(offbits, BMPFHSIZE + (size_t) ihsize);
+}
+
+
+
+/*****************************************************************************
+ * 	bmpread_probe / bmpread_probe_file
+ *
+ * Only parse the file header and the first 40 bytes of
+ * the info header (as far as the header is that long),
+ * directly from the caller's buffer. No handle, no
+ * allocations, no palette or color masks.
+ * If len is too small, we return BMP_RESULT_TRUNCATED
+ * with info->needed set to the number of bytes we need.
+ * That number can grow once the info header size is
+ * known, so bmpread_probe_file() may have to read twice.
+ *****************************************************************************/
+
+#define PROBE_MAX_BYTES (BMPFHSIZE + BMPIHSIZE_V3)
+
+static void s_detect_os2_compression(const struct Bmpfile *fh, struct Bmpinfo *ih);
+
+API BMPRESULT bmpread_probe(const void *buf, size_t len, BMPPROBEINFO *info)
+{
+	const unsigned char *data = buf;
+	unsigned char        hdr[BMPIHSIZE_V3];
+	struct Bmpfile       fh;
+	struct Bmpinfo       ih;
+
+	if (!(data && info))
+		return BMP_RESULT_ERROR;
+
+	memset(info, 0, sizeof *info);
+	memset(&fh, 0, sizeof fh);
+	memset(&ih, 0, sizeof ih);
+
+	info->needed = BMPFHSIZE + 4;
+	if (len < info->needed)
+		return BMP_RESULT_TRUNCATED;
+
+	fh.type    = u16_from_le(data);
+	fh.size    = u32_from_le(data + 2);
+	fh.offbits = u32_from_le(data + 10);
+	ih.size    = u32_from_le(data + BMPFHSIZE);
+
+	if (fh.type != BMPFILE_BM || !s_info_version(ih.size, &ih.version))
+		return BMP_RESULT_ERROR;
+
+	info->needed = BMPFHSIZE + MIN(ih.size, BMPIHSIZE_V3);
+	if (len < info->needed)
+		return BMP_RESULT_TRUNCATED;
+
+	/* fields beyond a short OS/2 header are zero, same as in s_read_info_header() */
+	memset(hdr, 0, sizeof hdr);
+	memcpy(hdr, data + BMPFHSIZE, info->needed - BMPFHSIZE);
+
+	if (ih.version == BMPINFO_CORE_OS21) {
+		ih.width    = u16_from_le(hdr +  4);
+		ih.height   = u16_from_le(hdr +  6);
+		ih.bitcount = u16_from_le(hdr + 10);
+	} else {
+		ih.width       = s32_from_le(hdr +  4);
+		ih.height      = s32_from_le(hdr +  8);
+		ih.bitcount    = u16_from_le(hdr + 14);
+		ih.compression = u32_from_le(hdr + 16);
+		ih.clrused     = u32_from_le(hdr + 32);
+	}
+
+	if (ih.height == INT32_MIN)
+		return BMP_RESULT_ERROR;
+
+	s_detect_os2_compression(&fh, &ih);
+
+	info->width       = (int) ih.width;
+	info->height      = (int) (ih.height < 0 ? -ih.height : ih.height);
+	info->orientation = ih.height < 0 ? BMP_ORIENT_TOPDOWN : BMP_ORIENT_BOTTOMUP;
+	info->bitcount    = (int) ih.bitcount;
+	info->compression = (int) ih.compression;
+	info->version     = ih.version;
+	info->header_size = (int) MIN(ih.size, INT_MAX);
+	info->clrused     = (unsigned long) ih.clrused;
+	info->offbits     = (unsigned long) fh.offbits;
+	info->filesize    = (unsigned long) fh.size;
+
+	return BMP_RESULT_OK;
+}
+
+
+API BMPRESULT bmpread_probe_file(FILE *file, BMPPROBEINFO *info)
+{
+	unsigned char buf[PROBE_MAX_BYTES];
+	size_t        len;
+	BMPRESULT     res;
+
+	if (!(file && info))
+		return BMP_RESULT_ERROR;
+
+	len = fread(buf, 1, BMPFHSIZE + 4, file);
+	res = bmpread_probe(buf, len, info);
+	if (res == BMP_RESULT_TRUNCATED && len == BMPFHSIZE + 4) {
+		len += fread(buf + len, 1, info->needed - len, file);
+		res  = bmpread_probe(buf, len, info);
+	}
+	return res;
+}
+
+
+
 /*****************************************************************************
  * 	bmpread_set_64bit_conv
  *****************************************************************************/
@@ -276,6 +904,154 @@ API int bmpread_is_64bit(BMPHANDLE h)
 
 
 
+/*****************************************************************************
+ * 	bmpread_set_channel_order
+ *****************************************************************************/
+
+API BMPRESULT bmpread_set_channel_order(BMPHANDLE h, enum BmpOrder order)
+{
+	BMPREAD rp;
+
+	if (!(h && cm_check_is_read_handle(h)))
+		return BMP_RESULT_ERROR;
+	rp = (BMPREAD)(void*)h;
+
+	if (rp->image_loaded || rp->line_by_line) {
+		logerr(rp->log, "Cannot change channel order after loading has started");
+		rp->lasterr = BMP_ERR_ORDER;
+		return BMP_RESULT_ERROR;
+	}
+
+	switch (order) {
+	case BMP_ORDER_RGB:
+	case BMP_ORDER_BGR:
+		rp->order = order;
+		break;
+	default:
+		logerr(rp->log, "Invalid channel order (%d)", (int) order);
+		rp->lasterr = BMP_ERR_ORDER;
+		return BMP_RESULT_ERROR;
+	}
+	return BMP_RESULT_OK;
+}
+
+
+
+/*****************************************************************************
+ * 	bmpread_set_threads
+ *****************************************************************************/
+
+API BMPRESULT bmpread_set_threads(BMPHANDLE h, int nthreads)
+{
+	BMPREAD rp;
+
+	if (!(h && cm_check_is_read_handle(h)))
+		return BMP_RESULT_ERROR;
+	rp = (BMPREAD)(void*)h;
+
+	if (nthreads < 0) {
+		logerr(rp->log, "Invalid number of threads (%d)", nthreads);
+		rp->lasterr = BMP_ERR_THREADS;
+		return BMP_RESULT_ERROR;
+	}
+
+#if HAVE_PTHREAD
+	if (nthreads == 0)
+		nthreads = cm_online_cpus();
+	rp->nthreads = MIN(nthreads, BMP_MAX_THREADS);
+	return BMP_RESULT_OK;
+#else
+	if (nthreads > 1) {
+		logerr(rp->log, "Threads are not supported on this platform");
+		rp->lasterr = BMP_ERR_UNSUPPORTED;
+		return BMP_RESULT_ERROR;
+	}
+	rp->nthreads = 1;
+	return BMP_RESULT_OK;
+#endif
+}
+
+
+
+/*****************************************************************************
+ * 	bmpread_set_stride
+ *****************************************************************************/
+
+API BMPRESULT bmpread_set_stride(BMPHANDLE h, size_t stride)
+{
+	BMPREAD rp;
+	size_t  oldsize;
+
+	if (!(h && cm_check_is_read_handle(h)))
+		return BMP_RESULT_ERROR;
+	rp = (BMPREAD)(void*)h;
+
+	if (rp->image_loaded || rp->line_by_line || rp->region_mode) {
+		logerr(rp->log, "Cannot change stride after loading has started");
+		rp->lasterr = BMP_ERR_STRIDE;
+		return BMP_RESULT_ERROR;
+	}
+
+	rp->stride = stride;
+	if (rp->getinfo_called) {
+		oldsize = rp->result_size;
+		br_set_resultbits(rp);
+		if (rp->result_size != oldsize)
+			rp->dimensions_queried = false; /* make caller re-check buffersize */
+	}
+	return BMP_RESULT_OK;
+}
+
+
+
+/*****************************************************************************
+ * 	bmpread_set_scale
+ *
+ * Decode only every 2nd, 4th, or 8th pixel of every
+ * 2nd, 4th, or 8th line (point sampling).
+ *****************************************************************************/
+
+API BMPRESULT bmpread_set_scale(BMPHANDLE h, int denominator)
+{
+	BMPREAD rp;
+	int     shift;
+
+	if (!(h && cm_check_is_read_handle(h)))
+		return BMP_RESULT_ERROR;
+	rp = (BMPREAD)(void*)h;
+
+	if (rp->image_loaded || rp->line_by_line || rp->region_mode) {
+		logerr(rp->log, "Cannot change scale after loading has started");
+		rp->lasterr = BMP_ERR_SCALE;
+		return BMP_RESULT_ERROR;
+	}
+
+	switch (denominator) {
+	case 1: shift = 0; break;
+	case 2: shift = 1; break;
+	case 4: shift = 2; break;
+	case 8: shift = 3; break;
+	default:
+		logerr(rp->log, "Invalid scale 1/%d (must be 1, 2, 4, or 8)", denominator);
+		rp->lasterr = BMP_ERR_SCALE;
+		return BMP_RESULT_ERROR;
+	}
+
+	if (shift != rp->scale_shift) {
+		rp->scale_shift = shift;
+		if (rp->getinfo_called) {
+			br_set_resultbits(rp);
+			/* dimensions and buffer size have changed */
+			rp->dim_queried_width  = false;
+			rp->dim_queried_height = false;
+			rp->dimensions_queried = false;
+		}
+	}
+	return BMP_RESULT_OK;
+}
+
+
+
 /*****************************************************************************
  * 	bmpread_dimensions
  *****************************************************************************/
@@ -300,11 +1076,11 @@ API BMPRESULT bmpread_dimensions(BMPHANDLE h, int* restrict width,
 	}
 
 	if (width) {
-		*width = rp->width;
+		*width = rp->result_width;
 		rp->dim_queried_width = true;
 	}
 	if (height) {
-		*height = (int) rp->height;
+		*height = (int) rp->result_height;
 		rp->dim_queried_height = true;
 	}
 	if (channels) {
@@ -442,11 +1218,11 @@ static int s_single_dim_val(BMPHANDLE h, enum Dimint dim)
 	switch (dim) {
 	case DIM_WIDTH:
 		rp->dim_queried_width = true;
-		ret = rp->width;
+		ret = rp->result_width;
 		break;
 	case DIM_HEIGHT:
 		rp->dim_queried_height = true;
-		ret = (int) rp->height;
+		ret = (int) rp->result_height;
 		break;
 	case DIM_CHANNELS:
 		rp->dim_queried_channels = true;
@@ -572,15 +1348,29 @@ API void bmpread_set_undefined(BMPHANDLE h, enum BmpUndefined mode)
 
 void br_free(BMPREAD rp)
 {
+	struct BmpAllocator allocator = rp->allocator;
+
+#if HAVE_MMAP
+	if (rp->mmap_base)
+		munmap(rp->mmap_base, rp->mmap_size);
+#endif
+	if (rp->rbuf && (!rp->rbuf_static || rp->feed))
+		cm_free(&allocator, rp->rbuf);
+	if (rp->line_index)
+		cm_free(&allocator, rp->line_index);
 	if (rp->palette)
-		free(rp->palette);
+		cm_free(&allocator, rp->palette);
+	if (rp->spare_palette)
+		cm_free(&allocator, rp->spare_palette);
+	if (rp->pal_expand)
+		cm_free(&allocator, rp->pal_expand);
 	if (rp->ih)
-		free(rp->ih);
+		cm_free(&allocator, rp->ih);
 	if (rp->fh)
-		free(rp->fh);
+		cm_free(&allocator, rp->fh);
 	if (rp->log)
 		logfree(rp->log);
-	free(rp);
+	cm_free(&allocator, rp);
 }
 
 
@@ -740,9 +1530,9 @@ static bool s_check_dimensions(BMPREAD_R rp)
 
 static struct Palette* s_read_palette(BMPREAD_R rp)
 {
-	int             i, r,g,b;
+	int             i;
+	unsigned char   entry[4];
 	struct Palette *palette;
-	size_t          memsize;
 	int             bytes_per_entry;
 	int             colors_in_file;
 	int             max_colors_in_file;
@@ -787,44 +1577,38 @@ static struct Palette* s_read_palette(BMPREAD_R rp)
 	if (colors_in_file > colors_full_palette)
 		colors_ignore = colors_in_file - colors_full_palette;
 
-	memsize = sizeof *palette +
-	                 (colors_in_file - colors_ignore) * sizeof palette->color[0];
-	if (!(palette = malloc(memsize))) {
+	palette = cm_get_palette(&rp->allocator, &rp->spare_palette,
+	                         &rp->palette_capacity, colors_in_file - colors_ignore);
+	if (!palette) {
 		logsyserr(rp->log, "Allocating mem for palette");
 		rp->lasterr = BMP_ERR_MEMORY;
 		return NULL;
 	}
 
-	memset(palette, 0, memsize);
-	palette->numcolors = colors_in_file - colors_ignore;
 	for (i = 0; i < palette->numcolors; i++) {
-		if (EOF == (b = getc(rp->file)) ||
-		    EOF == (g = getc(rp->file)) ||
-		    EOF == (r = getc(rp->file)) ||
-		    ((bytes_per_entry == 4) && (EOF == getc(rp->file))) ) {
-			if (feof(rp->file)) {
+		if ((size_t) bytes_per_entry != cm_read(rp, entry, bytes_per_entry)) {
+			if (cm_is_eof(rp)) {
 				logerr(rp->log, "file ended reading palette entries");
 				rp->lasterr = BMP_ERR_TRUNCATED;
 			} else {
 				logsyserr(rp->log, "reading palette entries");
 				rp->lasterr = BMP_ERR_FILEIO;
 			}
-			free (palette);
+			cm_free(&rp->allocator, palette);
 			return NULL;
 		}
 		rp->bytes_read += bytes_per_entry;
-		palette->color[i].red   = r;
-		palette->color[i].green = g;
-		palette->color[i].blue  = b;
+		palette->color[i].red   = entry[2];
+		palette->color[i].green = entry[1];
+		palette->color[i].blue  = entry[0];
 	}
 
 	for (i = 0; i < colors_ignore; i++) {
 		if (!cm_gobble_up(rp, bytes_per_entry)) {
 			logerr(rp->log, "reading superfluous palette entries");
-			free(palette);
+			cm_free(&rp->allocator, palette);
 			return NULL;
 		}
-		rp->bytes_read += bytes_per_entry;
 	}
 
 	return palette;
@@ -956,7 +1740,10 @@ bool br_set_resultbits(BMPREAD_R rp)
 	rp->result_bits_per_pixel = rp->result_bitsperchannel * rp->result_channels;
 	rp->result_bytes_per_pixel = rp->result_bits_per_pixel / 8;
 
-	rp->result_size = (size_t) rp->width * rp->height * rp->result_bytes_per_pixel;
+	rp->result_width  = (int) (((unsigned) rp->width + (1U << rp->scale_shift) - 1) >> rp->scale_shift);
+	rp->result_height = (rp->height + (1U << rp->scale_shift) - 1) >> rp->scale_shift;
+	rp->result_stride = rp->stride ? rp->stride : (size_t) rp->result_width * rp->result_bytes_per_pixel;
+	rp->result_size   = rp->result_stride * rp->result_height;
 	if (rp->getinfo_called) {
 		if (rp->insanity_limit && rp->result_size > rp->insanity_limit) {
 		 	if (rp->getinfo_return == BMP_RESULT_OK) {
@@ -989,10 +1776,10 @@ static bool s_read_masks_from_bitfields(BMPREAD_R rp)
 	}
 
 	if (rp->ih->version < BMPINFO_V3_ADOBE1) {
-		if (!(read_u32_le(rp->file, &r) &&
-		      read_u32_le(rp->file, &g) &&
-		      read_u32_le(rp->file, &b))) {
-			if (feof(rp->file)) {
+		if (!(cm_read_u32_le(rp, &r) &&
+		      cm_read_u32_le(rp, &g) &&
+		      cm_read_u32_le(rp, &b))) {
+			if (cm_is_eof(rp)) {
 				logerr(rp->log, "File ended reading color masks");
 				rp->lasterr = BMP_ERR_TRUNCATED;
 			} else {
@@ -1006,8 +1793,8 @@ static bool s_read_masks_from_bitfields(BMPREAD_R rp)
 		rp->cmask.mask.green = g;
 		rp->cmask.mask.blue  = b;
 		if (rp->ih->compression == BI_ALPHABITFIELDS) {
-			if (!read_u32_le(rp->file, &a)) {
-				if (feof(rp->file)) {
+			if (!cm_read_u32_le(rp, &a)) {
+				if (cm_is_eof(rp)) {
 					logerr(rp->log, "File ended reading color masks");
 					rp->lasterr = BMP_ERR_TRUNCATED;
 				} else {
@@ -1136,17 +1923,17 @@ static inline int s_calc_shift_for_mask(unsigned long long mask)
  *****************************************************************************/
 static bool s_read_file_header(BMPREAD_R rp)
 {
-	if (read_u16_le(rp->file, &rp->fh->type)      &&
-	    read_u32_le(rp->file, &rp->fh->size)      &&
-	    read_u16_le(rp->file, &rp->fh->reserved1) &&
-	    read_u16_le(rp->file, &rp->fh->reserved2) &&
-	    read_u32_le(rp->file, &rp->fh->offbits)    ) {
+	if (cm_read_u16_le(rp, &rp->fh->type)      &&
+	    cm_read_u32_le(rp, &rp->fh->size)      &&
+	    cm_read_u16_le(rp, &rp->fh->reserved1) &&
+	    cm_read_u16_le(rp, &rp->fh->reserved2) &&
+	    cm_read_u32_le(rp, &rp->fh->offbits)    ) {
 
 		rp->bytes_read += 14;
 		return true;
 	}
 
-	if (feof(rp->file)) {
+	if (cm_is_eof(rp)) {
 		logerr(rp->log, "unexpected end-of-file while reading "
 				"file header");
 		rp->lasterr = BMP_ERR_TRUNCATED;
@@ -1161,24 +1948,13 @@ static bool s_read_file_header(BMPREAD_R rp)
 
 
 /*****************************************************************************
- * 	s_read_info_header
+ * 	s_info_version
  *****************************************************************************/
-static void s_detect_os2_compression(BMPREAD_R rp);
 
-static bool s_read_info_header(BMPREAD_R rp)
+static bool s_info_version(uint32_t size, enum BmpInfoVer *version)
 {
-	int           skip, i, filepos;
-	unsigned char buf[124];
-	size_t        read_size;
-
-	filepos = (int) rp->bytes_read;
-
-	if (!read_u32_le(rp->file, &rp->ih->size))
-		goto abort_file_err;
-	rp->bytes_read += 4;
-
-	switch (rp->ih->size) {
-	case  12: rp->ih->version = BMPINFO_CORE_OS21; break;
+	switch (size) {
+	case  12: *version = BMPINFO_CORE_OS21; break;
 	case  16:
 	case  20:
 	case  24:
@@ -1190,27 +1966,50 @@ static bool s_read_info_header(BMPREAD_R rp)
 	case  46:
 	case  48:
 	case  60:
-	case  64: rp->ih->version = BMPINFO_OS22;      break;
-	case  40: rp->ih->version = BMPINFO_V3;        break;
-	case  52: rp->ih->version = BMPINFO_V3_ADOBE1; break;
-	case  56: rp->ih->version = BMPINFO_V3_ADOBE2; break;
-	case 108: rp->ih->version = BMPINFO_V4;        break;
-	case 124: rp->ih->version = BMPINFO_V5;        break;
+	case  64: *version = BMPINFO_OS22;      break;
+	case  40: *version = BMPINFO_V3;        break;
+	case  52: *version = BMPINFO_V3_ADOBE1; break;
+	case  56: *version = BMPINFO_V3_ADOBE2; break;
+	case 108: *version = BMPINFO_V4;        break;
+	case 124: *version = BMPINFO_V5;        break;
 	default:
-		if (rp->ih->size > 124)
-			rp->ih->version = BMPINFO_FUTURE;
-		else {
-			logerr(rp->log, "Invalid info header size (%lu)",
-			                   (unsigned long) rp->ih->size);
-			rp->lasterr = BMP_ERR_HEADER;
+		if (size > 124)
+			*version = BMPINFO_FUTURE;
+		else
 			return false;
-		}
 		break;
 	}
+	return true;
+}
+
+
+
+/*****************************************************************************
+ * 	s_read_info_header
+ *****************************************************************************/
+
+static bool s_read_info_header(BMPREAD_R rp)
+{
+	int           skip, i, filepos;
+	unsigned char buf[124];
+	size_t        read_size;
+
+	filepos = (int) rp->bytes_read;
+
+	if (!cm_read_u32_le(rp, &rp->ih->size))
+		goto abort_file_err;
+	rp->bytes_read += 4;
+
+	if (!s_info_version(rp->ih->size, &rp->ih->version)) {
+		logerr(rp->log, "Invalid info header size (%lu)",
+		                   (unsigned long) rp->ih->size);
+		rp->lasterr = BMP_ERR_HEADER;
+		return false;
+	}
 
 	memset(buf, 0, sizeof buf);
 	read_size = MIN(sizeof buf - 4, rp->ih->size - 4);
-	if (fread(buf + 4, 1, read_size, rp->file) != read_size)
+	if (cm_read(rp, buf + 4, read_size) != read_size)
 		goto abort_file_err;
 
 	rp->bytes_read += read_size;
@@ -1281,17 +2080,17 @@ header_done:
 	skip = (int) rp->ih->size - ((int) rp->bytes_read - filepos);
 
 	for (i = 0; i < skip; i++) {
-		if (EOF == getc(rp->file))
+		if (1 != cm_read(rp, buf, 1))
 			goto abort_file_err;
 		rp->bytes_read++;
 	}
 
-	s_detect_os2_compression(rp);
+	s_detect_os2_compression(rp->fh, rp->ih);
 
 	return true;
 
 abort_file_err:
-	if (feof(rp->file)) {
+	if (cm_is_eof(rp)) {
 		logerr(rp->log, "Unexpected end of file while reading BMP info header");
 		rp->lasterr = BMP_ERR_TRUNCATED;
 	} else {
@@ -1308,22 +2107,22 @@ abort_file_err:
  * 	s_detect_os2_compression
  *****************************************************************************/
 
-static void s_detect_os2_compression(BMPREAD_R rp)
+static void s_detect_os2_compression(const struct Bmpfile *fh, struct Bmpinfo *ih)
 {
-	if (rp->ih->version == BMPINFO_V3) {
+	if (ih->version == BMPINFO_V3) {
 		/* might actually be a 40-byte OS/2 header */
-		if (rp->fh->size == 54 ||
-		    (rp->ih->compression == BI_OS2_HUFFMAN_DUP && rp->ih->bitcount == 1) ||
-		    (rp->ih->compression == BI_OS2_RLE24_DUP && rp->ih->bitcount == 24)) {
-			rp->ih->version = BMPINFO_OS22;
+		if (fh->size == 54 ||
+		    (ih->compression == BI_OS2_HUFFMAN_DUP && ih->bitcount == 1) ||
+		    (ih->compression == BI_OS2_RLE24_DUP && ih->bitcount == 24)) {
+			ih->version = BMPINFO_OS22;
 		}
 	}
 
-	if (rp->ih->version <= BMPINFO_OS22) {
-		if (rp->ih->compression == BI_OS2_HUFFMAN_DUP)
-			rp->ih->compression = BI_OS2_HUFFMAN;
-		else if (rp->ih->compression == BI_OS2_RLE24_DUP)
-			rp->ih->compression = BI_OS2_RLE24;
+	if (ih->version <= BMPINFO_OS22) {
+		if (ih->compression == BI_OS2_HUFFMAN_DUP)
+			ih->compression = BI_OS2_HUFFMAN;
+		else if (ih->compression == BI_OS2_RLE24_DUP)
+			ih->compression = BI_OS2_RLE24;
 	}
 }
 
@@ -1460,6 +2259,28 @@ API BMPRESULT bmpread_info_channel_bits(BMPHANDLE h, int *r, int *g, int *b, int
 
 
 
+/*****************************************************************************
+ * 	bmpread_get_stats
+ *****************************************************************************/
+
+API BMPRESULT bmpread_get_stats(BMPHANDLE h, BMPSTATS *stats)
+{
+	BMPREAD rp;
+
+	if (!(h && cm_check_is_read_handle(h)))
+		return BMP_RESULT_ERROR;
+	rp = (BMPREAD)(void*)h;
+
+	if (!stats)
+		return BMP_RESULT_ERROR;
+
+	*stats       = rp->stats;
+	stats->bytes = rp->bytes_read;
+	return BMP_RESULT_OK;
+}
+
+
+
 /*****************************************************************************
  * 	s_infoheader_name
  *****************************************************************************/
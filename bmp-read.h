@@ -21,3 +21,6 @@
 void br_free(BMPREAD rp);
 bool br_set_resultbits(BMPREAD_R rp);
 BMPRESULT br_set_number_format(BMPREAD_R rp, enum BmpFormat format);
+void br_feed_scan(BMPREAD_R rp);
+int br_lines_left(BMPREAD_R rp, int y_end);
+bool br_can_seek(BMPREAD_R rp);
@@ -0,0 +1,237 @@
+/* bmplib - bmp-transcode.c
+ *
+ * Copyright (c) 2024, Rupert Weber.
+ *
+ * This file is part of bmplib.
+ * bmplib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BMPLIB_LIB
+
+#include "config.h"
+#include "bmplib.h"
+#include "logging.h"
+#include "bmp-common.h"
+#include "bmp-read.h"
+
+
+#define TRANSCODE_WINDOW ((size_t) 1024 * 1024) /* default working memory */
+
+static bool s_setup_writer(BMPREAD_R rp, BMPWRITE_R wp);
+static BMPRESULT s_worse(BMPRESULT a, BMPRESULT b);
+
+
+/*****************************************************************************
+ * 	bmp_transcode
+ *
+ * Read the BMP from hread and save it to hwrite, a window of
+ * lines at a time. If both have the same orientation, the lines
+ * go straight through in file order. Otherwise the writer needs
+ * the lines in the opposite order of the file, and we walk the
+ * image backwards with bmpread_load_region(), one window at a
+ * time, which needs a seekable file (or memory/mmap).
+ *****************************************************************************/
+
+API BMPRESULT bmp_transcode(BMPHANDLE hread, BMPHANDLE hwrite, size_t mem_limit)
+{
+	BMPREAD        rp;
+	BMPWRITE       wp;
+	BMPRESULT      res, rres, getinfo_return, ret = BMP_RESULT_OK;
+	BMPORIENT      orientation;
+	unsigned char *buf = NULL;
+	size_t         linesize;
+	int            width, height, channels, bits, window, n, y, y0, i, done;
+	bool           flip;
+
+	if (!(hread && cm_check_is_read_handle(hread)))
+		return BMP_RESULT_ERROR;
+	if (!(hwrite && cm_check_is_write_handle(hwrite)))
+		return BMP_RESULT_ERROR;
+	rp = (BMPREAD)(void*)hread;
+	wp = (BMPWRITE)(void*)hwrite;
+
+	res = bmpread_load_info(hread);
+	if (res != BMP_RESULT_OK && res != BMP_RESULT_INSANE) {
+		logerr(wp->log, "Cannot transcode, reading BMP info failed");
+		return BMP_RESULT_ERROR;
+	}
+
+	res = bmpread_dimensions(hread, &width, &height, &channels, &bits, &orientation);
+	if (res != BMP_RESULT_OK && res != BMP_RESULT_INSANE)
+		return BMP_RESULT_ERROR;
+
+	flip = orientation != wp->outorientation;
+
+	linesize = (size_t) width * rp->result_bytes_per_pixel;
+	if (!mem_limit)
+		mem_limit = TRANSCODE_WINDOW;
+	window = (int) MIN((size_t) height, MAX((size_t) 1, mem_limit / linesize));
+
+	/* check everything that would make us fail halfway, before
+	 * anything is written
+	 */
+	if (flip && rp->scale_shift) {
+		logerr(wp->log, "Cannot transcode a scaled image to the opposite orientation");
+		return BMP_RESULT_ERROR;
+	}
+	if (flip && window < height && !br_can_seek(rp)) {
+		logerr(wp->log, "Cannot transcode to the opposite orientation, "
+		                "file is not seekable");
+		return BMP_RESULT_ERROR;
+	}
+
+	if (!s_setup_writer(rp, wp))
+		return BMP_RESULT_ERROR;
+
+	if (!(buf = cm_malloc(&rp->allocator, (size_t) window * linesize))) {
+		logsyserr(wp->log, "Allocating transcode buffer");
+		return BMP_RESULT_ERROR;
+	}
+
+	/* the insanity limit is about the full image in memory, which
+	 * we never need here. Only for this call, the caller's handle
+	 * keeps its limit.
+	 */
+	getinfo_return = rp->getinfo_return;
+	if (getinfo_return == BMP_RESULT_INSANE)
+		rp->getinfo_return = BMP_RESULT_OK;
+
+	for (y = 0; y < height; y += n) {
+		n = MIN(window, height - y);
+
+		if (!flip) {
+			/* file order in, file order out */
+			done = rp->lbl_y;
+			rres = bmpread_load_lines(hread, n, buf, linesize);
+			if (rres == BMP_RESULT_TRUNCATED) {
+				/* lines after the truncation aren't touched */
+				done = MIN(rp->lbl_y - done, n);
+				memset(buf + (size_t) done * linesize, 0, (size_t) (n - done) * linesize);
+			}
+		} else {
+			/* regions are read top-down. For a bottom-up writer,
+			 * start with the bottom window (and reverse below)
+			 */
+			memset(buf, 0, (size_t) n * linesize);
+			y0   = (wp->outorientation == BMP_ORIENT_TOPDOWN) ? y : height - y - n;
+			rres = bmpread_load_region(hread, 0, y0, width, n, &buf);
+		}
+
+		if (rres == BMP_RESULT_ERROR) {
+			if (!(rp->image_loaded && rp->truncated)) {
+				logerr(wp->log, "Cannot transcode, reading line %d failed", y);
+				ret = BMP_RESULT_ERROR;
+				break;
+			}
+			/* a truncated image stops loading, the rest stays empty */
+			memset(buf, 0, (size_t) n * linesize);
+			rres = BMP_RESULT_TRUNCATED;
+		}
+		ret = s_worse(ret, rres);
+
+		if (!flip || wp->outorientation == BMP_ORIENT_TOPDOWN) {
+			res = bmpwrite_save_lines(hwrite, n, buf, linesize);
+		} else {
+			res = BMP_RESULT_OK;
+			for (i = n - 1; i >= 0 && res == BMP_RESULT_OK; i--)
+				res = bmpwrite_save_line(hwrite, buf + (size_t) i * linesize);
+		}
+		if (res != BMP_RESULT_OK) {
+			ret = BMP_RESULT_ERROR;
+			break;
+		}
+	}
+
+	rp->getinfo_return = getinfo_return;
+	cm_free(&rp->allocator, buf);
+	return ret;
+}
+
+
+
+/*****************************************************************************
+ * 	s_setup_writer
+ *
+ * Unless the caller has set them already, the writer gets the
+ * dimensions, number format, and palette of the image as the
+ * read handle returns it.
+ *****************************************************************************/
+
+static bool s_setup_writer(BMPREAD_R rp, BMPWRITE_R wp)
+{
+	BMPHANDLE      hwrite = (BMPHANDLE)(void*)wp;
+	unsigned char *palette;
+	int            i, c, numcolors;
+	bool           ok;
+
+	if (wp->dimensions_set) {
+		if (wp->width != rp->result_width || wp->height != (int) rp->result_height ||
+		    wp->source_channels != rp->result_channels ||
+		    wp->source_bitsperchannel != rp->result_bitsperchannel ||
+		    wp->source_format != (int) rp->result_format) {
+			logerr(wp->log, "Write handle dimensions don't match the image "
+			                "(%dx%d, %d channels, %d bits)", rp->result_width,
+			                (int) rp->result_height, rp->result_channels,
+			                rp->result_bitsperchannel);
+			return false;
+		}
+	} else {
+		if (BMP_RESULT_OK != bmp_set_number_format(hwrite, rp->result_format))
+			return false;
+		if (BMP_RESULT_OK != bmpwrite_set_dimensions(hwrite, (unsigned) rp->result_width,
+		                                             rp->result_height,
+		                                             (unsigned) rp->result_channels,
+		                                             (unsigned) rp->result_bitsperchannel))
+			return false;
+	}
+
+	if (!rp->result_indexed || wp->palette)
+		return true;
+
+	numcolors = rp->palette->numcolors;
+	if (!(palette = cm_malloc(&wp->allocator, (size_t) numcolors * 4))) {
+		logsyserr(wp->log, "Allocating palette");
+		return false;
+	}
+	for (i = 0; i < numcolors; i++) {
+		for (c = 0; c < 3; c++)
+			palette[4*i + c] = (unsigned char) rp->palette->color[i].value[c];
+		palette[4*i + 3] = 0;
+	}
+	ok = BMP_RESULT_OK == bmpwrite_set_palette(hwrite, numcolors, palette);
+	cm_free(&wp->allocator, palette);
+	return ok;
+}
+
+
+
+/*****************************************************************************
+ * 	s_worse
+ *****************************************************************************/
+
+static BMPRESULT s_worse(BMPRESULT a, BMPRESULT b)
+{
+	if (a == BMP_RESULT_TRUNCATED || b == BMP_RESULT_TRUNCATED)
+		return BMP_RESULT_TRUNCATED;
+	if (a == BMP_RESULT_INVALID || b == BMP_RESULT_INVALID)
+		return BMP_RESULT_INVALID;
+	return BMP_RESULT_OK;
+}
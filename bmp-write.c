@@ -36,14 +36,27 @@
 #include "bmp-common.h"
 #include "huffman.h"
 #include "bmp-write.h"
-
-static void s_decide_outformat(BMPWRITE_R wp);
+#include "kernels.h"
+
+static void s_decide_outformat(BMPWRITE_R wp, const unsigned char *image, int nlines,
+                               size_t stride);
+static int s_choose_rle(BMPWRITE_R wp, const unsigned char *image, int nlines, size_t stride);
+static int s_palette_bitcount(BMPWRITE_R wp);
+static bool s_save_line(BMPWRITE_R wp, const unsigned char *line);
+static bool s_init_quantizer(BMPWRITE_R wp);
+static void s_quantize_line(BMPWRITE_R wp, const unsigned char *restrict line);
+static void s_choose_packer(BMPWRITE_R wp);
+static inline uint16_t float_to_s2_13(double d);
 static bool s_write_palette(BMPWRITE_R wp);
 static bool s_write_bmp_file_header(BMPWRITE_R wp);
 static bool s_write_bmp_info_header(BMPWRITE_R wp);
 static inline int s_write_one_byte(int byte, BMPWRITE_R wp);
-static bool s_save_header(BMPWRITE_R wp);
+static bool s_save_header(BMPWRITE_R wp, const unsigned char *image, int nlines, size_t stride);
+static inline size_t s_source_stride(BMPWRITE_R wp);
 static bool s_try_saving_image_size(BMPWRITE_R wp);
+static bool s_finish_stream(BMPWRITE_R wp);
+static bool s_finish_image(BMPWRITE_R wp);
+static void s_patch_sizes(BMPWRITE_R wp, unsigned char *header);
 static int s_calc_mask_values(BMPWRITE_R wp);
 static bool s_is_setting_compatible(BMPWRITE_R wp, const char *setting, ...);
 static bool s_check_already_saved(BMPWRITE_R wp);
@@ -54,45 +67,310 @@ static bool s_check_already_saved(BMPWRITE_R wp);
  * 	bmpwrite_new
  *****************************************************************************/
 
+static BMPWRITE s_new_handle(const struct BmpAllocator *allocator);
+
 API BMPHANDLE bmpwrite_new(FILE *file)
 {
-	BMPWRITE wp = NULL;
+	BMPWRITE wp;
 
-	if (!(wp = malloc(sizeof *wp))) {
-		goto abort;
+	if (!(wp = s_new_handle(NULL)))
+		return NULL;
+
+	if (!file) {
+		logerr(wp->log, "Must supply file handle");
+		bw_free(wp);
+		return NULL;
+	}
+
+	wp->file = file;
+
+	if (!(wp->wbuf = cm_malloc(&wp->allocator, WRITEBUF_CHUNK))) {
+		logsyserr(wp->log, "allocating write buffer");
+		bw_free(wp);
+		return NULL;
+	}
+	wp->wbuf_size = WRITEBUF_CHUNK;
+
+	return (BMPHANDLE)(void*)wp;
+}
+
+
+
+/*****************************************************************************
+ * 	bmpwrite_new_mem
+ *
+ * Without a file, all output is collected in wbuf.
+ * Either in a buffer supplied by the caller, which is
+ * never grown, or in our own buffer which grows as
+ * needed.
+ *****************************************************************************/
+
+API BMPHANDLE bmpwrite_new_mem(void *buffer, size_t size)
+{
+	BMPWRITE wp;
+
+	if (!(wp = s_new_handle(NULL)))
+		return NULL;
+
+	wp->mem_target = true;
+	if (buffer) {
+		wp->wbuf       = buffer;
+		wp->wbuf_size  = size;
+		wp->wbuf_fixed = true;
+	}
+
+	return (BMPHANDLE)(void*)wp;
+}
+
+
+
+/*****************************************************************************
+ * 	bmpwrite_new_alloc
+ *
+ * All memory of the handle, including the buffer
+ * returned by bmpwrite_get_buffer(), comes from the
+ * given allocator. The handle has no file or memory
+ * target yet, it must first be given one with
+ * bmpwrite_reset() or bmpwrite_reset_mem().
+ *****************************************************************************/
+
+API BMPHANDLE bmpwrite_new_alloc(const BMPALLOCATOR *allocator)
+{
+	BMPWRITE wp;
+
+	if (!allocator || !allocator->alloc)
+		return NULL;
+
+	if (!(wp = s_new_handle(allocator)))
+		return NULL;
+
+	return (BMPHANDLE)(void*)wp;
+}
+
+
+
+/*****************************************************************************
+ * 	bmpwrite_get_buffer
+ *****************************************************************************/
+
+API BMPRESULT bmpwrite_get_buffer(BMPHANDLE h, void **pbuffer, size_t *psize)
+{
+	BMPWRITE       wp;
+	unsigned char *tmp;
+
+	if (!cm_check_is_write_handle(h))
+		return BMP_RESULT_ERROR;
+	wp = (BMPWRITE)(void*)h;
+
+	if (!wp->mem_target) {
+		logerr(wp->log, "Handle wasn't created with bmpwrite_new_mem()");
+		return BMP_RESULT_ERROR;
+	}
+
+	if (!wp->image_complete) {
+		logerr(wp->log, "Image has not been saved (yet)");
+		return BMP_RESULT_ERROR;
 	}
+
+	if (!wp->wbuf) {
+		logerr(wp->log, "Buffer has already been handed over");
+		return BMP_RESULT_ERROR;
+	}
+
+	if (psize)
+		*psize = wp->wbuf_len;
+
+	if (!wp->wbuf_fixed) {
+		/* our own buffer, hand over, shrunk to the actual size
+		 * (not with a custom allocator, that would be a copy) */
+		if (!wp->allocator.alloc && wp->wbuf_len < wp->wbuf_size &&
+		    (tmp = realloc(wp->wbuf, MAX(wp->wbuf_len, 1))))
+			wp->wbuf = tmp;
+		if (pbuffer)
+			*pbuffer = wp->wbuf;
+		else
+			cm_free(&wp->allocator, wp->wbuf);
+		wp->wbuf      = NULL;
+		wp->wbuf_size = 0;
+		wp->wbuf_len  = 0;
+	} else if (pbuffer) {
+		*pbuffer = wp->wbuf;
+	}
+
+	return BMP_RESULT_OK;
+}
+
+
+
+/*****************************************************************************
+ * 	bmpwrite_reset / bmpwrite_reset_mem
+ *
+ * Reuse the handle for another BMP. All settings which
+ * describe the image are forgotten, but the allocations
+ * (header structs, log, write buffer, palette, line and
+ * RLE buffers) are kept. Threads, streaming and the
+ * bmpwrite_allow_*() settings stay in effect.
+ *****************************************************************************/
+
+static void s_reset_handle(BMPWRITE wp);
+
+API BMPRESULT bmpwrite_reset(BMPHANDLE h, FILE *file)
+{
+	BMPWRITE       wp;
+	unsigned char *wbuf = NULL;
+
+	if (!cm_check_is_write_handle(h))
+		return BMP_RESULT_ERROR;
+	wp = (BMPWRITE)(void*)h;
+
+	if (!file) {
+		logerr(wp->log, "Must supply file handle");
+		return BMP_RESULT_ERROR;
+	}
+
+	if (!wp->wbuf || wp->wbuf_fixed) {
+		/* allocate before we touch the handle, so it stays
+		 * intact if this fails */
+		if (!(wbuf = cm_malloc(&wp->allocator, WRITEBUF_CHUNK))) {
+			logsyserr(wp->log, "allocating write buffer");
+			return BMP_RESULT_ERROR;
+		}
+	}
+
+	s_reset_handle(wp);
+	wp->file = file;
+	if (wbuf) {
+		if (wp->wbuf)
+			cm_free(&wp->allocator, wp->wbuf);
+		wp->wbuf      = wbuf;
+		wp->wbuf_size = WRITEBUF_CHUNK;
+	}
+
+	return BMP_RESULT_OK;
+}
+
+
+API BMPRESULT bmpwrite_reset_mem(BMPHANDLE h, void *buffer, size_t size)
+{
+	BMPWRITE wp;
+
+	if (!cm_check_is_write_handle(h))
+		return BMP_RESULT_ERROR;
+	wp = (BMPWRITE)(void*)h;
+
+	s_reset_handle(wp);
+	wp->mem_target = true;
+	if (buffer) {
+		if (wp->wbuf)
+			cm_free(&wp->allocator, wp->wbuf);
+		wp->wbuf       = buffer;
+		wp->wbuf_size  = size;
+		wp->wbuf_fixed = true;
+	}
+
+	return BMP_RESULT_OK;
+}
+
+
+static void s_reset_handle(BMPWRITE wp)
+{
+	struct Bmpwrite keep = *wp;
+
+	if (wp->spill)
+		fclose(wp->spill);
+	if (wp->stream_header)
+		cm_free(&wp->allocator, wp->stream_header);
+	if (keep.palette) {
+		/* only one of palette/spare_palette is ever allocated */
+		keep.spare_palette = keep.palette;
+	}
+	if (keep.wbuf_fixed) {
+		/* the caller's buffer, not ours to keep */
+		keep.wbuf      = NULL;
+		keep.wbuf_size = 0;
+	}
+
 	memset(wp, 0, sizeof *wp);
-	wp->magic = HMAGIC_WRITE;
+	wp->magic            = HMAGIC_WRITE;
+	wp->log              = keep.log;
+	wp->allocator        = keep.allocator;
+	wp->fh               = keep.fh;
+	wp->ih               = keep.ih;
+	wp->wbuf             = keep.wbuf;
+	wp->wbuf_size        = keep.wbuf_size;
+	wp->spare_palette    = keep.spare_palette;
+	wp->palette_capacity = keep.palette_capacity;
+	wp->pack_lut         = keep.pack_lut;
+	wp->linebuf          = keep.linebuf;
+	wp->linebuf_size     = keep.linebuf_size;
+	wp->group            = keep.group;
+	wp->group_width      = keep.group_width;
+	wp->quant            = keep.quant;
+	wp->qline            = keep.qline;
+	wp->qline_width      = keep.qline_width;
+	wp->kern             = keep.kern;
+
+	wp->nthreads      = keep.nthreads;
+	wp->streaming     = keep.streaming;
+	wp->stream_limit  = keep.stream_limit;
+	wp->allow_2bit    = keep.allow_2bit;
+	wp->allow_huffman = keep.allow_huffman;
+	wp->allow_rle24   = keep.allow_rle24;
+	wp->timing        = keep.timing;
 
 	wp->rle_requested  = BMP_RLE_NONE;
 	wp->outorientation = BMP_ORIENT_BOTTOMUP;
 	wp->source_format  = BMP_FORMAT_INT;
 
-	if (!(wp->log = logcreate()))
-		goto abort;
+	memset(wp->fh, 0, sizeof *wp->fh);
+	memset(wp->ih, 0, sizeof *wp->ih);
+	wp->ih->cstype = LCS_WINDOWS_COLOR_SPACE;
+	logreset(wp->log);
+}
 
-	if (!file) {
-		logerr(wp->log, "Must supply file handle");
+
+
+/*****************************************************************************
+ * 	s_new_handle
+ *****************************************************************************/
+
+static BMPWRITE s_new_handle(const struct BmpAllocator *allocator)
+{
+	static const struct BmpAllocator libc = { NULL, NULL, NULL };
+	BMPWRITE wp = NULL;
+
+	if (!allocator)
+		allocator = &libc;
+
+	if (!(wp = cm_malloc(allocator, sizeof *wp))) {
 		goto abort;
 	}
+	memset(wp, 0, sizeof *wp);
+	wp->magic     = HMAGIC_WRITE;
+	wp->allocator = *allocator;
 
-	wp->file = file;
+	wp->rle_requested  = BMP_RLE_NONE;
+	wp->outorientation = BMP_ORIENT_BOTTOMUP;
+	wp->source_format  = BMP_FORMAT_INT;
+	wp->kern           = kern_select();
+	wp->nthreads       = 1;
+
+	if (!(wp->log = logcreate(&wp->allocator)))
+		goto abort;
 
-	if (!(wp->fh = malloc(sizeof *wp->fh))) {
+	if (!(wp->fh = cm_calloc(&wp->allocator, sizeof *wp->fh))) {
 		logsyserr(wp->log, "allocating bmp file header");
 		goto abort;
 	}
-	memset(wp->fh, 0, sizeof *wp->fh);
 
-	if (!(wp->ih = malloc(sizeof *wp->ih))) {
+	if (!(wp->ih = cm_calloc(&wp->allocator, sizeof *wp->ih))) {
 		logsyserr(wp->log, "allocating bmp info header");
 		goto abort;
 	}
-	memset(wp->ih, 0, sizeof *wp->ih);
 	/* In case we need to write V4/V5 header: */
 	wp->ih->cstype = LCS_WINDOWS_COLOR_SPACE;
 
-	return (BMPHANDLE)(void*)wp;
+	return wp;
 
 abort:
 	if (wp)
@@ -228,7 +506,6 @@ API BMPRESULT bmpwrite_set_palette(BMPHANDLE h, int numcolors,
 {
 	BMPWRITE wp;
 	int      i, c;
-	size_t   memsize;
 
 	if (!cm_check_is_write_handle(h))
 		return BMP_RESULT_ERROR;
@@ -251,14 +528,13 @@ API BMPRESULT bmpwrite_set_palette(BMPHANDLE h, int numcolors,
 		return BMP_RESULT_ERROR;
 	}
 
-	memsize = sizeof *wp->palette + numcolors * sizeof wp->palette->color[0];
-	if (!(wp->palette = malloc(memsize))) {
+	wp->palette = cm_get_palette(&wp->allocator, &wp->spare_palette,
+	                             &wp->palette_capacity, numcolors);
+	if (!wp->palette) {
 		logsyserr(wp->log, "Allocating palette");
 		return BMP_RESULT_ERROR;
 	}
-	memset(wp->palette, 0, memsize);
 
-	wp->palette->numcolors = numcolors;
 	for (i = 0; i < numcolors; i++) {
 		for (c = 0; c < 3; c++) {
 			wp->palette->color[i].value[c] = palette[4*i + c];
@@ -270,6 +546,34 @@ API BMPRESULT bmpwrite_set_palette(BMPHANDLE h, int numcolors,
 
 
 
+/*****************************************************************************
+ * 	bmpwrite_map_to_palette
+ *
+ * Source image is 8-bit RGB or RGBA, we map the pixels
+ * to the palette ourselves (see s_quantize_line()).
+ *****************************************************************************/
+
+API BMPRESULT bmpwrite_map_to_palette(BMPHANDLE h)
+{
+	BMPWRITE wp;
+
+	if (!cm_check_is_write_handle(h))
+		return BMP_RESULT_ERROR;
+	wp = (BMPWRITE)(void*)h;
+
+	if (s_check_already_saved(wp))
+		return BMP_RESULT_ERROR;
+
+	if (!s_is_setting_compatible(wp, "maptopalette"))
+		return BMP_RESULT_ERROR;
+
+	wp->map_palette = true;
+
+	return BMP_RESULT_OK;
+}
+
+
+
 /*****************************************************************************
  * 	bmpwrite_set_orientation
  *****************************************************************************/
@@ -326,7 +630,8 @@ API BMPRESULT bmpwrite_set_rle(BMPHANDLE h, enum BmpRLEtype type)
 	if (!s_is_setting_compatible(wp, "rle", type))
 		return BMP_RESULT_ERROR;
 
-	if (!cm_is_one_of(3, (int) type, (int) BMP_RLE_NONE, (int) BMP_RLE_AUTO, (int) BMP_RLE_RLE8)) {
+	if (!cm_is_one_of(5, (int) type, (int) BMP_RLE_NONE, (int) BMP_RLE_AUTO, (int) BMP_RLE_RLE8,
+	                     (int) BMP_RLE_SMALLEST, (int) BMP_RLE_FASTEST)) {
 		logerr(wp->log, "Invalid RLE type specified (%d)", (int) type);
 		return BMP_RESULT_ERROR;
 	}
@@ -450,6 +755,108 @@ API BMPRESULT bmpwrite_set_64bit(BMPHANDLE h)
 
 
 
+/*****************************************************************************
+ * 	bmpwrite_set_streaming
+ *****************************************************************************/
+
+API BMPRESULT bmpwrite_set_streaming(BMPHANDLE h, size_t mem_limit)
+{
+	BMPWRITE wp;
+
+	if (!cm_check_is_write_handle(h))
+		return BMP_RESULT_ERROR;
+	wp = (BMPWRITE)(void*)h;
+
+	if (s_check_already_saved(wp))
+		return BMP_RESULT_ERROR;
+
+	if (wp->line_by_line) {
+		logerr(wp->log, "Cannot change streaming mode after saving has started");
+		return BMP_RESULT_ERROR;
+	}
+
+	wp->streaming    = true;
+	wp->stream_limit = mem_limit;
+	return BMP_RESULT_OK;
+}
+
+
+
+/*****************************************************************************
+ * 	bmpwrite_set_threads
+ *****************************************************************************/
+
+API BMPRESULT bmpwrite_set_threads(BMPHANDLE h, int nthreads)
+{
+	BMPWRITE wp;
+
+	if (!cm_check_is_write_handle(h))
+		return BMP_RESULT_ERROR;
+	wp = (BMPWRITE)(void*)h;
+
+	if (nthreads < 0) {
+		logerr(wp->log, "Invalid number of threads (%d)", nthreads);
+		return BMP_RESULT_ERROR;
+	}
+
+#if HAVE_PTHREAD
+	if (nthreads == 0)
+		nthreads = cm_online_cpus();
+	wp->nthreads = MIN(nthreads, BMP_MAX_THREADS);
+	return BMP_RESULT_OK;
+#else
+	if (nthreads > 1) {
+		logerr(wp->log, "Threads are not supported on this platform");
+		return BMP_RESULT_ERROR;
+	}
+	wp->nthreads = 1;
+	return BMP_RESULT_OK;
+#endif
+}
+
+
+
+/*****************************************************************************
+ * 	bmpwrite_set_stride
+ *****************************************************************************/
+
+API BMPRESULT bmpwrite_set_stride(BMPHANDLE h, size_t stride)
+{
+	BMPWRITE wp;
+
+	if (!cm_check_is_write_handle(h))
+		return BMP_RESULT_ERROR;
+	wp = (BMPWRITE)(void*)h;
+
+	if (s_check_already_saved(wp))
+		return BMP_RESULT_ERROR;
+
+	if (wp->line_by_line) {
+		logerr(wp->log, "Cannot change stride after saving has started");
+		return BMP_RESULT_ERROR;
+	}
+
+	wp->stride = stride;
+	return BMP_RESULT_OK;
+}
+
+
+
+/*****************************************************************************
+ * 	s_source_stride
+ *
+ * distance between the starts of two lines in the caller's image
+ *****************************************************************************/
+
+static inline size_t s_source_stride(BMPWRITE_R wp)
+{
+	if (wp->stride)
+		return wp->stride;
+	return (size_t) wp->width * wp->source_bytes_per_pixel;
+}
+
+
+
 /*****************************************************************************
  * 	s_check_already_saved
  *****************************************************************************/
@@ -491,7 +898,7 @@ static bool s_is_setting_compatible(BMPWRITE_R wp, const char *setting, ...)
 		}
 	} else if (!strcmp(setting, "srcbits")) {
 		bits = va_arg(args, int);
-		if (wp->palette && bits != 8) {
+		if ((wp->palette || wp->map_palette) && bits != 8) {
 			logerr(wp->log, "indexed images must be 8 bits (not %d)", bits);
 			ret = false;
 		} else if (wp->source_format == BMP_FORMAT_FLOAT && bits != 32) {
@@ -503,7 +910,11 @@ static bool s_is_setting_compatible(BMPWRITE_R wp, const char *setting, ...)
 		}
 	} else if (!strcmp(setting, "srcchannels")) {
 		channels = va_arg(args, int);
-		if (wp->palette && (channels != 1)) {
+		if (wp->map_palette && (channels != 3 && channels != 4)) {
+			logerr(wp->log, "Images mapped to a palette must have 3 or 4 channels (not %d)",
+			                channels);
+			ret = false;
+		} else if (wp->palette && !wp->map_palette && (channels != 1)) {
 			logerr(wp->log, "Indexed images must have 1 channel (not %d)", channels);
 			ret = false;
 		}
@@ -525,23 +936,40 @@ static bool s_is_setting_compatible(BMPWRITE_R wp, const char *setting, ...)
 			             cm_format_name(wp->source_format));
 			ret = false;
 		}
-		if (wp->dimensions_set) {
+		if (wp->dimensions_set && !wp->map_palette) {
 			if (!(wp->source_channels == 1 && wp->source_bitsperchannel == 8)) {
 				logerr (wp->log, "Indexed images must be 1 channel, 8 bits");
 				ret = false;
 			}
 		}
-	} else if (!strcmp(setting, "format")) {
-		format = va_arg(args, enum BmpFormat);
-		switch (format) {
-		case BMP_FORMAT_FLOAT:
-			if (wp->dimensions_set && wp->source_bitsperchannel != 32) {
-				logerr(wp->log, "float cannot be %d bits per pixel",
-				                           wp->source_bitsperchannel);
-				ret = false;
-			}
-			if (wp->palette) {
-				logerr(wp->log, "float cannot be used for indexed images");
+	} else if (!strcmp(setting, "maptopalette")) {
+		if (wp->out64bit) {
+			logerr(wp->log, "64bit BMPs cannot be indexed");
+			ret = false;
+		}
+		if (wp->source_format != BMP_FORMAT_INT) {
+			logerr(wp->log, "Images mapped to a palette must have INT format (not %s)",
+			             cm_format_name(wp->source_format));
+			ret = false;
+		}
+		if (wp->dimensions_set) {
+			if (!((wp->source_channels == 3 || wp->source_channels == 4) &&
+			      wp->source_bitsperchannel == 8)) {
+				logerr (wp->log, "Images mapped to a palette must be 3 or 4 channels, 8 bits");
+				ret = false;
+			}
+		}
+	} else if (!strcmp(setting, "format")) {
+		format = va_arg(args, enum BmpFormat);
+		switch (format) {
+		case BMP_FORMAT_FLOAT:
+			if (wp->dimensions_set && wp->source_bitsperchannel != 32) {
+				logerr(wp->log, "float cannot be %d bits per pixel",
+				                           wp->source_bitsperchannel);
+				ret = false;
+			}
+			if (wp->palette) {
+				logerr(wp->log, "float cannot be used for indexed images");
 				ret = false;
 			}
 			break;
@@ -562,7 +990,7 @@ static bool s_is_setting_compatible(BMPWRITE_R wp, const char *setting, ...)
 		}
 	} else if (!strcmp(setting, "rle")) {
 		rle = va_arg(args, enum BmpRLEtype);
-		if (rle == BMP_RLE_AUTO || rle == BMP_RLE_RLE8) {
+		if (rle != BMP_RLE_NONE) {
 			if (wp->outorientation != BMP_ORIENT_BOTTOMUP) {
 				logerr(wp->log, "RLE is invalid with top-down BMPs");
 				ret = false;
@@ -593,12 +1021,13 @@ static bool s_is_setting_compatible(BMPWRITE_R wp, const char *setting, ...)
  * 	s_decide_outformat
  *****************************************************************************/
 
-static void s_decide_outformat(BMPWRITE_R wp)
+static void s_decide_outformat(BMPWRITE_R wp, const unsigned char *image, int nlines,
+                               size_t stride)
 {
-	int      bitsum;
+	int      bitsum, rle;
 	uint64_t bitmapsize, filesize, bytes_per_line;
 
-	if ((wp->source_channels == 4 || wp->source_channels == 2) &&
+	if ((wp->source_channels == 4 || wp->source_channels == 2) && !wp->palette &&
 	    ((wp->outbits_set && wp->cmask.bits.alpha) || !wp->outbits_set) ) {
 		wp->has_alpha = true;
 	} else {
@@ -621,40 +1050,34 @@ static void s_decide_outformat(BMPWRITE_R wp)
 
 	bitsum = s_calc_mask_values(wp);
 
+	rle = s_choose_rle(wp, image, nlines, stride);
+
 	if (wp->palette) {
 		wp->ih->version = BMPINFO_V3;
 		wp->ih->size    = BMPIHSIZE_V3;
-		if (wp->rle_requested != BMP_RLE_NONE) {
-			if (wp->palette->numcolors > 16 ||
-			    wp->rle_requested == BMP_RLE_RLE8) {
-				wp->rle = 8;
-				wp->ih->compression = BI_RLE8;
-				wp->ih->bitcount    = 8;
-
-			} else if (wp->palette->numcolors > 2 || !wp->allow_huffman) {
-				wp->rle = 4;
-				wp->ih->compression = BI_RLE4;
-				wp->ih->bitcount    = 4;
-
-			} else {
-				wp->rle = 1;
-				wp->ih->compression = BI_OS2_HUFFMAN;
-				wp->ih->bitcount    = 1;
-				wp->ih->version     = BMPINFO_OS22;
-				wp->ih->size        = BMPIHSIZE_OS22;
-			}
+		if (rle == 8) {
+			wp->rle = 8;
+			wp->ih->compression = BI_RLE8;
+			wp->ih->bitcount    = 8;
+
+		} else if (rle == 4) {
+			wp->rle = 4;
+			wp->ih->compression = BI_RLE4;
+			wp->ih->bitcount    = 4;
+
+		} else if (rle == 1) {
+			wp->rle = 1;
+			wp->ih->compression = BI_OS2_HUFFMAN;
+			wp->ih->bitcount    = 1;
+			wp->ih->version     = BMPINFO_OS22;
+			wp->ih->size        = BMPIHSIZE_OS22;
 
 		} else {
 			wp->ih->compression = BI_RGB;
-			wp->ih->bitcount = 1;
-			while ((1<<wp->ih->bitcount) < wp->palette->numcolors)
-				wp->ih->bitcount *= 2;
-			if (wp->ih->bitcount == 2 && !wp->allow_2bit)
-				wp->ih->bitcount = 4;
+			wp->ih->bitcount    = s_palette_bitcount(wp);
 		}
 
-	} else if (wp->allow_rle24 && wp->source_channels == 3 &&
-	           wp->source_bitsperchannel && wp->rle_requested == BMP_RLE_AUTO) {
+	} else if (rle == 24) {
 		wp->rle = 24;
 		wp->ih->compression = BI_OS2_RLE24;
 		wp->ih->bitcount    = 24;
@@ -723,6 +1146,414 @@ static void s_decide_outformat(BMPWRITE_R wp)
 		wp->ih->height = -wp->height;
 	wp->ih->planes = 1;
 	wp->ih->sizeimage = (DWORD) ((wp->rle || bitmapsize > UINT32_MAX) ? 0 : bitmapsize);
+
+	s_choose_packer(wp);
+}
+
+
+
+/*****************************************************************************
+ * 	s_choose_rle
+ *
+ * Returns the compression to use (value for wp->rle,
+ * 0 = uncompressed).
+ * BMP_RLE_AUTO and BMP_RLE_RLE8 go by the size of the
+ * palette. For BMP_RLE_SMALLEST and BMP_RLE_FASTEST,
+ * a sample of the image lines is run through each of
+ * the encoders that can be used for this image, and
+ * the resulting file sizes are compared with the size
+ * of the uncompressed BMP. With BMP_RLE_FASTEST, we
+ * only compress if that saves at least 3/4 of the file
+ * size, because otherwise reading and writing the
+ * uncompressed file is faster.
+ * When writing line-by-line, only the first line is
+ * available for sampling.
+ *****************************************************************************/
+
+#define RLE_SAMPLE_LINES 32
+
+static uint64_t s_estimate_size(BMPWRITE_R wp, int rle, const unsigned char *image, int nlines,
+                                size_t stride);
+
+static int s_choose_rle(BMPWRITE_R wp, const unsigned char *image, int nlines, size_t stride)
+{
+	int      candidates[3], ncandidates = 0, i, best = 0;
+	uint64_t size, bestsize, rawsize;
+
+	switch (wp->rle_requested) {
+	case BMP_RLE_NONE:
+		return 0;
+
+	case BMP_RLE_AUTO:
+	case BMP_RLE_RLE8:
+		if (wp->palette) {
+			if (wp->palette->numcolors > 16 || wp->rle_requested == BMP_RLE_RLE8)
+				return 8;
+			else if (wp->palette->numcolors > 2 || !wp->allow_huffman)
+				return 4;
+			return 1;
+		}
+		if (wp->allow_rle24 && wp->source_channels == 3 &&
+		    wp->source_bitsperchannel && wp->rle_requested == BMP_RLE_AUTO)
+			return 24;
+		return 0;
+
+	default:
+		break;
+	}
+
+	if (wp->palette) {
+		if (wp->palette->numcolors <= 16)
+			candidates[ncandidates++] = 4;
+		candidates[ncandidates++] = 8;
+		if (wp->palette->numcolors <= 2 && wp->allow_huffman)
+			candidates[ncandidates++] = 1;
+		rawsize = ((uint64_t) wp->width * s_palette_bitcount(wp) + 7) / 8;
+	} else if (wp->allow_rle24 && wp->source_channels == 3 &&
+	           wp->source_bitsperchannel == 8 && !wp->out64bit) {
+		candidates[ncandidates++] = 24;
+		rawsize = (uint64_t) wp->width * 3;
+	} else {
+		return 0;
+	}
+	rawsize  = (rawsize + cm_align4padding(rawsize)) * wp->height + BMPIHSIZE_V3;
+	bestsize = rawsize;
+
+	for (i = 0; i < ncandidates; i++) {
+		size = s_estimate_size(wp, candidates[i], image, nlines, stride);
+		if (size < bestsize) {
+			bestsize = size;
+			best     = candidates[i];
+		}
+	}
+
+	if (wp->rle_requested == BMP_RLE_FASTEST && bestsize > rawsize / 4)
+		return 0;
+
+	return best;
+}
+
+
+
+/*****************************************************************************
+ * 	s_estimate_size
+ *
+ * Encode up to RLE_SAMPLE_LINES lines, evenly spread
+ * over the image, with a copy of the handle that has
+ * no file (so the output only goes to its wbuf), and
+ * extrapolate to the whole image. Includes the info
+ * header, which is larger for the OS/2 formats.
+ * Returns UINT64_MAX if the encoder failed.
+ *****************************************************************************/
+
+static uint64_t s_estimate_size(BMPWRITE_R wp, int rle, const unsigned char *image, int nlines,
+                                size_t stride)
+{
+	struct Bmpwrite est;
+	uint64_t        bits = 0;
+	int             i, nsample, y;
+	bool            ok = true;
+
+	est            = *wp;
+	est.rle        = rle;
+	est.file       = NULL;
+	est.stream_out = NULL;
+	est.wbuf       = NULL;
+	est.wbuf_size  = 0;
+	est.wbuf_len   = 0;
+	est.wbuf_fixed = false;
+	est.group      = NULL;
+	est.hufbuf     = 0;
+	est.hufbuf_len = 0;
+
+	nsample = MIN(nlines, RLE_SAMPLE_LINES);
+
+	for (i = 0; ok && i < nsample; i++) {
+		y  = (int) (((int64_t) 2 * i + 1) * nlines / (2 * nsample));
+		ok = s_save_line(&est, image + (size_t) y * stride);
+		bits += (uint64_t) est.wbuf_len * 8;
+		est.wbuf_len = 0;
+	}
+	bits += (uint64_t) est.hufbuf_len;
+
+	if (est.wbuf)
+		cm_free(&wp->allocator, est.wbuf);
+	if (est.group)
+		cm_free(&wp->allocator, est.group);
+
+	if (!ok)
+		return UINT64_MAX;
+
+	bits = bits * (uint64_t) wp->height / (uint64_t) nsample;
+	if (rle == 1)
+		return (bits + 6 * 12 + 7) / 8 + BMPIHSIZE_OS22;  /* RTC = 6 x EOL */
+	return bits / 8 + 2 + (rle == 24 ? BMPIHSIZE_OS22 : BMPIHSIZE_V3); /* + EOF */
+}
+
+
+
+/*****************************************************************************
+ * 	s_palette_bitcount
+ *****************************************************************************/
+
+static int s_palette_bitcount(BMPWRITE_R wp)
+{
+	int bitcount = 1;
+
+	while ((1 << bitcount) < wp->palette->numcolors)
+		bitcount *= 2;
+	if (bitcount == 2 && !wp->allow_2bit)
+		bitcount = 4;
+	return bitcount;
+}
+
+
+
+/*****************************************************************************
+ * 	s_choose_packer
+ *
+ * Pick the routine that converts a whole image line
+ * to output pixels, so that s_save_line_rgb() doesn't
+ * have to go through s_imgrgb_to_outbytes() for each
+ * pixel:
+ *  - 8-bit RGB/RGBA going to a plain 24-bit BGR or
+ *    32-bit BGRA file only needs the channels swapped
+ *    (SIMD kernels).
+ *  - any other 8-bit input is packed via per-channel
+ *    lookup tables (e.g. RGB -> 565, or 64-bit).
+ *  - float and s2.13 input going to 64-bit.
+ * Anything else keeps using s_imgrgb_to_outbytes().
+ *****************************************************************************/
+static void s_pack_kernel(BMPWRITE_R wp, const unsigned char *restrict src,
+                          unsigned char *restrict dst);
+static void s_pack_lut8(BMPWRITE_R wp, const unsigned char *restrict src,
+                        unsigned char *restrict dst);
+static void s_pack_float_64(BMPWRITE_R wp, const unsigned char *restrict src,
+                            unsigned char *restrict dst);
+static void s_pack_s2_13_64(BMPWRITE_R wp, const unsigned char *restrict src,
+                            unsigned char *restrict dst);
+static bool s_make_pack_lut(BMPWRITE_R wp);
+
+static void s_choose_packer(BMPWRITE_R wp)
+{
+	bool   std_shifts;
+	size_t size;
+
+	wp->packer      = NULL;
+	wp->line_kernel = NULL;
+
+	if (wp->palette || wp->rle)
+		return;
+
+	switch (wp->source_format) {
+	case BMP_FORMAT_INT:
+		if (wp->source_bitsperchannel != 8)
+			return;
+
+		std_shifts = !wp->out64bit &&
+		             wp->cmask.shift.red == 16 && wp->cmask.shift.green == 8 &&
+		             wp->cmask.shift.blue == 0 &&
+		             cm_all_equal_int(4, 8, wp->cmask.bits.red, wp->cmask.bits.green,
+		                                    wp->cmask.bits.blue);
+
+		if (std_shifts && wp->source_channels == 3 && !wp->has_alpha &&
+		    wp->ih->bitcount == 24) {
+			wp->line_kernel = wp->kern->swap3;
+		} else if (std_shifts && wp->source_channels == 4 && wp->has_alpha &&
+		           wp->cmask.bits.alpha == 8 && wp->cmask.shift.alpha == 24 &&
+		           wp->ih->bitcount == 32) {
+			wp->line_kernel = wp->kern->swap4;
+		}
+
+		if (wp->line_kernel)
+			wp->packer = s_pack_kernel;
+		else if (s_make_pack_lut(wp))
+			wp->packer = s_pack_lut8;
+		break;
+
+	case BMP_FORMAT_FLOAT:
+		if (wp->out64bit)
+			wp->packer = s_pack_float_64;
+		break;
+
+	case BMP_FORMAT_S2_13:
+		if (wp->out64bit)
+			wp->packer = s_pack_s2_13_64;
+		break;
+	}
+
+	if (!wp->packer)
+		return;
+
+	/* padding bytes at the end of linebuf stay zero */
+	size = (size_t) wp->width * wp->outbytes_per_pixel + wp->padding;
+	if (wp->linebuf && wp->linebuf_size >= size) {
+		memset(wp->linebuf, 0, size);
+		return;
+	}
+	if (wp->linebuf)
+		cm_free(&wp->allocator, wp->linebuf);
+	wp->linebuf_size = 0;
+	if (!(wp->linebuf = cm_calloc(&wp->allocator, size))) {
+		/* not fatal, fall back to per-pixel */
+		wp->packer      = NULL;
+		wp->line_kernel = NULL;
+		return;
+	}
+	wp->linebuf_size = size;
+}
+
+
+
+/*****************************************************************************
+ * 	s_make_pack_lut
+ *
+ * For 8-bit input, each channel's contribution to the
+ * output pixel only depends on the 8-bit value, so we
+ * can tabulate the (already shifted and masked) result
+ * of the same computation s_imgrgb_to_outbytes() does.
+ * Table 3 stays zero if there is no alpha channel, the
+ * constant alpha of 64-bit files is or'ed into table 0.
+ *****************************************************************************/
+
+static bool s_make_pack_lut(BMPWRITE_R wp)
+{
+	int    i, v, outchannels;
+	double scale;
+
+	if (!wp->pack_lut) {
+		if (!(wp->pack_lut = cm_malloc(&wp->allocator, 4 * sizeof *wp->pack_lut)))
+			return false;
+	}
+	memset(wp->pack_lut, 0, 4 * sizeof *wp->pack_lut);
+
+	outchannels = wp->has_alpha ? 4 : 3;
+
+	for (i = 0; i < outchannels; i++) {
+		scale = wp->out64bit ? 8192.0 : wp->cmask.maxval.val[i];
+		for (v = 0; v < 256; v++) {
+			wp->pack_lut[i][v] = ((unsigned long long) (unsigned long) (v * scale / 255.0 + 0.5) &
+			                      wp->cmask.mask.value[i]) << wp->cmask.shift.value[i];
+		}
+	}
+	if (!wp->has_alpha && wp->out64bit) {
+		for (v = 0; v < 256; v++)
+			wp->pack_lut[0][v] |= 8192ULL << wp->cmask.shift.alpha;
+	}
+	return true;
+}
+
+
+
+/*****************************************************************************
+ * 	s_pack_kernel
+ * 	s_pack_lut8
+ * 	s_pack_float_64
+ * 	s_pack_s2_13_64
+ *
+ * convert one image line to output pixels in dst.
+ * Offsets of the source channels are 0/1/2/3 for RGB(A)
+ * and 0/0/0/1 for gray(+alpha).
+ *****************************************************************************/
+
+static inline void s_put_le(unsigned char *dst, uint64_t v, int nbytes)
+{
+	int i;
+
+	for (i = 0; i < nbytes; i++)
+		dst[i] = (v >> (8 * i)) & 0xff;
+}
+
+
+static void s_pack_kernel(BMPWRITE_R wp, const unsigned char *restrict src,
+                          unsigned char *restrict dst)
+{
+	wp->line_kernel(src, dst, wp->width);
+}
+
+
+static inline void s_pack_lut8_n(BMPWRITE_R wp, const unsigned char *restrict src,
+                                 unsigned char *restrict dst, int nbytes)
+{
+	const uint64_t (*lut)[256] = (const uint64_t (*)[256]) wp->pack_lut;
+	int            x, g, b, a, stride;
+	uint64_t       v;
+
+	stride = wp->source_bytes_per_pixel;
+	g = b  = wp->source_channels >= 3 ? 1 : 0;
+	b     += b;
+	a      = wp->has_alpha ? stride - 1 : 0;
+
+	for (x = 0; x < wp->width; x++, src += stride, dst += nbytes) {
+		v = lut[0][src[0]] | lut[1][src[g]] | lut[2][src[b]] | lut[3][src[a]];
+		s_put_le(dst, v, nbytes);
+	}
+}
+
+
+static void s_pack_lut8(BMPWRITE_R wp, const unsigned char *restrict src,
+                        unsigned char *restrict dst)
+{
+	/* constant nbytes, so the compiler can specialize each case */
+	switch (wp->outbytes_per_pixel) {
+	case 2: s_pack_lut8_n(wp, src, dst, 2); break;
+	case 3: s_pack_lut8_n(wp, src, dst, 3); break;
+	case 4: s_pack_lut8_n(wp, src, dst, 4); break;
+	case 8: s_pack_lut8_n(wp, src, dst, 8); break;
+	default:
+		s_pack_lut8_n(wp, src, dst, wp->outbytes_per_pixel);
+		break;
+	}
+}
+
+
+static void s_pack_float_64(BMPWRITE_R wp, const unsigned char *restrict src,
+                            unsigned char *restrict dst)
+{
+	const float *px = (const float*)(const void*) src;
+	int          x, i, outchannels, offs[4], stride;
+	uint64_t     v, base;
+
+	stride      = wp->source_channels;
+	outchannels = wp->has_alpha ? 4 : 3;
+	for (i = 0; i < 3; i++)
+		offs[i] = stride >= 3 ? i : 0;
+	offs[3] = stride - 1;
+	base = wp->has_alpha ? 0 : 8192ULL << wp->cmask.shift.alpha;
+
+	for (x = 0; x < wp->width; x++, px += stride, dst += 8) {
+		v = base;
+		for (i = 0; i < outchannels; i++) {
+			v |= ((uint64_t) float_to_s2_13(px[offs[i]]) & wp->cmask.mask.value[i])
+			                                          << wp->cmask.shift.value[i];
+		}
+		s_put_le(dst, v, 8);
+	}
+}
+
+
+static void s_pack_s2_13_64(BMPWRITE_R wp, const unsigned char *restrict src,
+                            unsigned char *restrict dst)
+{
+	const uint16_t *px = (const uint16_t*)(const void*) src;
+	int             x, i, outchannels, offs[4], stride;
+	uint64_t        v, base;
+
+	stride      = wp->source_channels;
+	outchannels = wp->has_alpha ? 4 : 3;
+	for (i = 0; i < 3; i++)
+		offs[i] = stride >= 3 ? i : 0;
+	offs[3] = stride - 1;
+	base = wp->has_alpha ? 0 : 8192ULL << wp->cmask.shift.alpha;
+
+	for (x = 0; x < wp->width; x++, px += stride, dst += 8) {
+		v = base;
+		for (i = 0; i < outchannels; i++) {
+			v |= ((uint64_t) px[offs[i]] & wp->cmask.mask.value[i])
+			                            << wp->cmask.shift.value[i];
+		}
+		s_put_le(dst, v, 8);
+	}
 }
 
 
@@ -733,12 +1564,14 @@ static void s_decide_outformat(BMPWRITE_R wp)
 static bool s_save_line_rgb(BMPWRITE_R wp, const unsigned char *line);
 static bool s_save_line_rle(BMPWRITE_R wp, const unsigned char *line);
 static bool s_save_line_huff(BMPWRITE_R wp, const unsigned char *line);
+static int  s_save_bands(BMPWRITE_R wp, const unsigned char *image);
 
 API BMPRESULT bmpwrite_save_image(BMPHANDLE h, const unsigned char *image)
 {
 	BMPWRITE wp;
-	size_t   offs, linesize;
-	int      y, real_y, res;
+	size_t   offs, stride;
+	int      y, real_y;
+	double   start = 0.0;
 
 	if (!cm_check_is_write_handle(h))
 		return BMP_RESULT_ERROR;
@@ -752,120 +1585,581 @@ API BMPRESULT bmpwrite_save_image(BMPHANDLE h, const unsigned char *image)
 		return BMP_RESULT_ERROR;
 	}
 
-	if  (!s_save_header(wp))
-		return BMP_RESULT_ERROR;
+	stride = s_source_stride(wp);
+	if (stride < (size_t) wp->width * wp->source_bytes_per_pixel) {
+		logerr(wp->log, "Stride %lu is smaller than line size %lu", (unsigned long) stride,
+		       (unsigned long) ((size_t) wp->width * wp->source_bytes_per_pixel));
+		return BMP_RESULT_ERROR;
+	}
+	if (stride % (size_t) (wp->source_bitsperchannel / 8)) {
+		/* lines must start aligned to the 16/32-bit values */
+		logerr(wp->log, "Stride %lu is not a multiple of the channel size (%d bytes)",
+		       (unsigned long) stride, wp->source_bitsperchannel / 8);
+		return BMP_RESULT_ERROR;
+	}
+
+	if  (!s_save_header(wp, image, wp->height, stride))
+		return BMP_RESULT_ERROR;
+
+	wp->saveimage_done = true;
+	wp->bytes_written_before_bitdata = wp->bytes_written;
+
+	if (wp->timing)
+		start = cm_clock();
+
+	if ((y = s_save_bands(wp, image)) < 0)
+		goto abort;
+
+	for (; y < wp->height; y++) {
+		real_y = (wp->outorientation == BMP_ORIENT_TOPDOWN) ? y : wp->height - y - 1;
+		offs = (size_t) real_y * stride;
+		if (!s_save_line(wp, image + offs)) {
+			logerr(wp->log, "failed saving line %d", y);
+			goto abort;
+		}
+	}
+
+	if (!s_finish_image(wp))
+		goto abort;
+
+	wp->stats.rows = wp->height;
+	if (wp->timing)
+		wp->stats.time_pixels += cm_clock() - start;
+	return BMP_RESULT_OK;
+
+abort:
+	if (wp->timing)
+		wp->stats.time_pixels += cm_clock() - start;
+	return BMP_RESULT_ERROR;
+}
+
+
+
+/*****************************************************************************
+ * 	bmpwrite_save_line
+ *****************************************************************************/
+
+API BMPRESULT bmpwrite_save_line(BMPHANDLE h, const unsigned char *line)
+{
+	BMPWRITE wp;
+	double   start = 0.0;
+
+	if (!cm_check_is_write_handle(h))
+		return BMP_RESULT_ERROR;
+	wp = (BMPWRITE)(void*)h;
+
+	if (s_check_already_saved(wp))
+		return BMP_RESULT_ERROR;
+
+	if (!wp->line_by_line) {  /* first line */
+		if  (!s_save_header(wp, line, 1, 0))
+			goto abort;
+		wp->bytes_written_before_bitdata = wp->bytes_written;
+		wp->line_by_line = true;
+	}
+
+	if (wp->timing)
+		start = cm_clock();
+
+	if (!s_save_line(wp, line))
+		goto abort;
+	wp->stats.rows++;
+
+	if (++wp->lbl_y >= wp->height) {
+		if (!s_finish_image(wp))
+			goto abort;
+		wp->saveimage_done = true;
+	}
+
+	if (wp->timing)
+		wp->stats.time_pixels += cm_clock() - start;
+	return BMP_RESULT_OK;
+abort:
+	wp->saveimage_done = true;
+	return BMP_RESULT_ERROR;
+}
+
+
+
+/*****************************************************************************
+ * 	bmpwrite_save_lines
+ *
+ * Same as nlines calls to bmpwrite_save_line(), lines are stride bytes
+ * apart (0 = stride set with bmpwrite_set_stride()). All lines of the
+ * first batch are available to BMP_RLE_SMALLEST/FASTEST for the estimate.
+ *****************************************************************************/
+
+API BMPRESULT bmpwrite_save_lines(BMPHANDLE h, int nlines, const unsigned char *lines, size_t stride)
+{
+	BMPWRITE wp;
+	size_t   linesize;
+	double   start = 0.0;
+	int      i;
+
+	if (!cm_check_is_write_handle(h))
+		return BMP_RESULT_ERROR;
+	wp = (BMPWRITE)(void*)h;
+
+	if (s_check_already_saved(wp))
+		return BMP_RESULT_ERROR;
+
+	if (!lines) {
+		logerr(wp->log, "lines pointer is NULL");
+		return BMP_RESULT_ERROR;
+	}
+
+	linesize = (size_t) wp->width * wp->source_bytes_per_pixel;
+	if (!stride)
+		stride = s_source_stride(wp);
+
+	if (!wp->dimensions_set || nlines < 1 || nlines > wp->height - wp->lbl_y || stride < linesize ||
+	    stride % (size_t) (wp->source_bitsperchannel / 8)) {
+		logerr(wp->log, "Invalid request for %d lines with stride %lu (%d lines left, "
+		                "line size %lu)", nlines, (unsigned long) stride,
+		                wp->height - wp->lbl_y, (unsigned long) linesize);
+		return BMP_RESULT_ERROR;
+	}
+
+	if (!wp->line_by_line) {  /* first lines */
+		if  (!s_save_header(wp, lines, nlines, stride))
+			goto abort;
+		wp->bytes_written_before_bitdata = wp->bytes_written;
+		wp->line_by_line = true;
+	}
+
+	if (wp->timing)
+		start = cm_clock();
+
+	for (i = 0; i < nlines; i++) {
+		if (!s_save_line(wp, lines + (size_t) i * stride)) {
+			logerr(wp->log, "failed saving line %d", wp->lbl_y);
+			goto abort;
+		}
+		wp->stats.rows++;
+		wp->lbl_y++;
+	}
+
+	if (wp->lbl_y >= wp->height) {
+		if (!s_finish_image(wp))
+			goto abort;
+		wp->saveimage_done = true;
+	}
+
+	if (wp->timing)
+		wp->stats.time_pixels += cm_clock() - start;
+	return BMP_RESULT_OK;
+abort:
+	wp->saveimage_done = true;
+	return BMP_RESULT_ERROR;
+}
+
+
+
+/*****************************************************************************
+ * 	bmpwrite_get_stats
+ *****************************************************************************/
+
+API BMPRESULT bmpwrite_get_stats(BMPHANDLE h, BMPSTATS *stats)
+{
+	BMPWRITE wp;
+
+	if (!cm_check_is_write_handle(h))
+		return BMP_RESULT_ERROR;
+	wp = (BMPWRITE)(void*)h;
+
+	if (!stats)
+		return BMP_RESULT_ERROR;
+
+	*stats       = wp->stats;
+	stats->bytes = wp->bytes_written;
+	return BMP_RESULT_OK;
+}
+
 
-	wp->saveimage_done = true;
-	wp->bytes_written_before_bitdata = wp->bytes_written;
 
-	linesize = (size_t) wp->width * wp->source_bytes_per_pixel;
-	for (y = 0; y < wp->height; y++) {
-		real_y = (wp->outorientation == BMP_ORIENT_TOPDOWN) ? y : wp->height - y - 1;
-		offs = (size_t) real_y * linesize;
-		switch (wp->rle) {
-		case 4:
-		case 8:
-		case 24:
-			res = s_save_line_rle(wp, image + offs);
-			break;
-		case 1:
-			res = s_save_line_huff(wp, image + offs);
-			break;
-		default:
-			res = s_save_line_rgb(wp, image + offs);
-			break;
-		}
-		if (!res) {
-			logerr(wp->log, "failed saving line %d", y);
-			return BMP_RESULT_ERROR;
-		}
-	}
+/*****************************************************************************
+ * 	s_finish_image
+ *
+ * after the last line: write the end-of-file marker
+ * for RLE/Huffman and get the output to its final
+ * destination, with the correct sizes in the header
+ * if possible.
+ *****************************************************************************/
+
+static bool s_finish_image(BMPWRITE_R wp)
+{
 	if (wp->rle) {
 		if (wp->rle > 1) {
 			if (EOF == s_write_one_byte(0, wp) ||
 			    EOF == s_write_one_byte(1, wp)) {
 				logsyserr(wp->log, "Writing RLE end-of-file marker");
-				return BMP_RESULT_ERROR;
+				return false;
 			}
-		}
-		else {
+			wp->stats.rle_eof++;
+		} else {
 			if (!(huff_encode_rtc(wp) && huff_flush(wp))) {
 				logsyserr(wp->log, "Writing RTC end-of-file marker");
-				return BMP_RESULT_ERROR;
+				return false;
 			}
 		}
-		s_try_saving_image_size(wp);
 	}
 
-	return BMP_RESULT_OK;
+	if (wp->mem_target) {
+		/* everything is in wbuf, no need to go through a file */
+		if (wp->rle)
+			s_patch_sizes(wp, wp->wbuf);
+	} else if (wp->stream_out) {
+		if (!s_finish_stream(wp)) {
+			logsyserr(wp->log, "Writing image to BMP file");
+			return false;
+		}
+	} else {
+		if (!cm_flush_writebuf(wp)) {
+			logsyserr(wp->log, "Writing image to BMP file");
+			return false;
+		}
+		if (wp->rle)
+			s_try_saving_image_size(wp);
+	}
+	wp->image_complete = true;
+	return true;
 }
 
 
 
 /*****************************************************************************
- * 	bmpwrite_save_line
+ * 	s_save_line
  *****************************************************************************/
 
-API BMPRESULT bmpwrite_save_line(BMPHANDLE h, const unsigned char *line)
+static bool s_save_line(BMPWRITE_R wp, const unsigned char *line)
 {
-	BMPWRITE wp;
-	int      res;
-
-	if (!cm_check_is_write_handle(h))
-		return BMP_RESULT_ERROR;
-	wp = (BMPWRITE)(void*)h;
-
-	if (s_check_already_saved(wp))
-		return BMP_RESULT_ERROR;
-
-	if (!wp->line_by_line) {  /* first line */
-		if  (!s_save_header(wp))
-			goto abort;
-		wp->bytes_written_before_bitdata = wp->bytes_written;
-		wp->line_by_line = true;
+	if (wp->map_palette) {
+		s_quantize_line(wp, line);
+		line = wp->qline;
 	}
 
 	switch (wp->rle) {
 	case 4:
 	case 8:
 	case 24:
-		res = s_save_line_rle(wp, line);
-		break;
+		return s_save_line_rle(wp, line);
 	case 1:
-		res = s_save_line_huff(wp, line);
-		break;
+		return s_save_line_huff(wp, line);
 	default:
-		res = s_save_line_rgb(wp, line);
-		break;
+		return s_save_line_rgb(wp, line);
 	}
+}
 
-	if (!res)
-		goto abort;
 
-	if (++wp->lbl_y >= wp->height) {
-		if (wp->rle) {
-			if (wp->rle > 1) {
-				if (EOF == s_write_one_byte(0, wp) ||
-				    EOF == s_write_one_byte(1, wp)) {
-					logsyserr(wp->log, "Writing RLE end-of-file marker");
-					goto abort;
-				}
+
+/*****************************************************************************
+ * 	s_init_quantizer / s_quantize_line
+ *
+ * bmpwrite_map_to_palette(): RGB(A) source pixels are
+ * turned into palette indices one line at a time, right
+ * before the line is encoded.
+ * Colors which are in the palette are found through a
+ * small hash table and always map to their (first)
+ * palette entry. Any other color maps to the palette
+ * entry nearest to the center of its cell in a 32x32x32
+ * grid over the RGB cube. The cell's index is computed
+ * the first time a color in that cell comes along.
+ * Alpha is ignored.
+ *****************************************************************************/
+
+#define QHASH_BITS 10   /* hash table for up to 256 colors, at most 1/4 full */
+#define QHASH_SIZE (1 << QHASH_BITS)
+#define QCELL_BITS 5    /* 32 cells per channel */
+
+struct Quantizer {
+	uint32_t      hash_key[QHASH_SIZE]; /* 0x01rrggbb, 0 = empty slot */
+	unsigned char hash_idx[QHASH_SIZE];
+	uint16_t      cell[1 << (3 * QCELL_BITS)]; /* index + 1, 0 = not known yet */
+};
+
+static inline unsigned s_qhash(uint32_t key)
+{
+	return (uint32_t) (key * 2654435761U) >> (32 - QHASH_BITS);
+}
+
+static bool s_init_quantizer(BMPWRITE_R wp)
+{
+	struct Quantizer *q;
+	uint32_t          key;
+	unsigned          slot;
+	int               i;
+
+	if (!wp->quant) {
+		if (!(wp->quant = cm_malloc(&wp->allocator, sizeof *wp->quant))) {
+			logsyserr(wp->log, "Allocating palette cache");
+			return false;
+		}
+	}
+	if (!wp->qline || wp->qline_width < wp->width) {
+		if (wp->qline)
+			cm_free(&wp->allocator, wp->qline);
+		wp->qline_width = 0;
+		if (!(wp->qline = cm_malloc(&wp->allocator, (size_t) wp->width))) {
+			logsyserr(wp->log, "Allocating line buffer");
+			return false;
+		}
+		wp->qline_width = wp->width;
+	}
+
+	q = wp->quant;
+	memset(q, 0, sizeof *q);
+	for (i = 0; i < wp->palette->numcolors; i++) {
+		key = 0x01000000UL | (uint32_t) wp->palette->color[i].red << 16 |
+		                     (uint32_t) wp->palette->color[i].green << 8 |
+		                     (uint32_t) wp->palette->color[i].blue;
+		for (slot = s_qhash(key); q->hash_key[slot]; slot = (slot + 1) & (QHASH_SIZE - 1)) {
+			if (q->hash_key[slot] == key)
+				break;
+		}
+		if (!q->hash_key[slot]) {
+			q->hash_key[slot] = key;
+			q->hash_idx[slot] = (unsigned char) i;
+		}
+	}
+	return true;
+}
+
+
+static int s_nearest_color(BMPWRITE_R wp, int r, int g, int b)
+{
+	const union Pixel *c;
+	int               i, best = 0, dr, dg, db;
+	long              d, bestd = LONG_MAX;
+
+	for (i = 0; i < wp->palette->numcolors; i++) {
+		c  = &wp->palette->color[i];
+		dr = (int) c->red - r;
+		dg = (int) c->green - g;
+		db = (int) c->blue - b;
+		d  = (long) dr * dr + (long) dg * dg + (long) db * db;
+		if (d < bestd) {
+			bestd = d;
+			best  = i;
+		}
+	}
+	return best;
+}
+
+
+static void s_quantize_line(BMPWRITE_R wp, const unsigned char *restrict line)
+{
+	struct Quantizer    *q = wp->quant;
+	const unsigned char *px;
+	uint32_t             key, prev = 0;
+	unsigned             slot, cell;
+	int                  x, idx = 0, half = 1 << (7 - QCELL_BITS);
+
+	for (x = 0; x < wp->width; x++) {
+		px  = line + (size_t) x * wp->source_bytes_per_pixel;
+		key = 0x01000000UL | (uint32_t) px[0] << 16 | (uint32_t) px[1] << 8 | px[2];
+
+		if (key != prev) {
+			prev = key;
+			for (slot = s_qhash(key); q->hash_key[slot]; slot = (slot + 1) & (QHASH_SIZE - 1)) {
+				if (q->hash_key[slot] == key)
+					break;
+			}
+			if (q->hash_key[slot]) {
+				idx = q->hash_idx[slot];
 			} else {
-				if (!(huff_encode_rtc(wp) && huff_flush(wp))) {
-					logsyserr(wp->log, "Writing RTC end-of-file marker");
-					goto abort;
+				cell = (unsigned) (px[0] >> (8 - QCELL_BITS)) << (2 * QCELL_BITS) |
+				       (unsigned) (px[1] >> (8 - QCELL_BITS)) << QCELL_BITS |
+				       (unsigned) (px[2] >> (8 - QCELL_BITS));
+				if (!q->cell[cell]) {
+					q->cell[cell] = 1 + s_nearest_color(wp,
+					                  (px[0] & ~(2 * half - 1)) + half,
+					                  (px[1] & ~(2 * half - 1)) + half,
+					                  (px[2] & ~(2 * half - 1)) + half);
 				}
+				idx = q->cell[cell] - 1;
 			}
-			s_try_saving_image_size(wp);
 		}
-		wp->saveimage_done = true;
+		wp->qline[x] = (unsigned char) idx;
 	}
+}
 
-	return BMP_RESULT_OK;
-abort:
-	wp->saveimage_done = true;
-	return BMP_RESULT_ERROR;
+
+
+/*****************************************************************************
+ * 	s_save_bands
+ *
+ * With several threads, the image is encoded in chunks
+ * of nthreads bands. Each band gets its own copy of the
+ * handle without a file, so the regular s_save_line_*()
+ * collect the band's output in its wbuf. When all bands
+ * of a chunk are done, their output is appended to the
+ * real handle in order. Uncompressed lines have a fixed
+ * size anyway and RLE lines end with EOL, so the pieces
+ * just have to be concatenated. The Huffman bit stream
+ * isn't byte aligned at line ends, so those bands are
+ * shifted into place by huff_append().
+ * Returns the number of lines saved (0 if we don't use
+ * threads for this image), or -1 on error.
+ *****************************************************************************/
+
+#define WRITE_BAND_BYTES ((size_t) 1024 * 1024) /* image bytes per band */
+
+#if HAVE_PTHREAD
+struct WriteBand {
+	struct Bmpwrite      h;        /* private copy of the handle, no file */
+	const unsigned char *image;
+	int                  y0, y1;
+	int                  failed_y; /* -1 if all lines were encoded */
+};
+
+static void* s_encode_band(void *arg);
+#endif
+
+static int s_save_bands(BMPWRITE_R wp, const unsigned char *image)
+{
+#if HAVE_PTHREAD
+	struct WriteBand *band;
+	size_t            linesize;
+	int               i, y, n, nthreads, rows, failed_y = -1;
+	bool              ok = true, nomem = false;
+
+	if (wp->nthreads < 2)
+		return 0;
+
+	linesize = (size_t) wp->width * wp->source_bytes_per_pixel;
+	rows     = (int) MAX((size_t) 1, WRITE_BAND_BYTES / linesize);
+	nthreads = MIN(wp->nthreads, (wp->height + rows - 1) / rows);
+	if (nthreads < 2)
+		return 0;
+
+	if (!(band = cm_calloc(&wp->allocator, nthreads * sizeof *band)))
+		return 0; /* not fatal, encode with one thread */
+
+	for (i = 0; i < nthreads; i++) {
+		band[i].h            = *wp;
+		band[i].h.file       = NULL;
+		band[i].h.stream_out = NULL; /* bands never spill */
+		band[i].h.wbuf       = NULL;
+		band[i].h.wbuf_size  = 0;
+		band[i].h.wbuf_fixed = false;
+		band[i].h.group      = NULL;
+		band[i].h.linebuf    = NULL;
+		band[i].h.quant      = NULL;
+		band[i].h.qline      = NULL;
+		band[i].image        = image;
+		memset(&band[i].h.stats, 0, sizeof band[i].h.stats);
+		/* the workers must not share our log, each gets its own
+		 * which we merge after the threads are done
+		 */
+		if (!(band[i].h.log = logcreate(&wp->allocator))) {
+			nthreads = i + 1;
+			nomem    = true;
+			ok       = false;
+			break;
+		}
+		if (wp->map_palette) {
+			/* the cache is filled as we go, each band needs its own */
+			band[i].h.quant = cm_malloc(&wp->allocator, sizeof *wp->quant);
+			band[i].h.qline = cm_malloc(&wp->allocator, (size_t) wp->width);
+			if (!(band[i].h.quant && band[i].h.qline)) {
+				nthreads = i + 1;
+				nomem    = true;
+				ok       = false;
+				break;
+			}
+			memcpy(band[i].h.quant, wp->quant, sizeof *wp->quant);
+		}
+		if (wp->packer) {
+			band[i].h.linebuf = cm_calloc(&wp->allocator, (size_t) wp->width *
+			                              wp->outbytes_per_pixel + wp->padding);
+			if (!band[i].h.linebuf)
+				band[i].h.packer = NULL;
+		}
+	}
+
+	for (y = 0; ok && y < wp->height; y += n) {
+		n = MIN(nthreads * rows, wp->height - y);
+		for (i = 0; i < nthreads; i++) {
+			band[i].y0           = y + (int) ((int64_t) n * i / nthreads);
+			band[i].y1           = y + (int) ((int64_t) n * (i + 1) / nthreads);
+			band[i].failed_y     = -1;
+			band[i].h.wbuf_len   = 0;
+			band[i].h.hufbuf     = 0;
+			band[i].h.hufbuf_len = 0;
+		}
+
+		cm_run_threads(s_encode_band, band, sizeof *band, nthreads);
+
+		for (i = 0; i < nthreads; i++) {
+			if (*logmsg(band[i].h.log))
+				logerr(wp->log, "%s", logmsg(band[i].h.log));
+			logreset(band[i].h.log);
+		}
+
+		for (i = 0; ok && i < nthreads; i++) {
+			if (band[i].failed_y != -1) {
+				failed_y = band[i].failed_y;
+				ok = false;
+			} else if (wp->rle == 1) {
+				ok = huff_append(wp, band[i].h.wbuf, band[i].h.wbuf_len,
+				                 band[i].h.hufbuf, band[i].h.hufbuf_len);
+			} else if (!cm_write(wp, band[i].h.wbuf, band[i].h.wbuf_len)) {
+				logsyserr(wp->log, "Writing image to BMP file");
+				ok = false;
+			}
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		cm_add_stats(&wp->stats, &band[i].h.stats);
+		logfree(band[i].h.log);
+		if (band[i].h.wbuf)
+			cm_free(&wp->allocator, band[i].h.wbuf);
+		if (band[i].h.group)
+			cm_free(&wp->allocator, band[i].h.group);
+		if (band[i].h.linebuf)
+			cm_free(&wp->allocator, band[i].h.linebuf);
+		if (band[i].h.quant)
+			cm_free(&wp->allocator, band[i].h.quant);
+		if (band[i].h.qline)
+			cm_free(&wp->allocator, band[i].h.qline);
+	}
+	cm_free(&wp->allocator, band);
+
+	if (nomem)
+		return 0; /* not fatal, encode with one thread */
+
+	if (failed_y != -1)
+		logerr(wp->log, "failed saving line %d", failed_y);
+
+	return ok ? wp->height : -1;
+#else
+	(void) wp;
+	(void) image;
+	return 0;
+#endif
+}
+
+
+#if HAVE_PTHREAD
+static void* s_encode_band(void *arg)
+{
+	struct WriteBand *band = arg;
+	BMPWRITE_R        wp   = &band->h;
+	size_t            stride, real_y;
+
+	stride = s_source_stride(wp);
+
+	for (int y = band->y0; y < band->y1; y++) {
+		real_y = (wp->outorientation == BMP_ORIENT_TOPDOWN) ? y : wp->height - y - 1;
+		if (!s_save_line(wp, band->image + real_y * stride)) {
+			band->failed_y = y;
+			break;
+		}
+	}
+	return NULL;
 }
+#endif
 
 
 
@@ -873,8 +2167,10 @@ abort:
  * 	s_save_header
  *****************************************************************************/
 
-static bool s_save_header(BMPWRITE_R wp)
+static bool s_save_header(BMPWRITE_R wp, const unsigned char *image, int nlines, size_t stride)
 {
+	double start = 0.0, now;
+
 	if (wp->saveimage_done || wp->line_by_line) {
 		logerr(wp->log, "Image already saved.");
 		return false;
@@ -885,7 +2181,46 @@ static bool s_save_header(BMPWRITE_R wp)
 		return false;
 	}
 
-	s_decide_outformat(wp);
+	if (!wp->file && !wp->mem_target) {
+		logerr(wp->log, "No file or memory given (bmpwrite_reset() missing?)");
+		return false;
+	}
+
+	if (wp->map_palette && !wp->palette) {
+		logerr(wp->log, "bmpwrite_map_to_palette() needs a palette");
+		return false;
+	}
+
+	if (wp->timing)
+		start = cm_clock();
+
+	if (wp->map_palette && !s_init_quantizer(wp))
+		return false;
+
+	s_decide_outformat(wp, image, nlines, stride);
+
+	if (wp->mem_target && !wp->wbuf_fixed && !wp->rle && wp->fh->size) {
+		/* size of uncompressed BMPs is known, allocate only once */
+		if (!cm_grow_writebuf(wp, wp->fh->size)) {
+			logsyserr(wp->log, "Allocating output buffer");
+			return false;
+		}
+	}
+
+	if (wp->wbuf_fixed && !wp->rle && wp->fh->size &&
+	    wp->fh->size > wp->wbuf_size - wp->wbuf_len) {
+		/* fail now, not after the caller has passed all the lines */
+		logerr(wp->log, "Output buffer too small (%lu bytes, BMP needs %lu)",
+		                (unsigned long) (wp->wbuf_size - wp->wbuf_len),
+		                (unsigned long) wp->fh->size);
+		return false;
+	}
+
+	if (wp->streaming && wp->rle && wp->file) {
+		/* sizes are only known at the end, hold everything back */
+		wp->stream_out = wp->file;
+		wp->file       = NULL;
+	}
 
 	if (!s_write_bmp_file_header(wp)) {
 		logsyserr(wp->log, "Writing BMP file header");
@@ -897,11 +2232,19 @@ static bool s_save_header(BMPWRITE_R wp)
 		return false;
 	}
 
+	if (wp->timing) {
+		now = cm_clock();
+		wp->stats.time_header += now - start;
+		start = now;
+	}
+
 	if (wp->palette) {
 		if (!s_write_palette(wp)) {
 			logsyserr(wp->log, "Couldn't write palette");
 			return false;
 		}
+		if (wp->timing)
+			wp->stats.time_palette += cm_clock() - start;
 	}
 
 	return true;
@@ -919,30 +2262,106 @@ static bool s_save_header(BMPWRITE_R wp)
  * files like pipes etc.
  * We ignore any errors quietly, as there's nothing we
  * can do and most (all?) readers ignore those sizes in
- * the header, anyway. Same goes for file/bitmap sizes
+ * the header, anyway. (In streaming mode, we don't get
+ * here, see s_finish_stream().) Same goes for file/bitmap sizes
  * which are too big for the respective fields.
  *****************************************************************************/
 
 static bool s_try_saving_image_size(BMPWRITE_R wp)
 {
-	uint64_t image_size, file_size;
+	uint64_t      image_size, file_size;
+	unsigned char buf[4];
 
 	image_size = wp->bytes_written - wp->bytes_written_before_bitdata;
 	file_size  = wp->bytes_written;
 
+	/* the write buffer has been flushed, so we go to the file directly */
 	if (fseek(wp->file, 2, SEEK_SET))        /* file header -> bfSize */
 		return false;
-	if (file_size <= UINT32_MAX && !write_u32_le(wp->file, (uint32_t) file_size))
+	u32_to_le(buf, (uint32_t) file_size);
+	if (file_size <= UINT32_MAX && 4 != fwrite(buf, 1, 4, wp->file))
 		return false;
 	if (fseek(wp->file, 14 + 20, SEEK_SET))  /* info header -> biSizeImage */
 		return false;
-	if (image_size <= UINT32_MAX && !write_u32_le(wp->file, (uint32_t) image_size))
+	u32_to_le(buf, (uint32_t) image_size);
+	if (image_size <= UINT32_MAX && 4 != fwrite(buf, 1, 4, wp->file))
 		return false;
 	return true;
 }
 
 
 
+/*****************************************************************************
+ * s_patch_sizes
+ *
+ * fill in the file/bitmap sizes of an RLE image in the
+ * headers that are still in memory.
+ *****************************************************************************/
+
+static void s_patch_sizes(BMPWRITE_R wp, unsigned char *header)
+{
+	uint64_t image_size, file_size;
+
+	image_size = wp->bytes_written - wp->bytes_written_before_bitdata;
+	file_size  = wp->bytes_written;
+
+	if (file_size <= UINT32_MAX)
+		u32_to_le(header + 2, (uint32_t) file_size);       /* file header -> bfSize */
+	if (image_size <= UINT32_MAX)
+		u32_to_le(header + 14 + 20, (uint32_t) image_size); /* info header -> biSizeImage */
+}
+
+
+
+/*****************************************************************************
+ * s_finish_stream
+ *
+ * In streaming mode, the whole file has been held back
+ * in memory (or, beyond stream_limit, in a temp file),
+ * so we can now fill in the sizes and then send it all
+ * to the real file in one go, without any fseek().
+ *****************************************************************************/
+
+static bool s_finish_stream(BMPWRITE_R wp)
+{
+	size_t n;
+	bool   ok = true;
+
+	s_patch_sizes(wp, wp->spill ? wp->stream_header : wp->wbuf);
+
+	if (!wp->spill) {
+		wp->file       = wp->stream_out;
+		wp->stream_out = NULL;
+		return cm_flush_writebuf(wp);
+	}
+
+	if (!cm_flush_writebuf(wp))  /* rest of the data to the temp file */
+		ok = false;
+
+	wp->file       = wp->stream_out;
+	wp->stream_out = NULL;
+
+	if (ok && wp->fh->offbits != fwrite(wp->stream_header, 1, wp->fh->offbits, wp->file))
+		ok = false;
+
+	if (ok && fseek(wp->spill, 0, SEEK_SET))
+		ok = false;
+
+	/* wbuf is empty now, use it to copy the temp file over */
+	while (ok && (n = fread(wp->wbuf, 1, wp->wbuf_size, wp->spill)) > 0) {
+		if (n != fwrite(wp->wbuf, 1, n, wp->file))
+			ok = false;
+	}
+	if (ok && ferror(wp->spill))
+		ok = false;
+
+	fclose(wp->spill);
+	wp->spill = NULL;
+	return ok;
+}
+
+
+
 /*****************************************************************************
  * 	s_save_line_rgb
  *****************************************************************************/
@@ -951,15 +2370,25 @@ static inline unsigned long long s_imgrgb_to_outbytes(BMPWRITE_R wp,
 
 static bool s_save_line_rgb(BMPWRITE_R wp, const unsigned char *line)
 {
-	size_t             offs;
+	size_t             offs, linesize;
 	unsigned long long bytes = 0;
 	int                i, x, bits_used = 0;
 
+	if (wp->packer) {
+		wp->packer(wp, line, wp->linebuf);
+		linesize = (size_t) wp->width * wp->outbytes_per_pixel + wp->padding;
+		if (!cm_write(wp, wp->linebuf, linesize)) {
+			logsyserr(wp->log, "Writing image to BMP file");
+			return false;
+		}
+		return true;
+	}
+
 	for (x = 0; x < wp->width; x++) {
 		offs = (size_t) x * (size_t) wp->source_bytes_per_pixel;
 		if (wp->palette) {
 			bytes <<= wp->ih->bitcount;
-			bytes |= line[offs];
+			bytes |= line[x];
 			bits_used += wp->ih->bitcount;
 			if (bits_used == 8) {
 				if (EOF == s_write_one_byte((int)bytes, wp)) {
@@ -1003,30 +2432,6 @@ static bool s_save_line_rgb(BMPWRITE_R wp, const unsigned char *line)
 
 
 
-/*****************************************************************************
- * 	s_length_of_runs
- *
- * 	for RLE-encoding, returns the number of
- *      pixels in contiguous upcoming groups with
- *      run-lengths >= minlen. Used to determine if it is
- *      worthwile to switch from literal run to
- *      repeat-run.
- *****************************************************************************/
-
-static inline int s_length_of_runs(BMPWRITE_R wp, int x, int group, int minlen)
-{
-	int i, len = 0;
-
-	for (i = group; i < wp->group_count; i++) {
-		if (wp->group[i] < minlen)
-			break;
-		len += wp->group[i];
-	}
-	return len;
-}
-
-
-
 /*****************************************************************************
  * 	s_save_line_rle
  *****************************************************************************/
@@ -1034,6 +2439,7 @@ static inline int s_length_of_runs(BMPWRITE_R wp, int x, int group, int minlen)
 static bool s_save_line_rle(BMPWRITE_R wp, const unsigned char *line)
 {
 	int  i, j, k, x, l, dx, outbyte = 0;
+	int  len, left, *ahead;
 	bool even;
 	int  small_number, minlen = 0;
 
@@ -1055,50 +2461,57 @@ static bool s_save_line_rle(BMPWRITE_R wp, const unsigned char *line)
 		break;
 	}
 
-	if (!wp->group) {
-		if (!(wp->group = malloc(wp->width * sizeof *wp->group))) {
+	if (!wp->group || wp->group_width < wp->width) {
+		/* group list, followed by the ahead list (see below) */
+		if (wp->group)
+			cm_free(&wp->allocator, wp->group);
+		if (!(wp->group = cm_malloc(&wp->allocator, (2 * (size_t) wp->width + 1) * sizeof *wp->group))) {
 			logsyserr(wp->log, "allocating RLE buffer");
 			goto abort;
 		}
+		wp->group_width = wp->width;
 	}
+	ahead = wp->group + wp->width;
 
 	/* group identical contiguous pixels and keep a list
 	 * of number of pixels/group in wp->group
 	 * e.g. a pixel line abccaaadaaba would make a group list:
 	 *                   112 3  12 11 = 1,1,2,3,1,2,1,1
+	 * For RLE4, a group is a run of alternating pixels
+	 * (ababa...), which is what RLE4 can repeat.
+	 * Each group is one equal_run() comparing the line
+	 * with itself shifted by one pixel (two for RLE4),
+	 * groups are at most 255 pixels long.
 	 */
-	memset(wp->group, 0, wp->width * sizeof *wp->group);
-	for (x = 0, wp->group_count = 0; x < wp->width; x++) {
-		wp->group[wp->group_count]++;
-
-		if (wp->group[wp->group_count] == 255) {
-			wp->group_count++;
-			continue;
-		}
-
-		if (x == wp->width - 1) {
-			wp->group_count++;
+	for (x = 0, wp->group_count = 0; x < wp->width; x += len) {
+		left = wp->width - x;
+		switch (wp->rle) {
+		case 4:
+			if (left > 2)
+				len = 2 + (int) wp->kern->equal_run(line + x, line + x + 2, MIN(left - 2, 253));
+			else
+				len = left;
+			break;
+		case 8:
+			len = 1 + (int) wp->kern->equal_run(line + x, line + x + 1, MIN(left - 1, 254));
+			break;
+		default: /* 24 */
+			len = 1 + (int) (wp->kern->equal_run(line + 3 * (size_t) x, line + 3 * (size_t) x + 3,
+			                                     3 * (size_t) MIN(left - 1, 254)) / 3);
 			break;
 		}
-
-		if (wp->rle == 4) {
-			if (wp->group[wp->group_count] > 1 && line[x-1] != line[x+1])
-				wp->group_count++;
-
-		} else if (wp->rle == 8) {
-			if (line[x] != line[x+1])
-				wp->group_count++;
-
-		} else if (wp->rle == 24) {
-			for (int c = 0; c < 3; c++) {
-				if (line[3*x + c] != line[3*(x+1) + c]) {
-					wp->group_count++;
-					break;
-				}
-			}
-		}
+		wp->group[wp->group_count++] = len;
 	}
 
+	/* ahead[i] is the number of pixels in the contiguous groups
+	 * starting at group i which are at least minlen long. Used to
+	 * determine if it is worthwile to switch from literal run to
+	 * repeat-run.
+	 */
+	ahead[wp->group_count] = 0;
+	for (i = wp->group_count - 1; i >= 0; i--)
+		ahead[i] = (wp->group[i] >= minlen) ? wp->group[i] + ahead[i + 1] : 0;
+
 	x = 0;
 	for (i = 0; i < wp->group_count; i++) {
 		l = 0;  /* l counts the number of groups in this literal run */
@@ -1114,7 +2527,7 @@ static bool s_save_line_rle(BMPWRITE_R wp, const unsigned char *line)
 			 * run for e.g. two repeated pixels and then restarting the literal
 			 * run at a cost of 2-4 bytes (depending on padding)
 			 */
-			if (i+l < wp->group_count && s_length_of_runs(wp, x+dx, i+l, minlen) <= small_number) {
+			if (i+l < wp->group_count && ahead[i+l] <= small_number) {
 				while (i+l < wp->group_count && wp->group[i+l] > (minlen-1) && dx + wp->group[i+l] < 255) {
 					dx += wp->group[i+l];
 					l++;
@@ -1129,6 +2542,7 @@ static bool s_save_line_rle(BMPWRITE_R wp, const unsigned char *line)
 			    EOF == s_write_one_byte(dx, wp)) {
 				goto abort;
 			}
+			wp->stats.rle_literal++;
 			even = true;
 			for (j = 0; j < l; j++) {
 				for (k = 0; k < wp->group[i+j]; k++) {
@@ -1179,6 +2593,7 @@ static bool s_save_line_rle(BMPWRITE_R wp, const unsigned char *line)
 		if (EOF == s_write_one_byte(wp->group[i], wp)) {
 			goto abort;
 		}
+		wp->stats.rle_repeat++;
 
 		if (wp->rle == 4) {
 			outbyte = (line[x] << 4) & 0xf0;
@@ -1204,11 +2619,12 @@ static bool s_save_line_rle(BMPWRITE_R wp, const unsigned char *line)
 	if (EOF == s_write_one_byte(0, wp) || EOF == s_write_one_byte(0, wp)) {  /* EOL */
 		goto abort;
 	}
+	wp->stats.rle_eol++;
 
 	return true;
 abort:
 	if (wp->group) {
-		free(wp->group);
+		cm_free(&wp->allocator, wp->group);
 		wp->group = NULL;
 		wp->group_count = 0;
 	}
@@ -1236,6 +2652,7 @@ static bool s_save_line_huff(BMPWRITE_R wp, const unsigned char *line)
 			len++;
 		if (!huff_encode(wp, len, black))
 			goto abort;
+		wp->stats.huffman_codes++;
 		black = !black;
 		x += len;
 	}
@@ -1277,8 +2694,6 @@ static int s_calc_mask_values(BMPWRITE_R wp)
  * 	s_imgrgb_to_outbytes
  *****************************************************************************/
 
-static inline uint16_t float_to_s2_13(double d);
-
 static inline unsigned long long s_imgrgb_to_outbytes(BMPWRITE_R wp,
 	                                   const unsigned char *restrict imgpx)
 {
@@ -1446,14 +2861,13 @@ static bool s_write_palette(BMPWRITE_R wp)
 
 static bool s_write_bmp_file_header(BMPWRITE_R wp)
 {
-	if (!(write_u16_le(wp->file, wp->fh->type) &&
-	      write_u32_le(wp->file, wp->fh->size) &&
-	      write_u16_le(wp->file, wp->fh->reserved1) &&
-	      write_u16_le(wp->file, wp->fh->reserved2) &&
-	      write_u32_le(wp->file, wp->fh->offbits))) {
+	if (!(cm_write_u16_le(wp, wp->fh->type) &&
+	      cm_write_u32_le(wp, wp->fh->size) &&
+	      cm_write_u16_le(wp, wp->fh->reserved1) &&
+	      cm_write_u16_le(wp, wp->fh->reserved2) &&
+	      cm_write_u32_le(wp, wp->fh->offbits))) {
 		return false;
 	}
-	wp->bytes_written += 14;
 	return true;
 }
 
@@ -1480,20 +2894,19 @@ static bool s_write_bmp_info_header(BMPWRITE_R wp)
 		break;
 	}
 
-	if (!(write_u32_le(wp->file, wp->ih->size) &&
-	      write_s32_le(wp->file, wp->ih->width) &&
-	      write_s32_le(wp->file, wp->ih->height) &&
-	      write_u16_le(wp->file, wp->ih->planes) &&
-	      write_u16_le(wp->file, wp->ih->bitcount) &&
-	      write_u32_le(wp->file, compression) &&
-	      write_u32_le(wp->file, wp->ih->sizeimage) &&
-	      write_s32_le(wp->file, wp->ih->xpelspermeter) &&
-	      write_s32_le(wp->file, wp->ih->ypelspermeter) &&
-	      write_u32_le(wp->file, wp->ih->clrused) &&
-	      write_u32_le(wp->file, wp->ih->clrimportant) )) {
+	if (!(cm_write_u32_le(wp, wp->ih->size) &&
+	      cm_write_s32_le(wp, wp->ih->width) &&
+	      cm_write_s32_le(wp, wp->ih->height) &&
+	      cm_write_u16_le(wp, wp->ih->planes) &&
+	      cm_write_u16_le(wp, wp->ih->bitcount) &&
+	      cm_write_u32_le(wp, compression) &&
+	      cm_write_u32_le(wp, wp->ih->sizeimage) &&
+	      cm_write_s32_le(wp, wp->ih->xpelspermeter) &&
+	      cm_write_s32_le(wp, wp->ih->ypelspermeter) &&
+	      cm_write_u32_le(wp, wp->ih->clrused) &&
+	      cm_write_u32_le(wp, wp->ih->clrimportant) )) {
 		return false;
 	}
-	wp->bytes_written += 40;
 
 	if (wp->ih->version == BMPINFO_V3)
 		return true;
@@ -1506,33 +2919,31 @@ static bool s_write_bmp_info_header(BMPWRITE_R wp)
 		}
 #endif
 		for (int i = 0; (DWORD) i < wp->ih->size - 40; i++) {
-			if (EOF == putc(0, wp->file))
+			if (EOF == s_write_one_byte(0, wp))
 				return false;
-			wp->bytes_written++;
 		}
 		return true;
 	}
 
-	if (!(write_u32_le(wp->file, wp->ih->redmask) &&
-	      write_u32_le(wp->file, wp->ih->greenmask) &&
-	      write_u32_le(wp->file, wp->ih->bluemask) &&
-	      write_u32_le(wp->file, wp->ih->alphamask) &&
-	      write_u32_le(wp->file, wp->ih->cstype) &&
-	      write_s32_le(wp->file, wp->ih->redX) &&
-	      write_s32_le(wp->file, wp->ih->redY) &&
-	      write_s32_le(wp->file, wp->ih->redZ) &&
-	      write_s32_le(wp->file, wp->ih->greenX) &&
-	      write_s32_le(wp->file, wp->ih->greenY) &&
-	      write_s32_le(wp->file, wp->ih->greenZ) &&
-	      write_s32_le(wp->file, wp->ih->blueX) &&
-	      write_s32_le(wp->file, wp->ih->blueY) &&
-	      write_u32_le(wp->file, wp->ih->blueZ) &&
-	      write_u32_le(wp->file, wp->ih->gammared) &&
-	      write_u32_le(wp->file, wp->ih->gammagreen) &&
-	      write_u32_le(wp->file, wp->ih->gammablue))) {
+	if (!(cm_write_u32_le(wp, wp->ih->redmask) &&
+	      cm_write_u32_le(wp, wp->ih->greenmask) &&
+	      cm_write_u32_le(wp, wp->ih->bluemask) &&
+	      cm_write_u32_le(wp, wp->ih->alphamask) &&
+	      cm_write_u32_le(wp, wp->ih->cstype) &&
+	      cm_write_s32_le(wp, wp->ih->redX) &&
+	      cm_write_s32_le(wp, wp->ih->redY) &&
+	      cm_write_s32_le(wp, wp->ih->redZ) &&
+	      cm_write_s32_le(wp, wp->ih->greenX) &&
+	      cm_write_s32_le(wp, wp->ih->greenY) &&
+	      cm_write_s32_le(wp, wp->ih->greenZ) &&
+	      cm_write_s32_le(wp, wp->ih->blueX) &&
+	      cm_write_s32_le(wp, wp->ih->blueY) &&
+	      cm_write_u32_le(wp, wp->ih->blueZ) &&
+	      cm_write_u32_le(wp, wp->ih->gammared) &&
+	      cm_write_u32_le(wp, wp->ih->gammagreen) &&
+	      cm_write_u32_le(wp, wp->ih->gammablue))) {
 		return false;
 	}
-	wp->bytes_written += 68;
 
 	return true;
 }
@@ -1545,12 +2956,13 @@ static bool s_write_bmp_info_header(BMPWRITE_R wp)
 
 static inline int s_write_one_byte(int byte, BMPWRITE_R wp)
 {
-	int ret;
+	if (wp->wbuf_len >= wp->wbuf_size && !cm_flush_writebuf(wp))
+		return EOF;
 
-	if (EOF != (ret = putc(byte, wp->file)))
-		wp->bytes_written++;
+	wp->wbuf[wp->wbuf_len++] = (unsigned char) byte;
+	wp->bytes_written++;
 
-	return ret;
+	return byte & 0xff;
 }
 
 
@@ -1561,16 +2973,34 @@ static inline int s_write_one_byte(int byte, BMPWRITE_R wp)
 
 void bw_free(BMPWRITE wp)
 {
+	struct BmpAllocator allocator = wp->allocator;
+
 	if (wp->group)
-		free(wp->group);
+		cm_free(&allocator, wp->group);
+	if (wp->linebuf)
+		cm_free(&allocator, wp->linebuf);
+	if (wp->quant)
+		cm_free(&allocator, wp->quant);
+	if (wp->qline)
+		cm_free(&allocator, wp->qline);
+	if (wp->pack_lut)
+		cm_free(&allocator, wp->pack_lut);
+	if (wp->spill)
+		fclose(wp->spill);
+	if (wp->stream_header)
+		cm_free(&allocator, wp->stream_header);
+	if (wp->wbuf && !wp->wbuf_fixed)
+		cm_free(&allocator, wp->wbuf);
 	if (wp->palette)
-		free(wp->palette);
+		cm_free(&allocator, wp->palette);
+	if (wp->spare_palette)
+		cm_free(&allocator, wp->spare_palette);
 	if (wp->ih)
-		free(wp->ih);
+		cm_free(&allocator, wp->ih);
 	if (wp->fh)
-		free(wp->fh);
+		cm_free(&allocator, wp->fh);
 	if (wp->log)
 		logfree(wp->log);
 
-	free(wp);
+	cm_free(&allocator, wp);
 }
@@ -84,6 +84,14 @@ typedef struct Bmphandle *BMPHANDLE;
  *                       the image unless you first call
  *                       bmpread_set_insanity_limit() to set a new
  *                       sufficiently high limit.
+ *
+ * BMP_RESULT_NEED_MORE  (bmpread_feed() handles only) Not enough
+ *                       data has been fed yet. Nothing was read,
+ *                       feed more data and try again.
+ *
+ * BMP_RESULT_ROWS_READY (bmpread_feed() only) The header has been
+ *                       read and at least one new line can be
+ *                       loaded, see bmpread_rows_ready().
  */
 enum Bmpresult {
 	BMP_RESULT_OK = 0,
@@ -93,6 +101,8 @@ enum Bmpresult {
 	BMP_RESULT_PNG,
 	BMP_RESULT_JPEG,
 	BMP_RESULT_ERROR,
+	BMP_RESULT_NEED_MORE,
+	BMP_RESULT_ROWS_READY,
 };
 typedef enum Bmpresult BMPRESULT;
 
@@ -121,6 +131,23 @@ enum Bmpconv64 {
 typedef enum Bmpconv64 BMPCONV64;
 
 
+/*
+ * Channel order of returned RGB(A) images
+ *
+ * BMP_ORDER_RGB  (default) red, green, blue (, alpha)
+ *
+ * BMP_ORDER_BGR  blue, green, red (, alpha). This is the
+ *                order most BMPs store their pixels in,
+ *                so 24/32-bit BMPs can be returned as-is
+ *                (see bmpread_is_passthrough()).
+ */
+enum BmpOrder {
+	BMP_ORDER_RGB = 0,  /* default */
+	BMP_ORDER_BGR
+};
+typedef enum BmpOrder BMPORDER;
+
+
 /*
  * BMP info header versions
  *
@@ -154,11 +181,20 @@ typedef enum BmpInfoVer BMPINFOVER;
  *
  * BMP_RLE_RLE8  always use RLE8, regardless of color
  *               table size.
+ *
+ * BMP_RLE_SMALLEST  encode sample lines with each possible
+ *                   format and use the smallest one, which
+ *                   may also be uncompressed.
+ *
+ * BMP_RLE_FASTEST   like BMP_RLE_SMALLEST, but only compress
+ *                   if that saves at least 75% of the size.
  */
 enum BmpRLEtype {
 	BMP_RLE_NONE,
 	BMP_RLE_AUTO,
-	BMP_RLE_RLE8
+	BMP_RLE_RLE8,
+	BMP_RLE_SMALLEST,
+	BMP_RLE_FASTEST
 };
 typedef enum BmpRLEtype BMPRLETYPE;
 
@@ -205,7 +241,92 @@ enum BmpFormat {
 typedef enum BmpFormat BMPFORMAT;
 
 
+/*
+ * Allocator (see bmpread_new_alloc(), bmpwrite_new_alloc())
+ *
+ * alloc(ctx, size)  return size bytes of memory, aligned for
+ *                   any type, or NULL.
+ * free(ctx, ptr)    release memory returned by alloc(). May be
+ *                   NULL if memory is never released one by one
+ *                   (e.g. arenas).
+ */
+struct BmpAllocator {
+	void* (*alloc)(void *ctx, size_t size);
+	void  (*free)(void *ctx, void *ptr);
+	void   *ctx;
+};
+typedef struct BmpAllocator BMPALLOCATOR;
+
+
+/*
+ * Result of bmpread_probe()
+ *
+ * needed       number of bytes at the start of the file
+ *              which bmpread_probe() parsed, or would
+ *              have needed (BMP_RESULT_TRUNCATED).
+ * height       always positive, see orientation.
+ * compression  as returned by bmpread_info_compression().
+ */
+struct BmpProbeInfo {
+	size_t        needed;
+	int           width;
+	int           height;
+	BMPORIENT     orientation;
+	int           bitcount;
+	int           compression;
+	BMPINFOVER    version;
+	int           header_size;
+	unsigned long clrused;
+	unsigned long offbits;
+	unsigned long filesize;
+};
+typedef struct BmpProbeInfo BMPPROBEINFO;
+
+
+/*
+ * Statistics, see bmpread_get_stats() / bmpwrite_get_stats()
+ *
+ * bytes            file position, i.e. bytes read/written so far
+ * rows             image lines decoded/encoded
+ * rle_repeat ...   RLE codes by type
+ * huffman_codes    1-D Huffman: run lengths decoded/encoded
+ * invalid_index    pixels with out-of-range palette index (reading)
+ * invalid_delta    RLE deltas/line skips beyond the image (reading)
+ * invalid_overrun  RLE runs which went past the end of line (reading)
+ * time_*           seconds, only measured after bmp_set_timing()
+ */
+struct BmpStats {
+	unsigned long long bytes;
+	unsigned long      rows;
+	unsigned long      rle_repeat;
+	unsigned long      rle_literal;
+	unsigned long      rle_eol;
+	unsigned long      rle_delta;
+	unsigned long      rle_eof;
+	unsigned long      huffman_codes;
+	unsigned long      invalid_index;
+	unsigned long      invalid_delta;
+	unsigned long      invalid_overrun;
+	double             time_header;
+	double             time_palette;
+	double             time_pixels;
+};
+typedef struct BmpStats BMPSTATS;
+
+
 APIDECL BMPHANDLE bmpread_new(FILE *file);
+APIDECL BMPHANDLE bmpread_new_alloc(const BMPALLOCATOR *allocator);
+APIDECL BMPHANDLE bmpread_new_feed(void);
+APIDECL BMPHANDLE bmpread_new_mem(const void *data, size_t size);
+APIDECL BMPRESULT bmpread_reset(BMPHANDLE h, FILE *file);
+APIDECL BMPRESULT bmpread_reset_mem(BMPHANDLE h, const void *data, size_t size);
+APIDECL BMPRESULT bmpread_reset_feed(BMPHANDLE h);
+APIDECL BMPRESULT bmpread_feed(BMPHANDLE h, const void *data, size_t len);
+APIDECL int       bmpread_rows_ready(BMPHANDLE h);
+APIDECL BMPRESULT bmpread_use_mmap(BMPHANDLE h);
+
+APIDECL BMPRESULT bmpread_probe(const void *buf, size_t len, BMPPROBEINFO *info);
+APIDECL BMPRESULT bmpread_probe_file(FILE *file, BMPPROBEINFO *info);
 
 APIDECL BMPRESULT bmpread_load_info(BMPHANDLE h);
 
@@ -229,6 +350,9 @@ APIDECL size_t    bmpread_buffersize(BMPHANDLE h);
 
 APIDECL BMPRESULT bmpread_load_image(BMPHANDLE h, unsigned char **buffer);
 APIDECL BMPRESULT bmpread_load_line(BMPHANDLE h, unsigned char **buffer);
+APIDECL BMPRESULT bmpread_load_lines(BMPHANDLE h, int nlines, unsigned char *buffer, size_t stride);
+APIDECL BMPRESULT bmpread_load_region(BMPHANDLE h, int x, int y, int width, int height,
+                                      unsigned char **buffer);
 
 
 APIDECL int       bmpread_num_palette_colors(BMPHANDLE h);
@@ -241,6 +365,12 @@ APIDECL void      bmpread_set_insanity_limit(BMPHANDLE h, size_t limit);
 APIDECL int       bmpread_is_64bit(BMPHANDLE h);
 APIDECL BMPRESULT bmpread_set_64bit_conv(BMPHANDLE h, BMPCONV64 conv);
 
+APIDECL BMPRESULT bmpread_set_channel_order(BMPHANDLE h, BMPORDER order);
+APIDECL int       bmpread_is_passthrough(BMPHANDLE h);
+APIDECL BMPRESULT bmpread_set_threads(BMPHANDLE h, int nthreads);
+APIDECL BMPRESULT bmpread_set_stride(BMPHANDLE h, size_t stride);
+APIDECL BMPRESULT bmpread_set_scale(BMPHANDLE h, int denominator);
+
 APIDECL BMPINFOVER  bmpread_info_header_version(BMPHANDLE h);
 APIDECL const char* bmpread_info_header_name(BMPHANDLE h);
 APIDECL int         bmpread_info_header_size(BMPHANDLE h);
@@ -249,10 +379,17 @@ APIDECL const char* bmpread_info_compression_name(BMPHANDLE h);
 APIDECL int         bmpread_info_bitcount(BMPHANDLE h);
 APIDECL BMPRESULT   bmpread_info_channel_bits(BMPHANDLE h, int *r, int *g, int *b, int *a);
 
+APIDECL BMPRESULT   bmpread_get_stats(BMPHANDLE h, BMPSTATS *stats);
+
 
 
 
 APIDECL BMPHANDLE bmpwrite_new(FILE *file);
+APIDECL BMPHANDLE bmpwrite_new_mem(void *buffer, size_t size);
+APIDECL BMPHANDLE bmpwrite_new_alloc(const BMPALLOCATOR *allocator);
+APIDECL BMPRESULT bmpwrite_get_buffer(BMPHANDLE h, void **pbuffer, size_t *psize);
+APIDECL BMPRESULT bmpwrite_reset(BMPHANDLE h, FILE *file);
+APIDECL BMPRESULT bmpwrite_reset_mem(BMPHANDLE h, void *buffer, size_t size);
 
 APIDECL BMPRESULT bmpwrite_set_dimensions(BMPHANDLE h,
                                           unsigned  width,
@@ -262,18 +399,27 @@ APIDECL BMPRESULT bmpwrite_set_dimensions(BMPHANDLE h,
 APIDECL BMPRESULT bmpwrite_set_resolution(BMPHANDLE h, int xdpi, int ydpi);
 APIDECL BMPRESULT bmpwrite_set_output_bits(BMPHANDLE h, int red, int green, int blue, int alpha);
 APIDECL BMPRESULT bmpwrite_set_palette(BMPHANDLE h, int numcolors, const unsigned char *palette);
+APIDECL BMPRESULT bmpwrite_map_to_palette(BMPHANDLE h);
 APIDECL BMPRESULT bmpwrite_allow_2bit(BMPHANDLE h);
 APIDECL BMPRESULT bmpwrite_allow_huffman(BMPHANDLE h);
 APIDECL BMPRESULT bmpwrite_allow_rle24(BMPHANDLE h);
 APIDECL BMPRESULT bmpwrite_set_rle(BMPHANDLE h, BMPRLETYPE type);
 APIDECL BMPRESULT bmpwrite_set_orientation(BMPHANDLE h, BMPORIENT orientation);
 APIDECL BMPRESULT bmpwrite_set_64bit(BMPHANDLE h);
+APIDECL BMPRESULT bmpwrite_set_threads(BMPHANDLE h, int nthreads);
+APIDECL BMPRESULT bmpwrite_set_stride(BMPHANDLE h, size_t stride);
+APIDECL BMPRESULT bmpwrite_set_streaming(BMPHANDLE h, size_t mem_limit);
 
 APIDECL BMPRESULT bmpwrite_save_image(BMPHANDLE h, const unsigned char *image);
 APIDECL BMPRESULT bmpwrite_save_line(BMPHANDLE h, const unsigned char *line);
+APIDECL BMPRESULT bmpwrite_save_lines(BMPHANDLE h, int nlines, const unsigned char *lines, size_t stride);
+
+APIDECL BMPRESULT bmpwrite_get_stats(BMPHANDLE h, BMPSTATS *stats);
 
 
 APIDECL BMPRESULT bmp_set_number_format(BMPHANDLE h, BMPFORMAT format);
+APIDECL BMPRESULT bmp_set_timing(BMPHANDLE h, int enable);
+APIDECL BMPRESULT bmp_transcode(BMPHANDLE hread, BMPHANDLE hwrite, size_t mem_limit);
 
 APIDECL void        bmp_free(BMPHANDLE h);
 
@@ -309,6 +455,12 @@ APIDECL const char* bmp_version(void);
 #define BMP_ERR_PALETTE     0x00080000
 #define BMP_ERR_NOINFO      0x00100000
 #define BMP_ERR_UNDEFMODE   0x00200000
+#define BMP_ERR_ORDER       0x00400000
+#define BMP_ERR_THREADS     0x00800000
+#define BMP_ERR_REGION      0x01000000
+#define BMP_ERR_LINES       0x02000000
+#define BMP_ERR_STRIDE      0x04000000
+#define BMP_ERR_SCALE       0x08000000
 
 
 
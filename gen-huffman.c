@@ -53,9 +53,37 @@ static int black_tree = -1;
 static int white_tree = -1;
 
 
+/* lookup tables for decoding: the primary table is indexed by the
+ * next LOOKUP_BITS bits of input (first bit in lowest position, as
+ * in the decoder's bit buffer). Codes longer than that are resolved
+ * with a secondary table indexed by the following LONG_BITS bits.
+ */
+#define LOOKUP_BITS 9
+#define LONG_BITS   4
+
+enum Kind {
+	KIND_INVALID = 0,
+	KIND_TERM,
+	KIND_MAKEUP,
+	KIND_LONG,
+};
+
+struct Lookup {
+	int value;
+	int nbits;
+	int kind;
+};
+
+static struct Lookup lookup_black[1 << LOOKUP_BITS];
+static struct Lookup lookup_white[1 << LOOKUP_BITS];
+static struct Lookup lookup_long[64 << LONG_BITS];
+static int           nlong = 0;
+
 static void s_buildtree(void);
 static void add_node(int *nodeidx, const char *bits, int value, bool makeup);
 static unsigned short str2bits(const char *str);
+static void s_buildlookup(struct Lookup *table, int root);
+static void s_print_lookup(FILE *file, const char *name, const struct Lookup *table, int n);
 
 
 int main(int argc, char *argv[])
@@ -76,6 +104,8 @@ int main(int argc, char *argv[])
 	}
 
 	s_buildtree();
+	s_buildlookup(lookup_black, black_tree);
+	s_buildlookup(lookup_white, white_tree);
 
 	fprintf(file, "/* bmplib - %s\n", src_name);
 	fprintf(file, " *\n"
@@ -107,6 +137,13 @@ int main(int argc, char *argv[])
 	      "};\n\n",
 	      file);
 
+	fputs("struct Hufflookup {\n"
+	      "\tshort         value;\n"
+	      "\tunsigned char nbits;\n"
+	      "\tunsigned char kind;\n"
+	      "};\n\n",
+	      file);
+
 	fputs("struct Huffcode {\n"
 	      "\tunsigned char bits;\n"
 	      "\tunsigned char nbits;\n"
@@ -122,6 +159,17 @@ int main(int argc, char *argv[])
 	}
 	fputs("};\n\n", file);
 
+	fprintf(file, "#define HUFF_LOOKUP_BITS %d\n", LOOKUP_BITS);
+	fprintf(file, "#define HUFF_LONG_BITS   %d\n", LONG_BITS);
+	fprintf(file, "#define HUFF_MAXBITS     %d\n\n", LOOKUP_BITS + LONG_BITS);
+	fprintf(file, "#define HUFF_INVALID %d\n", KIND_INVALID);
+	fprintf(file, "#define HUFF_TERM    %d\n", KIND_TERM);
+	fprintf(file, "#define HUFF_MAKEUP  %d\n", KIND_MAKEUP);
+	fprintf(file, "#define HUFF_LONG    %d\n\n", KIND_LONG);
+	s_print_lookup(file, "huff_lookup_black", lookup_black, ARR_SIZE(lookup_black));
+	s_print_lookup(file, "huff_lookup_white", lookup_white, ARR_SIZE(lookup_white));
+	s_print_lookup(file, "huff_lookup_long", lookup_long, nlong << LONG_BITS);
+
 	fputs("static const struct Huffcode huff_term_black[] = {\n\t", file);
 	for (i = 0; i < ARR_SIZE(huff_term_black); i++) {
 		fprintf(file, "{ 0x%02hx, %2d },",
@@ -251,3 +299,105 @@ static void add_node(int *nodeidx, const char *bits, int value, bool makeup)
 		}
 	}
 }
+
+
+
+/*****************************************************************************
+ * s_walk()
+ *
+ * follow the tree from node idx for up to nbits bits.
+ * Returns the node we end up on (-1 for invalid codes)
+ * and the number of bits used in *used.
+ ****************************************************************************/
+
+static int s_walk(int idx, unsigned bits, int nbits, int *used)
+{
+	*used = 0;
+	while (idx != -1 && !nodebuffer[idx].terminal && *used < nbits) {
+		if (bits & 1)
+			idx = nodebuffer[idx].r;
+		else
+			idx = nodebuffer[idx].l;
+		(*used)++;
+		bits >>= 1;
+	}
+	return idx;
+}
+
+
+
+/*****************************************************************************
+ * s_set_entry()
+ ****************************************************************************/
+
+static void s_set_entry(struct Lookup *entry, int idx, int nbits)
+{
+	if (idx == -1 || !nodebuffer[idx].terminal) {
+		entry->kind  = KIND_INVALID;
+		entry->value = 0;
+		entry->nbits = 0;
+	} else {
+		entry->kind  = nodebuffer[idx].makeup ? KIND_MAKEUP : KIND_TERM;
+		entry->value = nodebuffer[idx].value;
+		entry->nbits = nbits;
+	}
+}
+
+
+
+/*****************************************************************************
+ * s_buildlookup()
+ ****************************************************************************/
+
+static void s_buildlookup(struct Lookup *table, int root)
+{
+	int            i, k, idx, sub, used, subused;
+	struct Lookup *sec;
+
+	for (i = 0; i < (1 << LOOKUP_BITS); i++) {
+		idx = s_walk(root, i, LOOKUP_BITS, &used);
+		if (idx != -1 && !nodebuffer[idx].terminal) {
+			/* code is longer than LOOKUP_BITS */
+			if (nlong >= 64) {
+				printf("too many secondary tables\n");
+				exit(1);
+			}
+			table[i].kind  = KIND_LONG;
+			table[i].value = nlong;
+			table[i].nbits = 0;
+			sec = &lookup_long[nlong << LONG_BITS];
+			nlong++;
+			for (k = 0; k < (1 << LONG_BITS); k++) {
+				sub = s_walk(idx, k, LONG_BITS, &subused);
+				if (sub != -1 && !nodebuffer[sub].terminal) {
+					printf("code longer than %d bits\n", LOOKUP_BITS + LONG_BITS);
+					exit(1);
+				}
+				s_set_entry(&sec[k], sub, LOOKUP_BITS + subused);
+			}
+		} else {
+			s_set_entry(&table[i], idx, used);
+		}
+	}
+}
+
+
+
+/*****************************************************************************
+ * s_print_lookup()
+ ****************************************************************************/
+
+static void s_print_lookup(FILE *file, const char *name, const struct Lookup *table, int n)
+{
+	int i;
+
+	fprintf(file, "static const struct Hufflookup %s[] = {\n\t", name);
+	for (i = 0; i < n; i++) {
+		fprintf(file, "{ %4d, %2d, %d },", table[i].value, table[i].nbits, table[i].kind);
+		if ((i+1) % 4 == 0 && i != n - 1)
+			fputs("\n\t", file);
+		else
+			fputs(" ", file);
+	}
+	fputs("\n};\n\n", file);
+}
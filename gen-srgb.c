@@ -0,0 +1,141 @@
+/* bmplib - gen-srgb.c
+ *
+ * Copyright (c) 2024, Rupert Weber.
+ *
+ * This file is part of bmplib.
+ * bmplib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+
+/* 64-bit BMPs store s2.13 values, so there are only 65536 possible
+ * inputs for each of the conversions in bmp-read-loadimage.c. We
+ * generate all of them here, so the reader itself never has to call
+ * pow().
+ *
+ * s2_13_to_16_srgb[]    s2.13 clamped to 0...1 (index 0...8192),
+ *                       sRGB gamma applied, scaled to 0...0xffff
+ * s2_13_to_16_linear[]  same as above, but without gamma
+ * s2_13_srgb[]          s2.13 -> s2.13 with sRGB gamma, indexed by
+ *                       the raw (unsigned) 16-bit value
+ * s2_13_srgb_float[]    s2.13 -> float with sRGB gamma, indexed by
+ *                       the raw (unsigned) 16-bit value
+ */
+
+static double srgb_gamma(double d)
+{
+	if (d <= 0.0031308)
+		d = 12.92 * d;
+	else
+		d = 1.055 * pow(d, 1.0/2.4) - 0.055;
+	return d;
+}
+
+
+static void print_u16(FILE *file, const char *name, int n, int gamma, int clamped)
+{
+	int      i;
+	double   d;
+	uint16_t val;
+
+	fprintf(file, "static const uint16_t %s[%d] = {\n\t", name, n);
+	for (i = 0; i < n; i++) {
+		if (clamped) {
+			d = i / 8192.0;
+			if (gamma)
+				d = srgb_gamma(d);
+			val = (uint16_t) (d * 0xffff + 0.5);
+		} else {
+			d = (int16_t) i / 8192.0;
+			d = srgb_gamma(d);
+			val = (uint16_t) (((int)(d * 8192.0 + 0.5)) & 0xffff);
+		}
+		fprintf(file, "0x%04x,", (unsigned) val);
+		if ((i + 1) % 12 == 0 && i < n - 1)
+			fprintf(file, "\n\t");
+		else if (i < n - 1)
+			fprintf(file, " ");
+	}
+	fprintf(file, "\n};\n\n");
+}
+
+
+static void print_float(FILE *file, const char *name)
+{
+	int   i;
+	float f;
+
+	fprintf(file, "static const float %s[65536] = {\n\t", name);
+	for (i = 0; i < 65536; i++) {
+		f = (float) srgb_gamma((int16_t) i / 8192.0);
+		/* hex float, so the table is bit-exact */
+		fprintf(file, "%af,", (double) f);
+		if ((i + 1) % 6 == 0 && i < 65535)
+			fprintf(file, "\n\t");
+		else if (i < 65535)
+			fprintf(file, " ");
+	}
+	fprintf(file, "\n};\n\n");
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	FILE       *file;
+	const char *src_name  = "srgb-tables.h";
+	const char *this_name = "gen-srgb.c";
+
+	if (argc == 2) {
+		if (!(file = fopen(argv[1], "w"))) {
+			perror(argv[1]);
+			return 1;
+		}
+	} else {
+		file = stdout;
+	}
+
+	fprintf(file, "/* bmplib - %s\n", src_name);
+	fprintf(file, " *\n"
+	              " * Copyright (c) 2024, Rupert Weber.\n"
+	              " *\n"
+	              " * This file is part of bmplib.\n"
+	              " * bmplib is free software: you can redistribute it and/or modify\n"
+	              " * it under the terms of the GNU Lesser General Public License as\n"
+	              " * published by the Free Software Foundation, either version 3 of\n"
+	              " * the License, or (at your option) any later version.\n"
+	              " *\n");
+	fprintf(file, " * This program is distributed in the hope that it will be useful,\n"
+	              " * but WITHOUT ANY WARRANTY; without even the implied warranty of\n"
+	              " * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the\n"
+	              " * GNU Lesser General Public License for more details.\n"
+	              " *\n"
+	              " * You should have received a copy of the GNU Lesser General Public\n"
+	              " * License along with this library.\n"
+	              " * If not, see <https://www.gnu.org/licenses/>\n"
+	              " */\n\n");
+	fprintf(file, "/* This file is auto-generated by %s */\n\n\n", this_name);
+
+	print_u16(file, "s2_13_to_16_srgb", 8193, 1, 1);
+	print_u16(file, "s2_13_to_16_linear", 8193, 0, 1);
+	print_u16(file, "s2_13_srgb", 65536, 1, 0);
+	print_float(file, "s2_13_srgb_float");
+
+	if (file != stdout)
+		fclose(file);
+	return 0;
+}
@@ -46,13 +46,55 @@ static bool s_zerofill(BMPWRITE_R wp);
  * Direction is from lowest to highest bit.
  * Returns -1 if no valid terminating code is found.
  * EOL is _not_ handled, must be done by caller.
+ *
+ * Codes are looked up in the tables generated by gen-huffman.c.
+ * Only when the table can't give a definite answer (invalid code
+ * or fewer bits left than the code is long, i.e. near the end of
+ * the file) do we walk the tree bit by bit.
  ****************************************************************************/
 
+static int s_decode_tree(BMPREAD_R rp, int black, int result);
+
 int huff_decode(BMPREAD_R rp, int black)
+{
+	const struct Hufflookup *entry;
+	int                      result = 0;
+
+	do {
+		huff_fillbuf(rp);
+
+		entry = &(black ? huff_lookup_black : huff_lookup_white)
+		                               [rp->hufbuf & ((1U << HUFF_LOOKUP_BITS) - 1)];
+		if (entry->kind == HUFF_LONG) {
+			entry = &huff_lookup_long[(entry->value << HUFF_LONG_BITS) +
+			           ((rp->hufbuf >> HUFF_LOOKUP_BITS) & ((1U << HUFF_LONG_BITS) - 1))];
+		}
+
+		if (entry->kind == HUFF_INVALID || entry->nbits > rp->hufbuf_len)
+			return s_decode_tree(rp, black, result);
+
+		result += entry->value;
+		rp->hufbuf >>= entry->nbits;
+		rp->hufbuf_len -= entry->nbits;
+
+	} while (entry->kind == HUFF_MAKEUP && result < INT_MAX - 2560);
+
+	return entry->kind == HUFF_MAKEUP ? -1 : result;
+}
+
+
+
+/*****************************************************************************
+ * s_decode_tree()
+ *
+ * Bit-by-bit tree walk, continues decoding from
+ * wherever huff_decode left off.
+ ****************************************************************************/
+
+static int s_decode_tree(BMPREAD_R rp, int black, int result)
 {
 	int idx;
 	int bits_used = 0;
-	int result = 0;
 
 	do {
 		huff_fillbuf(rp);
@@ -107,10 +149,10 @@ void huff_fillbuf(BMPREAD_R rp)
 	int byte;
 
 	while (rp->hufbuf_len <= 24) {
-		if (EOF == (byte = getc(rp->file)))
+		if (rp->rbuf_pos >= rp->rbuf_len && !cm_fill_readbuf(rp, 1))
 			break;
+		byte = reversebits[rp->rbuf[rp->rbuf_pos++]];
 		rp->bytes_read++;
-		byte = reversebits[byte];
 		rp->hufbuf |= ((uint32_t)byte) << rp->hufbuf_len;
 		rp->hufbuf_len += 8;
 	}
@@ -218,21 +260,61 @@ static bool s_zerofill(BMPWRITE_R wp)
 
 
 
+/*****************************************************************************
+ * huff_append()
+ *
+ * Append a separately encoded bit stream: len whole bytes
+ * (msb first) followed by the nbits lowest bits of tail.
+ ****************************************************************************/
+
+bool huff_append(BMPWRITE_R wp, const unsigned char *data, size_t len,
+                 uint32_t tail, int nbits)
+{
+	size_t i;
+
+	if (wp->hufbuf_len % 8 == 0 && len) {
+		/* byte aligned, no need to shift anything */
+		if (!huff_flush(wp))
+			return false;
+		if (!cm_write(wp, data, len))
+			goto abort;
+	} else {
+		for (i = 0; i < len; i++) {
+			if (!s_push(wp, data[i], 8))
+				return false;
+		}
+	}
+
+	while (nbits > 8) {
+		nbits -= 8;
+		if (!s_push(wp, (tail >> nbits) & 0xff, 8))
+			return false;
+	}
+	if (nbits > 0 && !s_push(wp, tail & ((1UL << nbits) - 1), nbits))
+		return false;
+
+	return true;
+abort:
+	logsyserr(wp->log, "writing Huffman bitmap");
+	return false;
+}
+
+
+
 /*****************************************************************************
  * huff_flush()
  ****************************************************************************/
 
 bool huff_flush(BMPWRITE_R wp)
 {
-	int byte;
+	unsigned char byte;
 
 	while (wp->hufbuf_len >= 8) {
 		byte = 0x00ff & (wp->hufbuf >> (wp->hufbuf_len - 8));
-		if (EOF == putc(byte, wp->file)) {
+		if (!cm_write(wp, &byte, 1)) {
 			logsyserr(wp->log, "writing Huffman bitmap");
 			return false;
 		}
-		wp->bytes_written++;
 		wp->hufbuf_len -= 8;
 		wp->hufbuf &= (1UL << wp->hufbuf_len) - 1;
 	}
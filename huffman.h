@@ -25,3 +25,5 @@ bool huff_encode(BMPWRITE_R wp, int val, bool black);
 bool huff_encode_eol(BMPWRITE_R wp);
 bool huff_encode_rtc(BMPWRITE_R wp);
 bool huff_flush(BMPWRITE_R wp);
+bool huff_append(BMPWRITE_R wp, const unsigned char *data, size_t len,
+                 uint32_t tail, int nbits);
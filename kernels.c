@@ -0,0 +1,633 @@
+/* bmplib - kernels.c
+ *
+ * Copyright (c) 2024, Rupert Weber.
+ *
+ * This file is part of bmplib.
+ * bmplib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define KERN_X86
+	#include <immintrin.h>
+	#define TARGET(t) __attribute__((target(t)))
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	#define KERN_NEON
+	#include <arm_neon.h>
+#endif
+
+
+/* All versions of a kernel must produce bit-identical results, as the
+ * generic (per-pixel) code path in bmp-read-loadimage.c is the reference.
+ *
+ * 5/6-bit expansion:  (v * 255 + 15) / 31 resp. (v * 255 + 31) / 63
+ *                     is the rounded scaling from s_scaleint(). The SIMD
+ *                     versions use the equivalent multiply-high with
+ *                     8457 >> 2 (31) resp. 16645 >> 4 (63), which is exact
+ *                     for all possible values.
+ * u8 -> float:        v / 255.0f, single precision division gives the
+ *                     same result as (float) (v / 255.0).
+ * u8 -> s2.13:        (v * 8192.0f) / 255.0f + 0.5f, truncated. Exhaustively
+ *                     verified to be identical to the double calculation.
+ */
+
+
+
+/*****************************************************************************
+ * 	plain C versions
+ *****************************************************************************/
+
+static void s_swap3_c(const unsigned char *restrict src, unsigned char *restrict dst, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		dst[0] = src[2];
+		dst[1] = src[1];
+		dst[2] = src[0];
+		dst += 3;
+		src += 3;
+	}
+}
+
+
+static void s_swap4_c(const unsigned char *restrict src, unsigned char *restrict dst, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		dst[0] = src[2];
+		dst[1] = src[1];
+		dst[2] = src[0];
+		dst[3] = src[3];
+		dst += 4;
+		src += 4;
+	}
+}
+
+
+static void s_expand565_c(const unsigned char *restrict src, unsigned char *restrict dst, size_t n)
+{
+	unsigned v;
+
+	for (size_t i = 0; i < n; i++) {
+		v = (unsigned) src[0] | (unsigned) src[1] << 8;
+		dst[0] = (unsigned char) ((((v >> 11) & 0x1f) * 255 + 15) / 31);
+		dst[1] = (unsigned char) ((((v >>  5) & 0x3f) * 255 + 31) / 63);
+		dst[2] = (unsigned char) (((v & 0x1f) * 255 + 15) / 31);
+		dst += 3;
+		src += 2;
+	}
+}
+
+
+static void s_expand555_c(const unsigned char *restrict src, unsigned char *restrict dst, size_t n)
+{
+	unsigned v;
+
+	for (size_t i = 0; i < n; i++) {
+		v = (unsigned) src[0] | (unsigned) src[1] << 8;
+		dst[0] = (unsigned char) ((((v >> 10) & 0x1f) * 255 + 15) / 31);
+		dst[1] = (unsigned char) ((((v >>  5) & 0x1f) * 255 + 15) / 31);
+		dst[2] = (unsigned char) (((v & 0x1f) * 255 + 15) / 31);
+		dst += 3;
+		src += 2;
+	}
+}
+
+
+static void s_u8_to_float_c(const unsigned char *restrict src, float *restrict dst, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		dst[i] = (float) src[i] / 255.0f;
+}
+
+
+static void s_u8_to_s2_13_c(const unsigned char *restrict src, uint16_t *restrict dst, size_t n)
+{
+	/* integer version of the same rounding, so we don't
+	 * depend on the compiler's floating point contraction
+	 */
+	for (size_t i = 0; i < n; i++)
+		dst[i] = (uint16_t) (((unsigned) src[i] * 16384 + 255) / 510);
+}
+
+
+static size_t s_equal_run_c(const unsigned char *a, const unsigned char *b, size_t n)
+{
+	size_t   i = 0;
+	uint64_t va, vb;
+
+	/* a word at a time, then find the differing byte */
+	for (; i + 8 <= n; i += 8) {
+		memcpy(&va, a + i, 8);
+		memcpy(&vb, b + i, 8);
+		if (va != vb)
+			break;
+	}
+	while (i < n && a[i] == b[i])
+		i++;
+	return i;
+}
+
+
+static const struct Kernels s_kernels_c = {
+	.name        = "C",
+	.swap3       = s_swap3_c,
+	.swap4       = s_swap4_c,
+	.expand565   = s_expand565_c,
+	.expand555   = s_expand555_c,
+	.u8_to_float = s_u8_to_float_c,
+	.u8_to_s2_13 = s_u8_to_s2_13_c,
+	.equal_run   = s_equal_run_c,
+};
+
+
+
+#ifdef KERN_X86
+
+/*****************************************************************************
+ * 	SSE4.1 versions
+ *****************************************************************************/
+
+TARGET("sse4.1")
+static void s_swap3_sse(const unsigned char *restrict src, unsigned char *restrict dst, size_t n)
+{
+	size_t  i = 0;
+	__m128i shuf, v;
+
+	/* 4 pixels per round, but each load/store touches 16 bytes */
+	shuf = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 12, 13, 14, 15);
+	for (; i + 6 <= n; i += 4) {
+		v = _mm_loadu_si128((const __m128i*) (src + 3 * i));
+		_mm_storeu_si128((__m128i*) (dst + 3 * i), _mm_shuffle_epi8(v, shuf));
+	}
+	s_swap3_c(src + 3 * i, dst + 3 * i, n - i);
+}
+
+
+TARGET("sse4.1")
+static void s_swap4_sse(const unsigned char *restrict src, unsigned char *restrict dst, size_t n)
+{
+	size_t  i = 0;
+	__m128i shuf, v;
+
+	shuf = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	for (; i + 4 <= n; i += 4) {
+		v = _mm_loadu_si128((const __m128i*) (src + 4 * i));
+		_mm_storeu_si128((__m128i*) (dst + 4 * i), _mm_shuffle_epi8(v, shuf));
+	}
+	s_swap4_c(src + 4 * i, dst + 4 * i, n - i);
+}
+
+
+TARGET("sse4.1")
+static inline __m128i s_scale5_sse(__m128i v)
+{
+	v = _mm_add_epi16(_mm_mullo_epi16(v, _mm_set1_epi16(255)), _mm_set1_epi16(15));
+	return _mm_srli_epi16(_mm_mulhi_epu16(v, _mm_set1_epi16(8457)), 2);
+}
+
+
+TARGET("sse4.1")
+static inline __m128i s_scale6_sse(__m128i v)
+{
+	v = _mm_add_epi16(_mm_mullo_epi16(v, _mm_set1_epi16(255)), _mm_set1_epi16(31));
+	return _mm_srli_epi16(_mm_mulhi_epu16(v, _mm_set1_epi16(16645)), 4);
+}
+
+
+TARGET("sse4.1")
+static inline void s_store_rgb8_sse(unsigned char *restrict dst, __m128i r, __m128i g, __m128i b)
+{
+	__m128i zero = _mm_setzero_si128(), rg, lo, hi;
+
+	/* r, g, b each hold 8 16-bit values. Interleave into 24 bytes */
+	r  = _mm_packus_epi16(r, zero);
+	g  = _mm_packus_epi16(g, zero);
+	b  = _mm_packus_epi16(b, zero);
+	rg = _mm_unpacklo_epi8(r, g);
+
+	lo = _mm_or_si128(_mm_shuffle_epi8(rg, _mm_setr_epi8(0, 1, -128, 2, 3, -128, 4, 5,
+	                                                     -128, 6, 7, -128, 8, 9, -128, 10)),
+	                  _mm_shuffle_epi8(b, _mm_setr_epi8(-128, -128, 0, -128, -128, 1, -128, -128,
+	                                                    2, -128, -128, 3, -128, -128, 4, -128)));
+	hi = _mm_or_si128(_mm_shuffle_epi8(rg, _mm_setr_epi8(11, -128, 12, 13, -128, 14, 15, -128,
+	                                                     -128, -128, -128, -128, -128, -128, -128, -128)),
+	                  _mm_shuffle_epi8(b, _mm_setr_epi8(-128, 5, -128, -128, 6, -128, -128, 7,
+	                                                    -128, -128, -128, -128, -128, -128, -128, -128)));
+	_mm_storeu_si128((__m128i*) dst, lo);
+	_mm_storel_epi64((__m128i*) (dst + 16), hi);
+}
+
+
+TARGET("sse4.1")
+static void s_expand565_sse(const unsigned char *restrict src, unsigned char *restrict dst, size_t n)
+{
+	size_t  i = 0;
+	__m128i v, r, g, b, mask5, mask6;
+
+	mask5 = _mm_set1_epi16(0x1f);
+	mask6 = _mm_set1_epi16(0x3f);
+	for (; i + 8 <= n; i += 8) {
+		v = _mm_loadu_si128((const __m128i*) (src + 2 * i));
+		r = s_scale5_sse(_mm_srli_epi16(v, 11));
+		g = s_scale6_sse(_mm_and_si128(_mm_srli_epi16(v, 5), mask6));
+		b = s_scale5_sse(_mm_and_si128(v, mask5));
+		s_store_rgb8_sse(dst + 3 * i, r, g, b);
+	}
+	s_expand565_c(src + 2 * i, dst + 3 * i, n - i);
+}
+
+
+TARGET("sse4.1")
+static void s_expand555_sse(const unsigned char *restrict src, unsigned char *restrict dst, size_t n)
+{
+	size_t  i = 0;
+	__m128i v, r, g, b, mask5;
+
+	mask5 = _mm_set1_epi16(0x1f);
+	for (; i + 8 <= n; i += 8) {
+		v = _mm_loadu_si128((const __m128i*) (src + 2 * i));
+		r = s_scale5_sse(_mm_and_si128(_mm_srli_epi16(v, 10), mask5));
+		g = s_scale5_sse(_mm_and_si128(_mm_srli_epi16(v, 5), mask5));
+		b = s_scale5_sse(_mm_and_si128(v, mask5));
+		s_store_rgb8_sse(dst + 3 * i, r, g, b);
+	}
+	s_expand555_c(src + 2 * i, dst + 3 * i, n - i);
+}
+
+
+TARGET("sse4.1")
+static void s_u8_to_float_sse(const unsigned char *restrict src, float *restrict dst, size_t n)
+{
+	size_t  i = 0;
+	__m128i v;
+	__m128  div;
+	int     k;
+
+	div = _mm_set1_ps(255.0f);
+	for (; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i*) (src + i));
+		for (k = 0; k < 4; k++) {
+			_mm_storeu_ps(dst + i + 4 * k,
+			              _mm_div_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(v)), div));
+			v = _mm_srli_si128(v, 4);
+		}
+	}
+	s_u8_to_float_c(src + i, dst + i, n - i);
+}
+
+
+TARGET("sse4.1")
+static inline __m128i s_u8x4_to_s2_13_sse(__m128i v)
+{
+	__m128 f;
+
+	f = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(v)), _mm_set1_ps(8192.0f));
+	f = _mm_add_ps(_mm_div_ps(f, _mm_set1_ps(255.0f)), _mm_set1_ps(0.5f));
+	return _mm_cvttps_epi32(f);
+}
+
+
+TARGET("sse4.1")
+static void s_u8_to_s2_13_sse(const unsigned char *restrict src, uint16_t *restrict dst, size_t n)
+{
+	size_t  i = 0;
+	__m128i v, lo, hi;
+
+	for (; i + 8 <= n; i += 8) {
+		v  = _mm_loadl_epi64((const __m128i*) (src + i));
+		lo = s_u8x4_to_s2_13_sse(v);
+		hi = s_u8x4_to_s2_13_sse(_mm_srli_si128(v, 4));
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_packus_epi32(lo, hi));
+	}
+	s_u8_to_s2_13_c(src + i, dst + i, n - i);
+}
+
+
+TARGET("sse4.1")
+static size_t s_equal_run_sse(const unsigned char *a, const unsigned char *b, size_t n)
+{
+	size_t   i = 0;
+	unsigned mask;
+
+	for (; i + 16 <= n; i += 16) {
+		mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(
+		                      _mm_loadu_si128((const __m128i*) (a + i)),
+		                      _mm_loadu_si128((const __m128i*) (b + i))));
+		if (mask != 0xffff)
+			return i + (size_t) __builtin_ctz(~mask);
+	}
+	return i + s_equal_run_c(a + i, b + i, n - i);
+}
+
+
+static const struct Kernels s_kernels_sse = {
+	.name        = "SSE4.1",
+	.swap3       = s_swap3_sse,
+	.swap4       = s_swap4_sse,
+	.expand565   = s_expand565_sse,
+	.expand555   = s_expand555_sse,
+	.u8_to_float = s_u8_to_float_sse,
+	.u8_to_s2_13 = s_u8_to_s2_13_sse,
+	.equal_run   = s_equal_run_sse,
+};
+
+
+
+/*****************************************************************************
+ * 	AVX2 versions
+ *
+ * Only where the wider registers help. 3-byte pixels
+ * and the 565/555 interleaving don't map well onto
+ * AVX2's two separate 128-bit lanes, so those stay SSE.
+ *****************************************************************************/
+
+TARGET("avx2")
+static void s_swap4_avx2(const unsigned char *restrict src, unsigned char *restrict dst, size_t n)
+{
+	size_t  i = 0;
+	__m256i shuf, v;
+
+	shuf = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+	                        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	for (; i + 8 <= n; i += 8) {
+		v = _mm256_loadu_si256((const __m256i*) (src + 4 * i));
+		_mm256_storeu_si256((__m256i*) (dst + 4 * i), _mm256_shuffle_epi8(v, shuf));
+	}
+	s_swap4_c(src + 4 * i, dst + 4 * i, n - i);
+}
+
+
+TARGET("avx2")
+static void s_u8_to_float_avx2(const unsigned char *restrict src, float *restrict dst, size_t n)
+{
+	size_t  i = 0;
+	__m128i v;
+	__m256  div;
+
+	div = _mm256_set1_ps(255.0f);
+	for (; i + 8 <= n; i += 8) {
+		v = _mm_loadl_epi64((const __m128i*) (src + i));
+		_mm256_storeu_ps(dst + i, _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)), div));
+	}
+	s_u8_to_float_c(src + i, dst + i, n - i);
+}
+
+
+TARGET("avx2")
+static inline __m256i s_u8x8_to_s2_13_avx2(__m128i v)
+{
+	__m256 f;
+
+	f = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)), _mm256_set1_ps(8192.0f));
+	f = _mm256_add_ps(_mm256_div_ps(f, _mm256_set1_ps(255.0f)), _mm256_set1_ps(0.5f));
+	return _mm256_cvttps_epi32(f);
+}
+
+
+TARGET("avx2")
+static void s_u8_to_s2_13_avx2(const unsigned char *restrict src, uint16_t *restrict dst, size_t n)
+{
+	size_t  i = 0;
+	__m128i v;
+	__m256i lo, hi, packed;
+
+	for (; i + 16 <= n; i += 16) {
+		v  = _mm_loadu_si128((const __m128i*) (src + i));
+		lo = s_u8x8_to_s2_13_avx2(v);
+		hi = s_u8x8_to_s2_13_avx2(_mm_srli_si128(v, 8));
+		/* packus works per 128-bit lane, restore order afterwards */
+		packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xd8);
+		_mm256_storeu_si256((__m256i*) (dst + i), packed);
+	}
+	s_u8_to_s2_13_c(src + i, dst + i, n - i);
+}
+
+
+TARGET("avx2")
+static size_t s_equal_run_avx2(const unsigned char *a, const unsigned char *b, size_t n)
+{
+	size_t   i = 0;
+	unsigned mask;
+
+	for (; i + 32 <= n; i += 32) {
+		mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+		                      _mm256_loadu_si256((const __m256i*) (a + i)),
+		                      _mm256_loadu_si256((const __m256i*) (b + i))));
+		if (mask != 0xffffffffU)
+			return i + (size_t) __builtin_ctz(~mask);
+	}
+	return i + s_equal_run_sse(a + i, b + i, n - i);
+}
+
+
+static const struct Kernels s_kernels_avx2 = {
+	.name        = "AVX2",
+	.swap3       = s_swap3_sse,
+	.swap4       = s_swap4_avx2,
+	.expand565   = s_expand565_sse,
+	.expand555   = s_expand555_sse,
+	.u8_to_float = s_u8_to_float_avx2,
+	.u8_to_s2_13 = s_u8_to_s2_13_avx2,
+	.equal_run   = s_equal_run_avx2,
+};
+
+#endif /* KERN_X86 */
+
+
+
+#ifdef KERN_NEON
+
+/*****************************************************************************
+ * 	NEON versions
+ *
+ * NEON is part of the aarch64 base ISA, no runtime check needed.
+ *****************************************************************************/
+
+static void s_swap3_neon(const unsigned char *restrict src, unsigned char *restrict dst, size_t n)
+{
+	size_t      i = 0;
+	uint8x16x3_t v;
+	uint8x16_t   tmp;
+
+	for (; i + 16 <= n; i += 16) {
+		v = vld3q_u8(src + 3 * i);
+		tmp = v.val[0];
+		v.val[0] = v.val[2];
+		v.val[2] = tmp;
+		vst3q_u8(dst + 3 * i, v);
+	}
+	s_swap3_c(src + 3 * i, dst + 3 * i, n - i);
+}
+
+
+static void s_swap4_neon(const unsigned char *restrict src, unsigned char *restrict dst, size_t n)
+{
+	size_t       i = 0;
+	uint8x16x4_t v;
+	uint8x16_t   tmp;
+
+	for (; i + 16 <= n; i += 16) {
+		v = vld4q_u8(src + 4 * i);
+		tmp = v.val[0];
+		v.val[0] = v.val[2];
+		v.val[2] = tmp;
+		vst4q_u8(dst + 4 * i, v);
+	}
+	s_swap4_c(src + 4 * i, dst + 4 * i, n - i);
+}
+
+
+static inline uint8x8_t s_scale_neon(uint16x8_t v, uint16_t round, uint16_t mul, int shift)
+{
+	uint16x8_t t;
+
+	t = vmlaq_n_u16(vdupq_n_u16(round), v, 255);
+	t = vcombine_u16(vshrn_n_u32(vmull_n_u16(vget_low_u16(t), mul), 16),
+	                 vshrn_n_u32(vmull_n_u16(vget_high_u16(t), mul), 16));
+	t = vshlq_u16(t, vdupq_n_s16((int16_t) -shift));
+	return vmovn_u16(t);
+}
+
+
+static void s_expand565_neon(const unsigned char *restrict src, unsigned char *restrict dst, size_t n)
+{
+	size_t      i = 0;
+	uint16x8_t  v;
+	uint8x8x3_t rgb;
+
+	for (; i + 8 <= n; i += 8) {
+		v = vreinterpretq_u16_u8(vld1q_u8(src + 2 * i));
+		rgb.val[0] = s_scale_neon(vshrq_n_u16(v, 11), 15, 8457, 2);
+		rgb.val[1] = s_scale_neon(vandq_u16(vshrq_n_u16(v, 5), vdupq_n_u16(0x3f)), 31, 16645, 4);
+		rgb.val[2] = s_scale_neon(vandq_u16(v, vdupq_n_u16(0x1f)), 15, 8457, 2);
+		vst3_u8(dst + 3 * i, rgb);
+	}
+	s_expand565_c(src + 2 * i, dst + 3 * i, n - i);
+}
+
+
+static void s_expand555_neon(const unsigned char *restrict src, unsigned char *restrict dst, size_t n)
+{
+	size_t      i = 0;
+	uint16x8_t  v;
+	uint8x8x3_t rgb;
+
+	for (; i + 8 <= n; i += 8) {
+		v = vreinterpretq_u16_u8(vld1q_u8(src + 2 * i));
+		rgb.val[0] = s_scale_neon(vandq_u16(vshrq_n_u16(v, 10), vdupq_n_u16(0x1f)), 15, 8457, 2);
+		rgb.val[1] = s_scale_neon(vandq_u16(vshrq_n_u16(v, 5), vdupq_n_u16(0x1f)), 15, 8457, 2);
+		rgb.val[2] = s_scale_neon(vandq_u16(v, vdupq_n_u16(0x1f)), 15, 8457, 2);
+		vst3_u8(dst + 3 * i, rgb);
+	}
+	s_expand555_c(src + 2 * i, dst + 3 * i, n - i);
+}
+
+
+static void s_u8_to_float_neon(const unsigned char *restrict src, float *restrict dst, size_t n)
+{
+	size_t      i = 0;
+	uint16x8_t  v;
+	float32x4_t div;
+
+	div = vdupq_n_f32(255.0f);
+	for (; i + 8 <= n; i += 8) {
+		v = vmovl_u8(vld1_u8(src + i));
+		vst1q_f32(dst + i,     vdivq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))), div));
+		vst1q_f32(dst + i + 4, vdivq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(v))), div));
+	}
+	s_u8_to_float_c(src + i, dst + i, n - i);
+}
+
+
+static inline uint16x4_t s_u16x4_to_s2_13_neon(uint16x4_t v)
+{
+	float32x4_t f;
+
+	f = vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(v)), 8192.0f);
+	f = vaddq_f32(vdivq_f32(f, vdupq_n_f32(255.0f)), vdupq_n_f32(0.5f));
+	return vmovn_u32(vcvtq_u32_f32(f));
+}
+
+
+static void s_u8_to_s2_13_neon(const unsigned char *restrict src, uint16_t *restrict dst, size_t n)
+{
+	size_t     i = 0;
+	uint16x8_t v;
+
+	for (; i + 8 <= n; i += 8) {
+		v = vmovl_u8(vld1_u8(src + i));
+		vst1q_u16(dst + i, vcombine_u16(s_u16x4_to_s2_13_neon(vget_low_u16(v)),
+		                                s_u16x4_to_s2_13_neon(vget_high_u16(v))));
+	}
+	s_u8_to_s2_13_c(src + i, dst + i, n - i);
+}
+
+
+static size_t s_equal_run_neon(const unsigned char *a, const unsigned char *b, size_t n)
+{
+	size_t i = 0;
+
+	/* only tells whether all 16 bytes are equal, C finds the position */
+	for (; i + 16 <= n; i += 16) {
+		if (vminvq_u8(vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i))) != 0xff)
+			break;
+	}
+	return i + s_equal_run_c(a + i, b + i, n - i);
+}
+
+
+static const struct Kernels s_kernels_neon = {
+	.name        = "NEON",
+	.swap3       = s_swap3_neon,
+	.swap4       = s_swap4_neon,
+	.expand565   = s_expand565_neon,
+	.expand555   = s_expand555_neon,
+	.u8_to_float = s_u8_to_float_neon,
+	.u8_to_s2_13 = s_u8_to_s2_13_neon,
+	.equal_run   = s_equal_run_neon,
+};
+
+#endif /* KERN_NEON */
+
+
+
+/*****************************************************************************
+ * 	kern_select
+ *
+ * Setting the environment variable BMPLIB_NO_SIMD
+ * forces the plain C kernels (for comparison and
+ * debugging).
+ *****************************************************************************/
+
+const struct Kernels* kern_select(void)
+{
+	if (getenv("BMPLIB_NO_SIMD"))
+		return &s_kernels_c;
+
+#if defined(KERN_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return &s_kernels_avx2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return &s_kernels_sse;
+#elif defined(KERN_NEON)
+	return &s_kernels_neon;
+#endif
+	return &s_kernels_c;
+}
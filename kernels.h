@@ -0,0 +1,47 @@
+/* bmplib - kernels.h
+ *
+ * Copyright (c) 2024, Rupert Weber.
+ *
+ * This file is part of bmplib.
+ * bmplib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <https://www.gnu.org/licenses/>
+ */
+
+/* Line conversion kernels. Each kernel exists as a plain C version
+ * and, where available, as SSE4.1/AVX2 (x86) or NEON (aarch64)
+ * version. kern_select() picks the best set for the CPU we are
+ * running on.
+ *
+ * swap3/swap4:   swap bytes 0 and 2 of each 3-/4-byte pixel
+ *                (BGR <-> RGB, BGRA <-> RGBA). n = number of pixels
+ * expand565/555: 16-bit 5/6/5 or 5/5/5 pixels to 8-bit RGB.
+ *                n = number of pixels
+ * u8_to_float:   8-bit values to float 0.0...1.0. n = number of values
+ * u8_to_s2_13:   8-bit values to s2.13 0.0...1.0. n = number of values
+ * equal_run:     number of leading bytes (max. n) which are the same in
+ *                a and b. a and b may overlap.
+ */
+
+struct Kernels {
+	const char *name;
+	void (*swap3)(const unsigned char *restrict src, unsigned char *restrict dst, size_t n);
+	void (*swap4)(const unsigned char *restrict src, unsigned char *restrict dst, size_t n);
+	void (*expand565)(const unsigned char *restrict src, unsigned char *restrict dst, size_t n);
+	void (*expand555)(const unsigned char *restrict src, unsigned char *restrict dst, size_t n);
+	void (*u8_to_float)(const unsigned char *restrict src, float *restrict dst, size_t n);
+	void (*u8_to_s2_13)(const unsigned char *restrict src, uint16_t *restrict dst, size_t n);
+	size_t (*equal_run)(const unsigned char *a, const unsigned char *b, size_t n);
+};
+
+const struct Kernels* kern_select(void);
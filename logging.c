@@ -25,14 +25,34 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include "config.h"
+#include "bmplib.h"
 #include "logging.h"
+#include "bmp-common.h"
 
 
+#define LOG_RING 16  /* entries kept for lazy formatting */
+
+struct LogEntry {
+	const char    *msg;
+	int            errnum;  /* 0 = no system error */
+#ifdef DEBUG
+	const char    *file;
+	int            line;
+	const char    *function;
+#endif
+};
+
 struct Log {
-	int   size;
-	char *buffer;
+	int                        size;
+	char                      *buffer;
+	const struct BmpAllocator *allocator;
+	struct LogEntry            ring[LOG_RING];
+	int                        ring_start;
+	int                        ring_count;
+	unsigned long              dropped;
 };
 
 
@@ -42,6 +62,14 @@ struct Log {
  * Use logsyserr() where perror() would be used, logerr()
  * otherwise.
  *
+ * logfixed(log, msg) and logsysfixed(log, msg) are for the
+ * decoding hot path. They only record a pointer to the (static!)
+ * message in a fixed-size ring, without any formatting or
+ * allocation. (The BMP_ERR_* codes are kept by the caller in
+ * rp->lasterr, the log only deals with text.) The ring is turned into
+ * text when the message is requested with logmsg(), or before the
+ * next logerr()/logsyserr() to keep the order of messages.
+ *
  * 'separator' and 'inter' can have any length
  * 'air' is just there so we don't need to realloc every
  * single time.
@@ -55,6 +83,9 @@ static bool s_allocate(LOG log, size_t add_chars);
 static void s_log(LOG log, const char *file, int line, const char *function,
 		  const char *etxt, const char *fmt, va_list args);
 static void panic(LOG log);
+static void s_add_entry(LOG log, const struct LogEntry *entry);
+static void s_flush_ring(LOG log);
+static void s_log_entry(LOG log, const struct LogEntry *entry, const char *fmt, ...);
 #ifdef DEBUG
 static int s_add_file_etc(LOG log, const char *file, int line, const char *function);
 #endif
@@ -65,13 +96,13 @@ static int s_add_file_etc(LOG log, const char *file, int line, const char *funct
  *      logcreate / logfree / etc.
  *********************************************************/
 
-LOG logcreate(void)
+LOG logcreate(const struct BmpAllocator *allocator)
 {
 	LOG log;
 
-	if (!(log = malloc(sizeof *log)))
+	if (!(log = cm_calloc(allocator, sizeof *log)))
 		return NULL;
-	memset(log, 0, sizeof *log);
+	log->allocator = allocator;
 	return log;
 }
 
@@ -79,15 +110,25 @@ void logfree(LOG log)
 {
 	if (log) {
 		if (log->size != -1 && log->buffer)
-			free(log->buffer);
-		free(log);
+			cm_free(log->allocator, log->buffer);
+		cm_free(log->allocator, log);
 	}
 }
 
 void logreset(LOG log)
 {
-	if (log && log->buffer)
-		*log->buffer = 0;
+	if (log) {
+		if (log->size == -1) {
+			/* panic, buffer is a string literal */
+			log->buffer = NULL;
+			log->size   = 0;
+		}
+		if (log->buffer)
+			*log->buffer = 0;
+		log->ring_start = 0;
+		log->ring_count = 0;
+		log->dropped    = 0;
+	}
 }
 
 
@@ -98,6 +139,9 @@ void logreset(LOG log)
 
 const char* logmsg(LOG log)
 {
+	if (log)
+		s_flush_ring(log);
+
 	if (log && log->buffer)
 		return log->buffer;
 	else
@@ -158,6 +202,124 @@ void logsyserr(LOG log, const char *fmt, ...)
 
 
 
+/*********************************************************
+ *      logfixed() / logsysfixed()
+ *********************************************************/
+
+#ifdef DEBUG
+void logfixed_(LOG log, const char *file, int line, const char *function, const char *msg)
+#else
+void logfixed(LOG log, const char *msg)
+#endif
+{
+	struct LogEntry entry = { .msg = msg };
+
+#ifdef DEBUG
+	entry.file     = file;
+	entry.line     = line;
+	entry.function = function;
+#endif
+	s_add_entry(log, &entry);
+}
+
+#ifdef DEBUG
+void logsysfixed_(LOG log, const char *file, int line, const char *function, const char *msg)
+#else
+void logsysfixed(LOG log, const char *msg)
+#endif
+{
+	struct LogEntry entry = { .msg = msg, .errnum = errno };
+
+#ifdef DEBUG
+	entry.file     = file;
+	entry.line     = line;
+	entry.function = function;
+#endif
+	s_add_entry(log, &entry);
+}
+
+
+
+/*********************************************************
+ *      s_add_entry()
+ *
+ * An error that is still waiting in the ring isn't added
+ * again, so a condition that is reported for every line
+ * only shows up once. When the ring is full, the oldest
+ * entry is dropped.
+ *********************************************************/
+
+static void s_add_entry(LOG log, const struct LogEntry *entry)
+{
+	const struct LogEntry *e;
+	int                    i;
+
+	for (i = 0; i < log->ring_count; i++) {
+		e = &log->ring[(log->ring_start + i) % LOG_RING];
+		if (e->msg == entry->msg && e->errnum == entry->errnum)
+			return;
+	}
+
+	if (log->ring_count == LOG_RING) {
+		log->ring_start = (log->ring_start + 1) % LOG_RING;
+		log->ring_count--;
+		log->dropped++;
+	}
+	log->ring[(log->ring_start + log->ring_count) % LOG_RING] = *entry;
+	log->ring_count++;
+}
+
+
+
+/*********************************************************
+ *      s_flush_ring()
+ *********************************************************/
+
+static void s_flush_ring(LOG log)
+{
+	struct LogEntry entry = { 0 };
+	int             i, count = log->ring_count;
+
+	log->ring_count = 0;  /* s_log() would come back here */
+
+#ifdef DEBUG
+	entry.file     = __FILE__;
+	entry.line     = __LINE__;
+	entry.function = __func__;
+#endif
+
+	if (log->dropped) {
+		s_log_entry(log, &entry, "(%lu earlier messages dropped)", log->dropped);
+		log->dropped = 0;
+	}
+	for (i = 0; i < count; i++)
+		s_log_entry(log, &log->ring[(log->ring_start + i) % LOG_RING], "%s",
+		            log->ring[(log->ring_start + i) % LOG_RING].msg);
+	log->ring_start = 0;
+}
+
+
+
+/*********************************************************
+ *      s_log_entry()
+ *********************************************************/
+
+static void s_log_entry(LOG log, const struct LogEntry *entry, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+#ifdef DEBUG
+	s_log(log, entry->file, entry->line, entry->function,
+	      entry->errnum ? strerror(entry->errnum) : NULL, fmt, args);
+#else
+	s_log(log, NULL, 0, NULL, entry->errnum ? strerror(entry->errnum) : NULL, fmt, args);
+#endif
+	va_end(args);
+}
+
+
+
 /*********************************************************
  *      s_log()
  *********************************************************/
@@ -171,6 +333,9 @@ static void s_log(LOG log, const char *file, int line, const char *function,
 	if (log->size == -1)
 		return; /* log is set to a string literal (panic) */
 
+	if (log->ring_count)
+		s_flush_ring(log); /* keep messages in order */
+
 #ifdef DEBUG
 	if (!s_add_file_etc(log, file, line, function))
 		return;
@@ -233,7 +398,7 @@ static bool s_allocate(LOG log, size_t add_chars)
 		return false;
 	}
 
-	tmp = realloc(log->buffer, newsize);
+	tmp = cm_realloc(log->allocator, log->buffer, (size_t) log->size, newsize);
 	if (tmp) {
 		log->buffer = tmp;
 		if (log->size == 0)
@@ -22,6 +22,7 @@
 #define LOGGING_H
 
 typedef struct Log *LOG;
+struct BmpAllocator;
 
 
 #if defined(__GNUC__)
@@ -39,15 +40,24 @@ typedef struct Log *LOG;
 	#define logsyserr(log, ...) logsyserr_(log, __FILE__, __LINE__, __func__, __VA_ARGS__)
 	void PRINTF(5,6) logsyserr_(LOG log, const char *file, int line,
 			    const char *function, const char *fmt, ...);
+
+	#define logfixed(log, msg) logfixed_(log, __FILE__, __LINE__, __func__, msg)
+	void logfixed_(LOG log, const char *file, int line, const char *function, const char *msg);
+
+	#define logsysfixed(log, msg) logsysfixed_(log, __FILE__, __LINE__, __func__, msg)
+	void logsysfixed_(LOG log, const char *file, int line, const char *function, const char *msg);
 #else
 	void PRINTF(2,3) logerr(LOG log, const char *fmt, ...);
 	void PRINTF(2,3) logsyserr(LOG log, const char *fmt, ...);
+
+	void logfixed(LOG log, const char *msg);
+	void logsysfixed(LOG log, const char *msg);
 #endif
 
 
 const char* logmsg(LOG log);
 
-LOG logcreate(void);
+LOG logcreate(const struct BmpAllocator *allocator);
 void logfree(LOG log);
 void logreset(LOG log);
 